@@ -0,0 +1,394 @@
+#include <stdio.h> // perror, fprintf
+#include <stdlib.h> // calloc, free
+#include <string.h> // memset, memcpy, memcmp
+#include <endian.h> // htole16, le32toh and friends
+#include <fcntl.h> // open
+#include <unistd.h> // write, close, ftruncate
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include "capture.h"
+
+#define CAPTURE_TABLE_SIZE 256 // Initial number of slots of the address table of a writer (power of 2)
+
+/**
+ * Opens a capture file for appending, and starts a session: its record is the first one of the writer's buffer.
+ * A record left incomplete at the end of the file (by a run that was killed while writing) is cut off,
+ * so the new records stay aligned.
+ * @param writer Pointer to the writer.
+ * @param path Path of the capture file, created if it doesn't exist.
+ * @param tool The program capturing (CAPTURE_TOOL_*).
+ * @param flags Flags of the session (CAPTURE_MULTIPATH).
+ * @param size Payload size of the echo requests (ping) or size of the probes (traceroute).
+ * @param targets Number of targets of the run, or 0 if they aren't known upfront.
+ * @param timeout Time after which a probe without reply is given up, in milliseconds.
+ * @return 0 on success, or 1 on error.
+ */
+int capture_open(struct capture_writer *writer, const char *path, int tool, int flags, int size, int targets, int timeout)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->buffer.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (writer->buffer.fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    struct stat st;
+
+    if (fstat(writer->buffer.fd, &st) == 0 && st.st_size % CAPTURE_RECORD_SIZE != 0)
+    {
+        fprintf(stderr, "%s: cutting off an incomplete record at the end of the file\n", path);
+
+        if (ftruncate(writer->buffer.fd, st.st_size - st.st_size % CAPTURE_RECORD_SIZE) != 0)
+        {
+            perror("ftruncate(2)");
+            close(writer->buffer.fd);
+            return 1;
+        }
+    }
+
+    writer->table_size = CAPTURE_TABLE_SIZE;
+    writer->slots = calloc(writer->table_size, sizeof(struct capture_slot));
+
+    if (writer->slots == NULL)
+    {
+        perror("calloc(3)");
+        close(writer->buffer.fd);
+        return 1;
+    }
+
+    // The wall-clock start of the session, and the monotonic time the probe records count from, read together
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &writer->base);
+
+    struct capture_session *session = &writer->buffer.records[writer->buffer.count++].session;
+    session->kind = CAPTURE_SESSION;
+    session->version = CAPTURE_VERSION;
+    session->tool = tool;
+    session->flags = flags;
+    memcpy(session->magic, CAPTURE_MAGIC, sizeof(session->magic));
+    session->start = htole64((uint64_t)wall.tv_sec * 1000000000 + wall.tv_nsec);
+    session->size = htole32(size);
+    session->targets = htole32(targets);
+    session->timeout = htole32(timeout);
+    return 0;
+}
+
+/**
+ * Doubles the size of the address table of a writer.
+ * @param writer Pointer to the writer.
+ * @return 0 on success, or 1 on error.
+ */
+static int grow_table(struct capture_writer *writer)
+{
+    unsigned int size = writer->table_size * 2;
+    struct capture_slot *slots = calloc(size, sizeof(struct capture_slot));
+
+    if (slots == NULL)
+    {
+        perror("calloc(3)");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < writer->table_size; i++)
+    {
+        const struct net_addr *addr = &writer->slots[i].addr;
+
+        if (addr->type == 0)
+            continue;
+
+        unsigned int slot = hash_address(addr->type, address_bytes(addr)) & (size - 1);
+
+        while (slots[slot].addr.type != 0)
+            slot = (slot + 1) & (size - 1);
+
+        slots[slot] = writer->slots[i];
+    }
+
+    free(writer->slots);
+    writer->slots = slots;
+    writer->table_size = size;
+    return 0;
+}
+
+/**
+ * Gets the index the probe records refer to an address with. The first time an address is seen, it's given
+ * the next index and its record is appended to the writer's buffer. Only the thread that owns the writer calls it.
+ * @param writer Pointer to the writer.
+ * @param addr Pointer to the address.
+ * @return The index of the address, or CAPTURE_NONE on error.
+ */
+unsigned int capture_address(struct capture_writer *writer, const struct net_addr *addr)
+{
+    const void *bytes = address_bytes(addr);
+    unsigned int slot = hash_address(addr->type, bytes) & (writer->table_size - 1);
+
+    while (writer->slots[slot].addr.type != 0)
+    {
+        if (same_address(&writer->slots[slot].addr, addr->type, bytes))
+            return writer->slots[slot].index;
+
+        slot = (slot + 1) & (writer->table_size - 1);
+    }
+
+    // Keep the table at most 3/4 full, so the probe sequences stay short
+    if ((writer->num_addresses + 1) * 4 > writer->table_size * 3)
+    {
+        if (grow_table(writer) != 0)
+            return CAPTURE_NONE;
+
+        slot = hash_address(addr->type, bytes) & (writer->table_size - 1);
+
+        while (writer->slots[slot].addr.type != 0)
+            slot = (slot + 1) & (writer->table_size - 1);
+    }
+
+    writer->slots[slot].addr = *addr;
+    writer->slots[slot].index = writer->num_addresses++;
+
+    if (writer->buffer.count == CAPTURE_BUFFER)
+        capture_flush(&writer->buffer);
+
+    struct capture_address *record = &writer->buffer.records[writer->buffer.count++].address;
+    memset(record, 0, sizeof(*record));
+    record->kind = CAPTURE_ADDRESS;
+    record->type = addr->type;
+    record->index = htole32(writer->slots[slot].index);
+    memcpy(record->bytes, bytes, address_size(addr->type));
+    return writer->slots[slot].index;
+}
+
+/**
+ * Converts a monotonic time to the time of a probe record.
+ * @param writer Pointer to the writer.
+ * @param monotonic Pointer to the monotonic time.
+ * @return The time in nanoseconds since the start of the session (0 for a time before it).
+ */
+uint64_t capture_time(const struct capture_writer *writer, const struct timespec *monotonic)
+{
+    int64_t ns = (int64_t)(monotonic->tv_sec - writer->base.tv_sec) * 1000000000 + (monotonic->tv_nsec - writer->base.tv_nsec);
+    return (ns > 0) ? (uint64_t)ns : 0;
+}
+
+/**
+ * Prepares the buffer of a thread that appends probe records to the file of a writer.
+ * @param buffer Pointer to the buffer.
+ * @param writer Pointer to the writer.
+ */
+void capture_buffer_init(struct capture_buffer *buffer, const struct capture_writer *writer)
+{
+    buffer->fd = writer->buffer.fd;
+    buffer->count = 0;
+}
+
+/**
+ * Appends a probe record to a buffer, writing the buffer out first if it's full.
+ * @param buffer Pointer to the buffer.
+ * @param outcome Pointer to the outcome of the probe.
+ */
+void capture_probe(struct capture_buffer *buffer, const struct probe_outcome *outcome)
+{
+    if (buffer->count == CAPTURE_BUFFER)
+        capture_flush(buffer);
+
+    struct capture_probe *record = &buffer->records[buffer->count++].probe;
+    uint64_t rtt = (outcome->rtt >= 0) ? (uint64_t)(outcome->rtt * (1000000.0 / CAPTURE_RTT_UNIT) + 0.5) : CAPTURE_NONE;
+
+    if (outcome->rtt >= 0 && rtt >= CAPTURE_NONE)
+        rtt = CAPTURE_NONE - 1; // Saturates past 42 seconds
+
+    record->kind = CAPTURE_PROBE;
+    record->outcome = outcome->outcome;
+    record->flags = (outcome->source & CAPTURE_SOURCE_MASK) | (outcome->bad_checksum ? CAPTURE_BAD_CHECKSUM : 0);
+    record->ttl = (outcome->ttl > 0) ? outcome->ttl : 0;
+    record->target = htole32(outcome->target);
+    record->responder = htole32(outcome->responder);
+    record->seq = htole32(outcome->seq);
+    record->sent = htole64(outcome->sent);
+    record->rtt = htole32(rtt);
+    record->size = htole16(outcome->size);
+    record->type = outcome->type;
+    record->code = outcome->code;
+}
+
+/**
+ * Writes the records of a buffer to the file, in one system call so the records of the other threads can't land
+ * in the middle of them. After an error the buffer drops its records, and the program goes on without them.
+ * @param buffer Pointer to the buffer.
+ * @return 0 on success, or 1 on error.
+ */
+int capture_flush(struct capture_buffer *buffer)
+{
+    size_t length = buffer->count * sizeof(union capture_record);
+    buffer->count = 0;
+
+    if (buffer->fd < 0)
+        return 1;
+
+    if (length == 0)
+        return 0;
+
+    ssize_t written = write(buffer->fd, buffer->records, length);
+
+    if (written != (ssize_t)length)
+    {
+        if (written < 0)
+            perror("capture write(2)");
+
+        else
+            fprintf(stderr, "capture write(2): short write, the capture stops here\n");
+
+        buffer->fd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes out the writer's buffer and closes the capture file. The other threads' buffers must be flushed first.
+ * @param writer Pointer to the writer.
+ * @return 0 on success, or 1 if some records couldn't be written.
+ */
+int capture_close(struct capture_writer *writer)
+{
+    int fd = writer->buffer.fd;
+    int ret = capture_flush(&writer->buffer);
+
+    if (fd >= 0 && close(fd) != 0)
+    {
+        perror("close(2)");
+        ret = 1;
+    }
+
+    free(writer->slots);
+    writer->slots = NULL;
+    return ret;
+}
+
+/**
+ * Maps a capture file in memory for reading, and checks that it starts with a session of a version we read.
+ * A record left incomplete at the end of the file is ignored.
+ * @param path Path of the capture file.
+ * @param file Pointer to the structure receiving the mapping.
+ * @return 0 on success, or 1 on error.
+ */
+int capture_map(const char *path, struct capture_file *file)
+{
+    memset(file, 0, sizeof(*file));
+    file->path = path;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(path);
+
+        if (fd >= 0)
+            close(fd);
+
+        return 1;
+    }
+
+    file->count = st.st_size / CAPTURE_RECORD_SIZE;
+
+    if (file->count == 0)
+    {
+        close(fd);
+        return 0; // Nothing was captured yet
+    }
+
+    file->length = st.st_size;
+    void *records = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (records == MAP_FAILED)
+    {
+        perror("mmap(2)");
+        return 1;
+    }
+
+    madvise(records, file->length, MADV_SEQUENTIAL); // Read ahead, and drop the pages behind
+    file->records = records;
+
+    const struct capture_session *session = &file->records[0].session;
+
+    if (session->kind != CAPTURE_SESSION || memcmp(session->magic, CAPTURE_MAGIC, sizeof(session->magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        capture_unmap(file);
+        return 1;
+    }
+
+    if (session->version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s: unsupported capture version %d\n", path, session->version);
+        capture_unmap(file);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Unmaps a capture file.
+ * @param file Pointer to the mapping.
+ */
+void capture_unmap(struct capture_file *file)
+{
+    if (file->records != NULL)
+        munmap((void *)file->records, file->length);
+
+    file->records = NULL;
+    file->count = 0;
+}
+
+/**
+ * Decodes an address record.
+ * @param record Pointer to the record.
+ * @param addr Pointer to the address receiving it.
+ */
+void capture_decode_address(const struct capture_address *record, struct net_addr *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->type = (record->type == 6) ? 6 : 4;
+    addr->sa.sa_family = (addr->type == 6) ? AF_INET6 : AF_INET;
+    memcpy((void *)address_bytes(addr), record->bytes, address_size(addr->type));
+}
+
+/**
+ * Decodes a probe record.
+ * @param record Pointer to the record.
+ * @param outcome Pointer to the outcome receiving it.
+ */
+void capture_decode_probe(const struct capture_probe *record, struct probe_outcome *outcome)
+{
+    uint32_t rtt = le32toh(record->rtt);
+
+    outcome->outcome = record->outcome;
+    outcome->source = record->flags & CAPTURE_SOURCE_MASK;
+    outcome->bad_checksum = (record->flags & CAPTURE_BAD_CHECKSUM) != 0;
+    outcome->ttl = record->ttl;
+    outcome->target = le32toh(record->target);
+    outcome->responder = le32toh(record->responder);
+    outcome->seq = le32toh(record->seq);
+    outcome->sent = le64toh(record->sent);
+    outcome->rtt = (rtt != CAPTURE_NONE) ? rtt * (CAPTURE_RTT_UNIT / 1000000.0) : -1;
+    outcome->size = le16toh(record->size);
+    outcome->type = record->type;
+    outcome->code = record->code;
+}
+
+/**
+ * Gets the name of an outcome.
+ * @param outcome The outcome (OUTCOME_*).
+ * @return The name of the outcome.
+ */
+const char *outcome_name(int outcome)
+{
+    static const char *names[] = {"reply", "reordered", "duplicate", "late", "corrupted", "timeout", "unanswered"};
+    return (outcome >= 0 && outcome < (int)(sizeof(names) / sizeof(names[0]))) ? names[outcome] : "unknown";
+}
@@ -0,0 +1,165 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "netaddr.h"
+
+// Capture files (-w): an append-only sequence of fixed-size records, little-endian whatever the host.
+// Each run appends a session record, then an address record the first time an address is used, then one probe
+// record per outcome. The address indexes and the times of the probe records are relative to their session,
+// so runs can be appended to the same file and files can be merged (see probedump).
+#define CAPTURE_MAGIC "PRBC" // Magic of the session records
+#define CAPTURE_VERSION 1 // Version of the format
+#define CAPTURE_RECORD_SIZE 32 // Size of every record, in bytes
+#define CAPTURE_BUFFER 2048 // Records buffered before they're written, 64 KiB
+#define CAPTURE_RTT_UNIT 10 // nanoseconds, resolution of the round-trip times
+#define CAPTURE_NONE 0xFFFFFFFF // No address (no responder) or no sequence number
+
+// Kinds of records
+#define CAPTURE_SESSION 1 // Start of a run
+#define CAPTURE_ADDRESS 2 // An address, and the index the probe records refer to it with
+#define CAPTURE_PROBE 3 // The outcome of a probe
+
+// Programs a session was captured by
+#define CAPTURE_TOOL_PING 1
+#define CAPTURE_TOOL_TRACEROUTE 2
+
+// Flags of a session
+#define CAPTURE_MULTIPATH 0x01 // traceroute -m: the probes of a hop are flows over the load-balanced paths
+
+// Outcomes of a probe
+#define OUTCOME_REPLY 0 // Answered, in order (traceroute: answered, by an ICMP error or the echo reply)
+#define OUTCOME_REORDERED 1 // Answered after a later probe of the same target
+#define OUTCOME_DUPLICATE 2 // Another reply to a probe that was already answered
+#define OUTCOME_LATE 3 // A reply to a probe that had already timed out
+#define OUTCOME_CORRUPTED 4 // A reply whose checksum, size or payload doesn't match the request
+#define OUTCOME_TIMEOUT 5 // No reply within the timeout
+#define OUTCOME_UNANSWERED 6 // Still waiting for its reply when the run ended
+
+// Flags of a probe record
+#define CAPTURE_SOURCE_MASK 0x03 // TS_SOURCE_* of the round-trip time
+#define CAPTURE_BAD_CHECKSUM 0x04 // The corrupted reply failed its checksum (rather than the payload check)
+
+// Record starting a session (CAPTURE_SESSION)
+struct capture_session
+{
+    uint8_t kind;
+    uint8_t version; // CAPTURE_VERSION
+    uint8_t tool; // CAPTURE_TOOL_*
+    uint8_t flags; // CAPTURE_MULTIPATH
+    char magic[4]; // CAPTURE_MAGIC
+    uint64_t start; // Wall-clock time the session started, in nanoseconds since the epoch
+    uint32_t size; // Payload size of the echo requests (ping) or size of the probes (traceroute), in bytes
+    uint32_t targets; // Number of targets of the run (ping), or 0 if they aren't known upfront
+    uint32_t timeout; // Time after which a probe without reply is given up, in milliseconds
+    uint8_t reserved[4];
+};
+
+// Record naming an address (CAPTURE_ADDRESS)
+struct capture_address
+{
+    uint8_t kind;
+    uint8_t type; // IP type (4 or 6)
+    uint16_t reserved;
+    uint32_t index; // Index of the address in the session
+    uint8_t bytes[16]; // The address, in network byte order (the first 4 bytes for IPv4)
+    uint8_t reserved2[8];
+};
+
+// Record of the outcome of a probe (CAPTURE_PROBE)
+struct capture_probe
+{
+    uint8_t kind;
+    uint8_t outcome; // OUTCOME_*
+    uint8_t flags; // CAPTURE_SOURCE_MASK, CAPTURE_BAD_CHECKSUM
+    uint8_t ttl; // TTL of the reply (ping), or of the probe (traceroute)
+    uint32_t target; // Index of the address of the target
+    uint32_t responder; // Index of the address that replied, or CAPTURE_NONE
+    uint32_t seq; // Sequence number of the probe as printed (ping), or its number in the hop (traceroute), or CAPTURE_NONE
+    uint64_t sent; // Time the probe was sent, in nanoseconds since the start of the session
+    uint32_t rtt; // Round-trip time, in units of CAPTURE_RTT_UNIT, or CAPTURE_NONE
+    uint16_t size; // Size of the ICMP reply, in bytes (ping), or 0
+    uint8_t type; // ICMP type of the reply
+    uint8_t code; // ICMP code of the reply
+};
+
+// A record of any kind
+union capture_record
+{
+    uint8_t kind; // CAPTURE_SESSION, CAPTURE_ADDRESS or CAPTURE_PROBE
+    struct capture_session session;
+    struct capture_address address;
+    struct capture_probe probe;
+};
+
+_Static_assert(sizeof(union capture_record) == CAPTURE_RECORD_SIZE, "capture records must be 32 bytes");
+
+// Structure to hold the outcome of a probe, in host byte order
+struct probe_outcome
+{
+    int outcome; // OUTCOME_*
+    int source; // TS_SOURCE_* of the round-trip time
+    int bad_checksum; // Whether a corrupted reply failed its checksum
+    int ttl; // TTL of the reply (ping), or of the probe (traceroute)
+    unsigned int target; // Index of the address of the target
+    unsigned int responder; // Index of the address that replied, or CAPTURE_NONE
+    unsigned int seq; // Sequence number, or CAPTURE_NONE
+    uint64_t sent; // Time the probe was sent, in nanoseconds since the start of the session
+    double rtt; // Round-trip time in milliseconds, or -1 without one
+    int size; // Size of the ICMP reply (ping), or 0
+    int type; // ICMP type of the reply
+    int code; // ICMP code of the reply
+};
+
+// Structure to hold records waiting to be written. Each thread appending probe records has its own, and writes
+// whole buffers to the file, which is opened with O_APPEND so the buffers of the threads never overlap.
+struct capture_buffer
+{
+    int fd; // The capture file, or -1 once writing to it failed
+    int count; // Number of records in the buffer
+    union capture_record records[CAPTURE_BUFFER];
+};
+
+// Structure to hold an address given an index, in the hash table of a writer
+struct capture_slot
+{
+    struct net_addr addr; // The address (type 0 for an empty slot)
+    unsigned int index; // Its index in the session
+};
+
+// Structure to hold a capture file being written
+struct capture_writer
+{
+    struct timespec base; // Monotonic time the session started, which the times of the probe records count from
+    struct capture_slot *slots; // Hash table of the addresses given an index
+    unsigned int table_size; // Number of slots in the hash table (power of 2)
+    unsigned int num_addresses; // Number of addresses given an index
+    struct capture_buffer buffer; // Records of the thread that owns the writer (session, addresses, its probes)
+};
+
+// Structure to hold a capture file mapped in memory for reading
+struct capture_file
+{
+    const char *path;
+    const union capture_record *records;
+    size_t count; // Number of records
+    size_t length; // Size of the mapping, in bytes
+};
+
+// Function declarations
+int capture_open(struct capture_writer *writer, const char *path, int tool, int flags, int size, int targets, int timeout);
+unsigned int capture_address(struct capture_writer *writer, const struct net_addr *addr);
+uint64_t capture_time(const struct capture_writer *writer, const struct timespec *monotonic);
+void capture_buffer_init(struct capture_buffer *buffer, const struct capture_writer *writer);
+void capture_probe(struct capture_buffer *buffer, const struct probe_outcome *outcome);
+int capture_flush(struct capture_buffer *buffer);
+int capture_close(struct capture_writer *writer);
+int capture_map(const char *path, struct capture_file *file);
+void capture_unmap(struct capture_file *file);
+void capture_decode_address(const struct capture_address *record, struct net_addr *addr);
+void capture_decode_probe(const struct capture_probe *record, struct probe_outcome *outcome);
+const char *outcome_name(int outcome);
+
+#endif // _CAPTURE_H
@@ -0,0 +1,277 @@
+#include <stdio.h> // fprintf
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, memset
+#include <pthread.h> // pthread_once
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2 and AVX2 intrinsics
+#define CHECKSUM_X86 1
+#endif
+
+#define SELF_TEST_SIZE 4096 // Size of the buffer the SIMD kernels are checked against the scalar one with
+#define SELF_TEST_LARGE (2 * 1024 * 1024) // Size of the all-ones buffer that fills the 32-bit lanes of the kernels
+#define LANE_ITERATIONS 32768 // Iterations of a SIMD kernel after which its 32-bit lanes are added to the sum
+
+// Signature of the summing kernels: add the 16-bit words of the data to a 64-bit one's complement sum
+typedef unsigned long long (*checksum_kernel)(unsigned long long sum, const void *data, size_t bytes);
+
+static checksum_kernel vector_kernel = NULL; // Kernel used for large buffers, chosen once on the first call
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT; // Chooses the kernel once, whichever thread calls first
+
+/**
+ * Adds the 16-bit words of the data to a one's complement sum, one word at a time.
+ * This is the reference implementation the SIMD kernels are checked against.
+ * The words are summed in host byte order (RFC 1071), and an odd last byte is padded with a zero byte.
+ * @param sum The sum so far.
+ * @param data Pointer to the data.
+ * @param bytes The number of bytes in the data.
+ * @return The new sum, not folded.
+ */
+unsigned long long checksum_add_scalar(unsigned long long sum, const void *data, size_t bytes)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned short word;
+
+    // Main summing loop. memcpy keeps the loads legal for unaligned data and compiles to plain loads.
+    while (bytes > 1)
+    {
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+        p += 2;
+        bytes -= 2;
+    }
+
+    // Add left-over byte, if any, padded with a zero byte.
+    if (bytes > 0)
+    {
+        unsigned char last[2] = {*p, 0};
+        memcpy(&word, last, sizeof(word));
+        sum += word;
+    }
+
+    return sum;
+}
+
+#ifdef CHECKSUM_X86
+/**
+ * SSE2 kernel: sums 16 bytes per iteration.
+ * The 16-bit words are widened into 32-bit lanes. Each lane gets two words per iteration, at most 131070,
+ * so it can't overflow within a block of LANE_ITERATIONS iterations, and each block is then added to the 64-bit sum.
+ */
+static unsigned long long checksum_add_sse2(unsigned long long sum, const void *data, size_t bytes)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const __m128i zero = _mm_setzero_si128();
+
+    while (bytes >= 16)
+    {
+        size_t blocks = bytes / 16;
+        blocks = (blocks > LANE_ITERATIONS) ? LANE_ITERATIONS : blocks;
+        __m128i acc = _mm_setzero_si128();
+
+        for (size_t i = 0; i < blocks; i++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            p += 16;
+        }
+
+        unsigned int lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        bytes -= blocks * 16;
+    }
+
+    return checksum_add_scalar(sum, p, bytes);
+}
+
+/**
+ * AVX2 kernel: sums 32 bytes per iteration, the same way as the SSE2 kernel.
+ */
+__attribute__((target("avx2")))
+static unsigned long long checksum_add_avx2(unsigned long long sum, const void *data, size_t bytes)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (bytes >= 32)
+    {
+        size_t blocks = bytes / 32;
+        blocks = (blocks > LANE_ITERATIONS) ? LANE_ITERATIONS : blocks;
+        __m256i acc = _mm256_setzero_si256();
+
+        for (size_t i = 0; i < blocks; i++)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            p += 32;
+        }
+
+        unsigned int lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+
+        for (int i = 0; i < 8; i++)
+            sum += lanes[i];
+
+        bytes -= blocks * 32;
+    }
+
+    return checksum_add_sse2(sum, p, bytes);
+}
+#endif
+
+/**
+ * Checks a SIMD kernel against the scalar one, for all the lengths and alignments of a pseudo-random buffer
+ * up to a few vectors, for a large one, and for a buffer of all ones large enough to fill its 32-bit lanes.
+ * @param kernel The kernel to check.
+ * @return 1 if the kernel agrees with the scalar one, 0 otherwise.
+ */
+static int self_test(checksum_kernel kernel)
+{
+    static unsigned char buffer[SELF_TEST_SIZE + 64];
+    unsigned int seed = 12345;
+
+    for (size_t i = 0; i < sizeof(buffer); i++)
+    {
+        seed = seed * 1103515245 + 12345; // Linear congruential generator, good enough for test data
+        buffer[i] = seed >> 16;
+    }
+
+    for (size_t offset = 0; offset < 32; offset++)
+    {
+        for (size_t len = 0; len <= 256; len++)
+        {
+            if (checksum_fold(kernel(0, buffer + offset, len)) != checksum_fold(checksum_add_scalar(0, buffer + offset, len)))
+                return 0;
+        }
+
+        if (checksum_fold(kernel(0, buffer + offset, SELF_TEST_SIZE)) != checksum_fold(checksum_add_scalar(0, buffer + offset, SELF_TEST_SIZE)))
+            return 0;
+    }
+
+    unsigned char *ones = malloc(SELF_TEST_LARGE);
+
+    if (ones == NULL)
+        return 0;
+
+    memset(ones, 0xFF, SELF_TEST_LARGE);
+    int same = (checksum_fold(kernel(0, ones, SELF_TEST_LARGE)) == checksum_fold(checksum_add_scalar(0, ones, SELF_TEST_LARGE)));
+    free(ones);
+    return same;
+}
+
+/**
+ * Chooses the fastest kernel the CPU supports. A kernel that disagrees with the scalar reference is never used.
+ */
+static void choose_kernel(void)
+{
+    vector_kernel = checksum_add_scalar;
+
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && self_test(checksum_add_avx2))
+    {
+        vector_kernel = checksum_add_avx2;
+    }
+
+    else if (__builtin_cpu_supports("sse2") && self_test(checksum_add_sse2))
+    {
+        vector_kernel = checksum_add_sse2;
+    }
+
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        fprintf(stderr, "Warning: the SIMD checksum doesn't match the scalar one, using the scalar checksum\n");
+    }
+#endif
+}
+
+/**
+ * Adds the 16-bit words of the data to a one's complement sum, using a SIMD kernel for large buffers.
+ * Sums of consecutive pieces can be chained, as long as every piece but the last one has an even size.
+ * @param sum The sum so far (0 to start).
+ * @param data Pointer to the data.
+ * @param bytes The number of bytes in the data.
+ * @return The new sum, not folded.
+ */
+unsigned long long checksum_add(unsigned long long sum, const void *data, size_t bytes)
+{
+    if (bytes < CHECKSUM_VECTOR_MIN)
+        return checksum_add_scalar(sum, data, bytes);
+
+    pthread_once(&kernel_once, choose_kernel); // The worker threads may race to the first large checksum
+
+    return vector_kernel(sum, data, bytes);
+}
+
+/**
+ * Folds a 64-bit one's complement sum into 16 bits.
+ * @param sum The sum.
+ * @return The folded sum (not complemented).
+ */
+unsigned short checksum_fold(unsigned long long sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (unsigned short)sum;
+}
+
+/**
+ * Calculates the Internet checksum (RFC 1071) of the given data.
+ * @param data Pointer to the data for which the checksum is to be calculated.
+ * @param bytes The number of bytes in the data.
+ * @return The checksum, ready to be stored in the packet.
+ */
+unsigned short calculate_checksum(const void *data, size_t bytes)
+{
+    return ~checksum_fold(checksum_add(0, data, bytes));
+}
+
+/**
+ * Updates a checksum after a 16-bit word of the data changed, without summing the data again (RFC 1624, eqn. 3).
+ * Both words are taken as they are stored in the packet.
+ * @param checksum The checksum stored in the packet.
+ * @param old_word The old value of the word.
+ * @param new_word The new value of the word.
+ * @return The new checksum.
+ */
+unsigned short checksum_update16(unsigned short checksum, unsigned short old_word, unsigned short new_word)
+{
+    // HC' = ~(~HC + ~m + m')
+    unsigned int sum = (unsigned short)~checksum + (unsigned short)~old_word + new_word;
+    return ~checksum_fold(sum);
+}
+
+/**
+ * Updates a checksum after a piece of the data changed (RFC 1624). The piece must start at an even offset.
+ * @param checksum The checksum stored in the packet.
+ * @param old_data Pointer to the old contents of the piece.
+ * @param new_data Pointer to the new contents of the piece.
+ * @param bytes The size of the piece.
+ * @return The new checksum.
+ */
+unsigned short checksum_update(unsigned short checksum, const void *old_data, const void *new_data, size_t bytes)
+{
+    // Subtracting in one's complement is adding the complement: ~HC' = ~HC - old + new = ~HC + ~old + new
+    unsigned long long old_sum = checksum_fold(checksum_add(0, old_data, bytes));
+    unsigned long long sum = (unsigned short)~checksum + (unsigned short)~old_sum;
+    return ~checksum_fold(checksum_add(sum, new_data, bytes));
+}
+
+/**
+ * Computes the word to store in a zeroed 16-bit word of the data, so that its checksum becomes a chosen value.
+ * This keeps the checksum constant while other fields change, e.g. for flow-stable probes (Paris traceroute).
+ * @param checksum The checksum of the data, with the word zeroed.
+ * @param target The checksum wanted, as it is stored in the packet.
+ * @return The word to store, as it is stored in the packet.
+ */
+unsigned short checksum_balance(unsigned short checksum, unsigned short target)
+{
+    // ~target = ~checksum + word, so word = ~target - ~checksum = ~target + checksum
+    return checksum_fold((unsigned short)~target + (unsigned int)checksum);
+}
@@ -0,0 +1,17 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <stddef.h>
+
+#define CHECKSUM_VECTOR_MIN 128 // Minimum size in bytes for which the SIMD kernels are used
+
+// Function declarations
+unsigned short calculate_checksum(const void *data, size_t bytes);
+unsigned long long checksum_add(unsigned long long sum, const void *data, size_t bytes);
+unsigned long long checksum_add_scalar(unsigned long long sum, const void *data, size_t bytes);
+unsigned short checksum_fold(unsigned long long sum);
+unsigned short checksum_update16(unsigned short checksum, unsigned short old_word, unsigned short new_word);
+unsigned short checksum_update(unsigned short checksum, const void *old_data, const void *new_data, size_t bytes);
+unsigned short checksum_balance(unsigned short checksum, unsigned short target);
+
+#endif // _CHECKSUM_H
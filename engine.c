@@ -0,0 +1,1068 @@
+#define _GNU_SOURCE // For sendmmsg and recvmmsg
+#include <stdio.h> // perror, fprintf
+#include <stdlib.h> // calloc, realloc, free
+#include <string.h> // memset, memcpy, strcmp
+#include <errno.h> // EAGAIN, ENOBUFS, EINTR, ETIME, EMSGSIZE
+#include <poll.h> // poll
+#include <unistd.h> // close, syscall
+#include <sys/mman.h> // mmap, munmap
+#include <sys/syscall.h> // __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register
+#include <sys/timerfd.h> // Deadline of the poll backend
+#include <linux/io_uring.h> // io_uring structures, used through the raw system calls (no liburing)
+#include "engine.h"
+#include "instrument.h" // Stage timers, counters and USDT probes
+
+// The engine hides how the probes are sent and the replies received, so ping and traceroute run the same loop
+// over either backend: queue sends, wait until a deadline, then read the received packets and the ready fds.
+// The poll backend flushes the queued sends with one sendmmsg(2) per socket and reads with recvmmsg(2).
+// The io_uring backend submits the sends and waits in a single io_uring_enter(2) call, and its multishot
+// receives fill a ring of provided buffers without any system call per packet.
+// The state is per thread, so each worker thread of ping runs its own engine over its own sockets.
+
+#define ENGINE_NAME_SIZE sizeof(struct sockaddr_in6) // Room for the source address of a received packet
+#define ENGINE_SEND 1 // Kinds of completions, in the upper half of their user data
+#define ENGINE_RECV 2
+#define ENGINE_POLLED 3
+
+// Structure to hold a send waiting to be flushed (poll) or completed (io_uring)
+struct send_slot
+{
+    char *data; // Copy of the packet
+    size_t capacity; // Size of the copy's buffer, grown to the largest packet sent through the slot so far
+    struct sockaddr_in6 name; // Copy of the destination address
+    char control[CMSG_SPACE(sizeof(int))]; // Copy of the control message (TTL / hop limit)
+    struct iovec iov; // I/O vector of the packet
+    int sock; // Socket to send the packet through
+    unsigned int tag; // Tag of the packet, given back by engine_tx_tag for its transmit timestamp
+};
+
+// Structure to hold the state of the io_uring backend
+struct uring
+{
+    int fd; // The io_uring file descriptor
+    void *sq_ring, *cq_ring; // Mapped submission and completion rings
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes; // Mapped submission queue entries
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; // Fields of the submission ring
+    unsigned *cq_head, *cq_tail, *cq_mask; // Fields of the completion ring
+    struct io_uring_cqe *cqes; // Completion queue entries
+    unsigned sq_entries; // Size of the submission ring
+    unsigned to_submit; // Entries queued since the last io_uring_enter(2) call
+
+    struct io_uring_buf_ring *buf_ring; // Ring of the provided receive buffers
+    char *buffers; // The receive buffers, buffer_size bytes each
+    unsigned num_buffers; // Number of receive buffers (power of 2)
+    unsigned short buf_tail; // Tail of the buffer ring
+    struct msghdr recv_msg; // Template of the multishot receives: sizes of the source address and control messages
+    int recycle; // Buffer of the packet last returned by engine_receive, to give back to the ring (-1 for none)
+
+    int *free_slots; // Stack of the free send slots
+    int num_free;
+    struct io_uring_cqe *packets; // Completions of the received packets, not yet returned by engine_receive
+    int num_packets, next_packet;
+    int rearm[ENGINE_MAX_FDS]; // Whether the multishot receive / poll of each fd must be submitted again
+};
+
+static __thread int backend = ENGINE_POLL; // Backend in use
+static __thread int batch_size = 1; // Sends per sendmmsg(2) and packets per recvmmsg(2) call
+static __thread int watched[ENGINE_MAX_FDS]; // Watched file descriptors
+static __thread int watched_socket[ENGINE_MAX_FDS]; // Whether each of them is a socket whose packets are received
+static __thread int readable[ENGINE_MAX_FDS]; // Whether each of them has packets to read (poll backend)
+static __thread int ready[ENGINE_MAX_FDS]; // Whether each of them is ready (error queue of a socket, POLLIN otherwise)
+static __thread int num_watched = 0;
+static __thread int timer_fd = -1; // Deadline of the poll backend, with a microsecond resolution
+static __thread int buffer_size = 0; // Room for a received packet, its source address and its control messages
+static __thread unsigned long dropped = 0; // Sends that failed because the transmit queue was full
+static __thread unsigned long oversized = 0; // Sends refused because they exceed the MTU and mustn't be fragmented
+static __thread int send_error = 0; // errno of the last send that failed for another reason, reported by engine_wait
+static __thread unsigned int socket_drops[ENGINE_MAX_FDS]; // Packets each watched socket dropped so far (SO_RXQ_OVFL)
+static __thread unsigned int tx_keys[ENGINE_MAX_FDS]; // Packets each watched socket accepted so far (SOF_TIMESTAMPING_OPT_ID)
+static __thread unsigned int *tx_tags = NULL; // Tags of the last ENGINE_TX_TAGS packets each watched socket accepted
+
+static __thread struct send_slot *slots = NULL; // Send slots
+static __thread struct mmsghdr *send_msgs = NULL; // Messages of the send slots
+static __thread struct mmsghdr *batch_msgs = NULL; // Messages of one sendmmsg(2) call, gathered from the send slots
+static __thread int num_queued = 0; // Sends queued (poll backend)
+
+static __thread char *recv_buffers = NULL; // Receive buffers of the poll backend
+static __thread struct mmsghdr *recv_msgs = NULL; // Messages of the receive buffers
+static __thread struct iovec *recv_iovs = NULL; // I/O vectors of the receive buffers
+static __thread struct timespec recv_time; // Time the last batch was received
+static __thread int num_received = 0, next_received = 0, draining = 0; // Batch being returned, and the socket it came from
+
+static __thread struct uring ring;
+
+/**
+ * Converts a monotonic time in milliseconds to a timespec.
+ * @param ms The time in milliseconds.
+ * @param ts Pointer to the timespec to fill.
+ */
+static void ms_to_timespec(double ms, struct timespec *ts)
+{
+    ts->tv_sec = (time_t)(ms / 1000);
+    ts->tv_nsec = (long)((ms - ts->tv_sec * 1000.0) * 1000000);
+
+    if (ts->tv_nsec < 0)
+        ts->tv_nsec = 0;
+
+    if (ts->tv_nsec > 999999999)
+        ts->tv_nsec = 999999999;
+}
+
+/**
+ * Finds the index of a watched file descriptor.
+ * @param fd The file descriptor.
+ * @return The index, or -1 if it isn't watched.
+ */
+static int find_watched(int fd)
+{
+    for (int i = 0; i < num_watched; i++)
+    {
+        if (watched[i] == fd)
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Gets the next free submission queue entry of the io_uring, submitting the queued ones if the ring is full.
+ * @return Pointer to the zeroed entry, or NULL if the ring stays full.
+ */
+static struct io_uring_sqe *get_sqe(void)
+{
+    unsigned tail = *ring.sq_tail;
+
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+    {
+        uint64_t start = STAGE_START();
+
+        self_stats.counters[COUNTER_SYSCALLS]++;
+
+        if (syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 0, 0, NULL, 0) >= 0)
+            ring.to_submit = 0;
+
+        STAGE_END(STAGE_SEND, start);
+
+        if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+            return NULL;
+    }
+
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+    return sqe;
+}
+
+/**
+ * Submits a multishot receive on a watched socket, into the provided buffers.
+ * @param index The index of the socket.
+ * @return 0 on success, or 1 if the submission queue is full.
+ */
+static int arm_receive(int index)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if (sqe == NULL)
+        return 1;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = watched[index];
+    sqe->addr = (unsigned long)&ring.recv_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = ((unsigned long long)ENGINE_RECV << 32) | index;
+    ring.rearm[index] = 0;
+    return 0;
+}
+
+/**
+ * Submits a multishot poll on a watched fd: for the error queue of a socket (transmit timestamps), for input otherwise.
+ * @param index The index of the fd.
+ * @return 0 on success, or 1 if the submission queue is full.
+ */
+static int arm_poll(int index)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if (sqe == NULL)
+        return 1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watched[index];
+    sqe->poll32_events = watched_socket[index] ? POLLERR : POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ((unsigned long long)ENGINE_POLLED << 32) | index;
+    return 0;
+}
+
+/**
+ * Gives a receive buffer back to the buffer ring.
+ * @param bid The buffer ID.
+ */
+static void recycle_buffer(int bid)
+{
+    struct io_uring_buf *buf = &ring.buf_ring->bufs[ring.buf_tail & (ring.num_buffers - 1)];
+
+    buf->addr = (unsigned long)(ring.buffers + (size_t)bid * buffer_size);
+    buf->len = buffer_size;
+    buf->bid = bid;
+    __atomic_store_n(&ring.buf_ring->tail, ++ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frees the io_uring and everything attached to it.
+ */
+static void close_uring(void)
+{
+    if (ring.buf_ring != NULL)
+        munmap(ring.buf_ring, ring.num_buffers * sizeof(struct io_uring_buf));
+
+    if (ring.sqes != NULL)
+        munmap(ring.sqes, ring.sq_entries * sizeof(struct io_uring_sqe));
+
+    if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring)
+        munmap(ring.cq_ring, ring.cq_ring_size);
+
+    if (ring.sq_ring != NULL)
+        munmap(ring.sq_ring, ring.sq_ring_size);
+
+    if (ring.fd >= 0)
+        close(ring.fd);
+
+    free(ring.buffers);
+    free(ring.free_slots);
+    free(ring.packets);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/**
+ * Sets up the io_uring: the rings, the provided receive buffers and the send slots.
+ * @return 0 on success, or 1 if io_uring isn't available (the caller falls back to poll).
+ */
+static int open_uring(void)
+{
+    struct io_uring_params params;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    ring.recycle = -1;
+
+    // Only this thread submits, and completions are processed when it waits (no interrupts of the task)
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = 4 * ENGINE_RING_ENTRIES;
+    ring.fd = syscall(__NR_io_uring_setup, ENGINE_RING_ENTRIES, &params);
+
+    if (ring.fd < 0 && errno == EINVAL)
+    {
+        // Older kernels: without the single issuer optimizations
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = 4 * ENGINE_RING_ENTRIES;
+        ring.fd = syscall(__NR_io_uring_setup, ENGINE_RING_ENTRIES, &params);
+    }
+
+    if (ring.fd < 0 || !(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close_uring();
+        return 1;
+    }
+
+    // Map the rings (one mapping for both) and the submission queue entries
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sq_ring_size = (ring.cq_ring_size > ring.sq_ring_size) ? ring.cq_ring_size : ring.sq_ring_size;
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sq_entries = params.sq_entries;
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+    if (ring.sq_ring == MAP_FAILED || ring.sqes == MAP_FAILED)
+    {
+        ring.sq_ring = (ring.sq_ring == MAP_FAILED) ? NULL : ring.sq_ring;
+        ring.sqes = (ring.sqes == MAP_FAILED) ? NULL : ring.sqes;
+        close_uring();
+        return 1;
+    }
+
+    ring.cq_ring = ring.sq_ring;
+    ring.sq_head = (unsigned *)((char *)ring.sq_ring + params.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.sq_ring + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.sq_ring + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((char *)ring.sq_ring + params.sq_off.array);
+    ring.cq_head = (unsigned *)((char *)ring.cq_ring + params.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.cq_ring + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.cq_ring + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + params.cq_off.cqes);
+
+    // Register the ring of provided buffers the multishot receives fill. Large packets get fewer buffers,
+    // so the ring stays within ENGINE_BUFFER_MEMORY.
+    ring.num_buffers = ENGINE_BUFFERS;
+
+    while (ring.num_buffers > ENGINE_MIN_BUFFERS && (size_t)ring.num_buffers * buffer_size > ENGINE_BUFFER_MEMORY)
+        ring.num_buffers /= 2;
+
+    ring.buf_ring = mmap(NULL, ring.num_buffers * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.buffers = calloc(ring.num_buffers, buffer_size);
+    ring.free_slots = calloc(ENGINE_MAX_BATCH, sizeof(int));
+    ring.packets = calloc(params.cq_entries, sizeof(struct io_uring_cqe));
+
+    if (ring.buf_ring == MAP_FAILED || ring.buffers == NULL || ring.free_slots == NULL || ring.packets == NULL)
+    {
+        ring.buf_ring = (ring.buf_ring == MAP_FAILED) ? NULL : ring.buf_ring;
+        close_uring();
+        return 1;
+    }
+
+    struct io_uring_buf_reg reg = {.ring_addr = (unsigned long)ring.buf_ring, .ring_entries = ring.num_buffers, .bgid = 0};
+
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        close_uring();
+        return 1;
+    }
+
+    for (unsigned bid = 0; bid < ring.num_buffers; bid++)
+        recycle_buffer(bid);
+
+    ring.recv_msg.msg_namelen = ENGINE_NAME_SIZE;
+    ring.recv_msg.msg_controllen = TIMESTAMP_CONTROL_SIZE;
+
+    for (int i = 0; i < ENGINE_MAX_BATCH; i++)
+        ring.free_slots[ring.num_free++] = ENGINE_MAX_BATCH - 1 - i;
+
+    return 0;
+}
+
+/**
+ * Counts the packets a socket dropped since its last packet, from the cumulative count the kernel attached to it.
+ * @param index The index of the socket.
+ * @param drops The packets the socket dropped so far (0 when the kernel attached no count).
+ */
+static void count_drops(int index, unsigned int drops)
+{
+    if (drops > socket_drops[index])
+    {
+        self_stats.counters[COUNTER_SOCKET_DROPS] += drops - socket_drops[index];
+        socket_drops[index] = drops;
+    }
+}
+
+/**
+ * Numbers a packet the kernel accepted, as the kernel numbers its transmit timestamp, and keeps its tag.
+ * A packet the kernel refused (too large, or the transmit queue full) gets no number, so it isn't counted.
+ * @param sock The socket the packet was sent through.
+ * @param tag The tag of the packet.
+ */
+static void count_sent(int sock, unsigned int tag)
+{
+    int index = find_watched(sock);
+
+    if (index >= 0)
+        tx_tags[index * ENGINE_TX_TAGS + tx_keys[index]++ % ENGINE_TX_TAGS] = tag;
+}
+
+/**
+ * Processes the completions of the io_uring: frees the send slots, keeps the received packets for engine_receive,
+ * and marks the polled fds as ready.
+ */
+static void reap_completions(void)
+{
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        int kind = cqe->user_data >> 32;
+        int index = cqe->user_data & 0xFFFFFFFF;
+
+        if (kind == ENGINE_SEND)
+        {
+            ring.free_slots[ring.num_free++] = index;
+
+            if (cqe->res >= 0)
+                count_sent(slots[index].sock, slots[index].tag);
+
+            else if (cqe->res == -ENOBUFS || cqe->res == -EAGAIN)
+            {
+                dropped++; // The transmit queue is full: the probe is lost, and gets no transmit timestamp key
+                self_stats.counters[COUNTER_EAGAIN]++;
+            }
+
+            else if (cqe->res == -EMSGSIZE)
+                oversized++; // Larger than the MTU with fragmentation forbidden: the probe is lost
+
+            else if (cqe->res < 0)
+                send_error = -cqe->res;
+        }
+
+        else if (kind == ENGINE_RECV)
+        {
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                ring.packets[ring.num_packets++] = *cqe;
+
+            // Out of buffers, or another error: the receive stops and is submitted again at the next wait
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                ring.rearm[index] = 1;
+        }
+
+        else if (kind == ENGINE_POLLED)
+        {
+            ready[index] = 1;
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                arm_poll(index);
+        }
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Opens the engine.
+ * @param requested The backend to use (ENGINE_POLL or ENGINE_URING).
+ * @param batch Sends per sendmmsg(2) and packets per recvmmsg(2) call of the poll backend (1 to ENGINE_MAX_BATCH).
+ * @param packet_size Size of the largest packet to send or receive (up to ENGINE_MAX_PACKET), larger ones are truncated.
+ * @return The backend in use (poll when io_uring is unavailable), or -1 on error.
+ */
+int engine_open(int requested, int batch, int packet_size)
+{
+    batch_size = (batch < 1) ? 1 : (batch > ENGINE_MAX_BATCH) ? ENGINE_MAX_BATCH : batch;
+    packet_size = (packet_size > ENGINE_MAX_PACKET) ? ENGINE_MAX_PACKET : packet_size;
+    buffer_size = packet_size + ENGINE_NAME_SIZE + TIMESTAMP_CONTROL_SIZE;
+    buffer_size = (buffer_size + 63) & ~63; // Each buffer starts on its own cache line
+    slots = calloc(ENGINE_MAX_BATCH, sizeof(struct send_slot));
+    send_msgs = calloc(ENGINE_MAX_BATCH, sizeof(struct mmsghdr));
+    batch_msgs = calloc(ENGINE_MAX_BATCH, sizeof(struct mmsghdr));
+    tx_tags = calloc(ENGINE_MAX_FDS * ENGINE_TX_TAGS, sizeof(unsigned int));
+
+    if (slots == NULL || send_msgs == NULL || batch_msgs == NULL || tx_tags == NULL)
+    {
+        perror("calloc(3)");
+        return -1;
+    }
+
+    for (int i = 0; i < ENGINE_MAX_BATCH; i++)
+    {
+        send_msgs[i].msg_hdr.msg_iov = &slots[i].iov;
+        send_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    backend = ENGINE_POLL;
+
+    if (requested == ENGINE_URING)
+    {
+        buffer_size += sizeof(struct io_uring_recvmsg_out); // The header of each multishot receive comes first
+
+        if (open_uring() == 0)
+            return backend = ENGINE_URING;
+
+        fprintf(stderr, "io_uring unavailable, using poll\n");
+        buffer_size -= sizeof(struct io_uring_recvmsg_out);
+    }
+
+    // Large packets get fewer receive buffers, so they stay within ENGINE_BUFFER_MEMORY
+    while (batch_size > 1 && (size_t)batch_size * buffer_size > ENGINE_BUFFER_MEMORY)
+        batch_size /= 2;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    recv_buffers = calloc(batch_size, buffer_size);
+    recv_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    recv_iovs = calloc(batch_size, sizeof(struct iovec));
+
+    if (timer_fd < 0 || recv_buffers == NULL || recv_msgs == NULL || recv_iovs == NULL)
+    {
+        perror("engine_open");
+        return -1;
+    }
+
+    // Each receive buffer holds the packet, then its source address, then its control messages
+    for (int i = 0; i < batch_size; i++)
+    {
+        struct msghdr *msg = &recv_msgs[i].msg_hdr;
+        char *buffer = recv_buffers + (size_t)i * buffer_size;
+
+        msg->msg_iov = &recv_iovs[i];
+        msg->msg_iov->iov_base = buffer;
+        msg->msg_iov->iov_len = buffer_size - ENGINE_NAME_SIZE - TIMESTAMP_CONTROL_SIZE;
+        msg->msg_iovlen = 1;
+        msg->msg_name = buffer + msg->msg_iov->iov_len;
+        msg->msg_control = buffer + msg->msg_iov->iov_len + ENGINE_NAME_SIZE;
+    }
+
+    return backend;
+}
+
+/**
+ * Watches a file descriptor: the packets of a socket are received through the engine and its error queue
+ * (transmit timestamps) is reported by engine_ready, another fd is reported by engine_ready when it's readable.
+ * @param fd The file descriptor.
+ * @param is_socket Whether the fd is a socket whose packets are received.
+ * @return 0 on success, or 1 on error.
+ */
+int engine_watch(int fd, int is_socket)
+{
+    if (num_watched == ENGINE_MAX_FDS)
+    {
+        fprintf(stderr, "Too many file descriptors for the engine\n");
+        return 1;
+    }
+
+    int index = num_watched++;
+    watched[index] = fd;
+    watched_socket[index] = is_socket;
+    socket_drops[index] = 0;
+    tx_keys[index] = 0;
+
+    if (backend == ENGINE_URING && ((is_socket && arm_receive(index) != 0) || arm_poll(index) != 0))
+    {
+        fprintf(stderr, "io_uring submission queue full\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sends the queued packets (poll backend). The packets of each socket are gathered, in their order,
+ * and sent with one sendmmsg(2) call per batch. A full transmit queue drops the rest of the batch,
+ * as the link is saturated anyway, while a packet too large for the MTU (with fragmentation forbidden)
+ * is skipped alone. Only the packets sendmmsg(2) reports as sent are numbered for their transmit timestamps.
+ * @return 0 on success, or 1 on error.
+ */
+static int flush_sends(void)
+{
+    int done = 0; // Number of queued packets already sent (or dropped)
+    unsigned int tags[ENGINE_MAX_BATCH]; // Tags of the packets of one sendmmsg(2) call
+
+    for (int first = 0; done < num_queued; first++)
+    {
+        if (slots[first].sock < 0)
+            continue; // Sent with the packets of an earlier socket
+
+        int sock = slots[first].sock;
+
+        for (int i = first; i < num_queued; )
+        {
+            int count = 0;
+
+            for (; i < num_queued && count < batch_size; i++)
+            {
+                if (slots[i].sock != sock)
+                    continue;
+
+                tags[count] = slots[i].tag;
+                batch_msgs[count++] = send_msgs[i];
+                slots[i].sock = -1;
+            }
+
+            if (count == 0)
+                break;
+
+            // sendmmsg(2) stops at the first packet that fails, and only reports the error if it's the first one
+            for (int offset = 0; offset < count; )
+            {
+                uint64_t start = STAGE_START();
+                int sent = sendmmsg(sock, batch_msgs + offset, count - offset, 0);
+
+                STAGE_END(STAGE_SEND, start);
+                self_stats.counters[COUNTER_SYSCALLS]++;
+                USDT(engine, send, sock, count - offset, sent);
+
+                for (int j = 0; j < sent; j++)
+                    count_sent(sock, tags[offset + j]);
+
+                if (sent > 0)
+                    offset += sent;
+
+                else if (errno == EMSGSIZE)
+                {
+                    oversized++;
+                    offset++;
+                }
+
+                else if (errno == ENOBUFS || errno == EAGAIN)
+                {
+                    dropped += count - offset;
+                    self_stats.counters[COUNTER_EAGAIN]++;
+                    break;
+                }
+
+                else
+                {
+                    perror("sendmmsg(2)");
+                    num_queued = 0;
+                    return 1;
+                }
+            }
+
+            done += count;
+        }
+    }
+
+    num_queued = 0;
+    return 0;
+}
+
+/**
+ * Queues a packet to send. The packet, its destination and its control message are copied, so the caller
+ * can reuse its buffers right away. The queued packets are sent at the latest by the next engine_wait.
+ * @param sock The socket to send the packet through.
+ * @param msg The message: one I/O vector, an optional destination and an optional TTL control message.
+ * @param tag The tag of the packet (e.g. its sequence number), which engine_tx_tag gives back for its transmit timestamp.
+ * @return 0 on success, or 1 on error.
+ */
+int engine_send(int sock, const struct msghdr *msg, unsigned int tag)
+{
+    int index;
+
+    if (msg->msg_iov[0].iov_len > ENGINE_MAX_PACKET || msg->msg_namelen > sizeof(struct sockaddr_in6) ||
+        msg->msg_controllen > sizeof(slots[0].control))
+    {
+        fprintf(stderr, "Packet too large for the engine\n");
+        return 1;
+    }
+
+    if (backend == ENGINE_URING)
+    {
+        // Wait for a send to complete if all the slots are in use
+        while (ring.num_free == 0)
+        {
+            self_stats.counters[COUNTER_SYSCALLS]++;
+
+            if (syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            {
+                perror("io_uring_enter(2)");
+                return 1;
+            }
+
+            ring.to_submit = 0;
+            reap_completions();
+        }
+
+        index = ring.free_slots[--ring.num_free];
+    }
+
+    else
+    {
+        if (num_queued == ENGINE_MAX_BATCH && flush_sends() != 0)
+            return 1;
+
+        index = num_queued++;
+    }
+
+    struct send_slot *slot = &slots[index];
+    struct msghdr *hdr = &send_msgs[index].msg_hdr;
+
+    if (msg->msg_iov[0].iov_len > slot->capacity)
+    {
+        char *data = realloc(slot->data, msg->msg_iov[0].iov_len);
+
+        if (data == NULL)
+        {
+            perror("realloc(3)");
+
+            if (backend == ENGINE_URING)
+                ring.free_slots[ring.num_free++] = index;
+
+            else
+                num_queued--;
+
+            return 1;
+        }
+
+        slot->data = data;
+        slot->capacity = msg->msg_iov[0].iov_len;
+        slot->iov.iov_base = data;
+    }
+
+    memcpy(slot->data, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+    slot->iov.iov_len = msg->msg_iov[0].iov_len;
+    slot->sock = sock;
+    slot->tag = tag;
+    hdr->msg_name = (msg->msg_name != NULL) ? &slot->name : NULL;
+    hdr->msg_namelen = msg->msg_namelen;
+    hdr->msg_control = (msg->msg_controllen > 0) ? slot->control : NULL;
+    hdr->msg_controllen = msg->msg_controllen;
+
+    if (msg->msg_name != NULL)
+        memcpy(&slot->name, msg->msg_name, msg->msg_namelen);
+
+    if (msg->msg_controllen > 0)
+        memcpy(slot->control, msg->msg_control, msg->msg_controllen);
+
+    if (backend == ENGINE_URING)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+
+        if (sqe == NULL)
+        {
+            ring.free_slots[ring.num_free++] = index;
+            dropped++;
+            return 0;
+        }
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sock;
+        sqe->addr = (unsigned long)hdr;
+        sqe->msg_flags = MSG_DONTWAIT; // A full queue fails the send now, rather than a retry sending it out of order
+        sqe->user_data = ((unsigned long long)ENGINE_SEND << 32) | index;
+    }
+
+    return 0;
+}
+
+/**
+ * Sends the queued packets, then waits until a packet arrives, a watched fd is ready, or the deadline passes.
+ * With io_uring, the sends are submitted and the wait starts in the same system call.
+ * @param deadline Monotonic time to wait until, in milliseconds (0 or less to only collect what is there).
+ * @return 0 on success, or 1 on error.
+ */
+int engine_wait(double deadline)
+{
+    double wait = deadline - monotonic_time_ms();
+
+    memset(ready, 0, sizeof(ready));
+
+    if (backend == ENGINE_URING)
+    {
+        // Give the buffer of the last packet back, and restart the receives that stopped
+        if (ring.recycle >= 0)
+            recycle_buffer(ring.recycle);
+
+        ring.recycle = -1;
+
+        for (int i = ring.next_packet; i < ring.num_packets; i++)
+            recycle_buffer(ring.packets[i].flags >> IORING_CQE_BUFFER_SHIFT); // Packets the caller didn't read
+
+        ring.num_packets = ring.next_packet = 0;
+
+        for (int i = 0; i < num_watched; i++)
+        {
+            if (ring.rearm[i])
+                arm_receive(i);
+        }
+
+        struct timespec timeout;
+        ms_to_timespec((wait > 0) ? wait : 0, &timeout);
+        struct __kernel_timespec ts = {.tv_sec = timeout.tv_sec, .tv_nsec = timeout.tv_nsec};
+        struct io_uring_getevents_arg arg = {.ts = (unsigned long)&ts};
+        unsigned pending = *ring.cq_tail - *ring.cq_head; // Completions already there: don't wait
+        uint64_t start = STAGE_START();
+
+        int ret = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, (wait > 0 && pending == 0) ? 1 : 0,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+        STAGE_END(STAGE_WAIT, start);
+        self_stats.counters[COUNTER_SYSCALLS]++;
+        self_stats.counters[COUNTER_WAKEUPS]++;
+
+        if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        {
+            perror("io_uring_enter(2)");
+            return 1;
+        }
+
+        if (ret >= 0)
+            ring.to_submit = 0;
+
+        monotonic_time(&recv_time);
+        start = STAGE_START();
+        reap_completions();
+        STAGE_END(STAGE_RECEIVE, start);
+        USDT(engine, wakeup, ENGINE_URING, ring.num_packets);
+    }
+
+    else
+    {
+        struct pollfd fds[ENGINE_MAX_FDS + 1];
+
+        if (flush_sends() != 0)
+            return 1;
+
+        for (int i = 0; i < num_watched; i++)
+        {
+            fds[i].fd = watched[i];
+            fds[i].events = POLLIN; // The error queue of a socket raises POLLERR
+            readable[i] = 0;
+        }
+
+        fds[num_watched].fd = timer_fd;
+        fds[num_watched].events = POLLIN;
+        num_received = next_received = draining = 0;
+
+        // Sleep until the absolute deadline with the timerfd, rather than poll's millisecond timeout
+        if (wait > 0)
+        {
+            struct itimerspec timer = {0};
+            ms_to_timespec(deadline, &timer.it_value);
+
+            if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) != 0)
+            {
+                perror("timerfd_settime(2)");
+                return 1;
+            }
+        }
+
+        uint64_t start = STAGE_START();
+        int ret = poll(fds, num_watched + 1, (wait > 0) ? -1 : 0);
+
+        STAGE_END(STAGE_WAIT, start);
+        self_stats.counters[COUNTER_SYSCALLS]++;
+        self_stats.counters[COUNTER_WAKEUPS]++;
+        USDT(engine, wakeup, ENGINE_POLL, ret);
+
+        if (ret < 0 && errno != EINTR)
+        {
+            perror("poll(2)");
+            return 1;
+        }
+
+        for (int i = 0; ret > 0 && i < num_watched; i++)
+        {
+            readable[i] = watched_socket[i] && (fds[i].revents & POLLIN);
+            ready[i] = watched_socket[i] ? (fds[i].revents & POLLERR) != 0 : (fds[i].revents & POLLIN) != 0;
+        }
+
+        if (ret > 0 && (fds[num_watched].revents & POLLIN))
+        {
+            unsigned long long expirations;
+            self_stats.counters[COUNTER_SYSCALLS]++;
+
+            if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                perror("read(2)"); // The deadline is checked against the clock anyway
+        }
+    }
+
+    if (send_error != 0)
+    {
+        errno = send_error;
+        send_error = 0;
+        perror("sendmsg(2)");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the next packet received during the last engine_wait.
+ * @param packet Pointer to the structure to fill.
+ * @return 1 if a packet was returned, 0 if there are no more, or -1 on error.
+ */
+int engine_receive(struct engine_packet *packet)
+{
+    if (backend == ENGINE_URING)
+    {
+        if (ring.recycle >= 0)
+            recycle_buffer(ring.recycle);
+
+        ring.recycle = -1;
+
+        while (ring.next_packet < ring.num_packets)
+        {
+            struct io_uring_cqe *cqe = &ring.packets[ring.next_packet++];
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buffer = ring.buffers + (size_t)bid * buffer_size;
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+
+            if (cqe->res < (int)sizeof(*out))
+            {
+                recycle_buffer(bid); // Failed receive that still consumed a buffer
+                continue;
+            }
+
+            ring.recycle = bid; // Given back at the next call, once the caller is done with the packet
+
+            // The buffer holds the header, the source address, the control messages and the packet, in that order
+            char *name = buffer + sizeof(*out);
+            char *control = name + ENGINE_NAME_SIZE;
+            int available = cqe->res - (int)(sizeof(*out) + ENGINE_NAME_SIZE + TIMESTAMP_CONTROL_SIZE);
+            struct msghdr msg = {.msg_control = control, .msg_controllen = out->controllen};
+
+            int index = cqe->user_data & 0xFFFFFFFF;
+
+            packet->sock = watched[index];
+            packet->data = control + TIMESTAMP_CONTROL_SIZE;
+            packet->len = ((int)out->payloadlen < available) ? (int)out->payloadlen : available;
+            memset(&packet->source, 0, sizeof(packet->source));
+            memcpy(&packet->source, name, (out->namelen < ENGINE_NAME_SIZE) ? out->namelen : ENGINE_NAME_SIZE);
+            packet->times.user = recv_time;
+            read_rx_timestamps(&msg, &packet->times);
+            count_drops(index, packet->times.drops);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    while (next_received == num_received)
+    {
+        // Read the next batch from the first socket that still has packets
+        while (draining < num_watched && !readable[draining])
+            draining++;
+
+        if (draining == num_watched)
+            return 0;
+
+        for (int i = 0; i < batch_size; i++)
+        {
+            recv_msgs[i].msg_hdr.msg_namelen = ENGINE_NAME_SIZE;
+            recv_msgs[i].msg_hdr.msg_controllen = TIMESTAMP_CONTROL_SIZE;
+        }
+
+        uint64_t start = STAGE_START();
+        int received = recvmmsg(watched[draining], recv_msgs, batch_size, MSG_DONTWAIT, NULL);
+        monotonic_time(&recv_time); // Taken right after the system call, before any processing
+
+        STAGE_END(STAGE_RECEIVE, start);
+        self_stats.counters[COUNTER_SYSCALLS]++;
+
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            self_stats.counters[COUNTER_EAGAIN]++; // The socket was drained: the call only told us so
+
+        if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("recvmmsg(2)");
+            return -1;
+        }
+
+        if (received <= 0)
+        {
+            readable[draining] = 0; // No more packets on this socket
+            continue;
+        }
+
+        num_received = received;
+        next_received = 0;
+    }
+
+    struct mmsghdr *msg = &recv_msgs[next_received++];
+
+    packet->sock = watched[draining];
+    packet->data = msg->msg_hdr.msg_iov->iov_base;
+    packet->len = msg->msg_len;
+    memset(&packet->source, 0, sizeof(packet->source));
+    memcpy(&packet->source, msg->msg_hdr.msg_name, msg->msg_hdr.msg_namelen);
+    packet->times.user = recv_time;
+    read_rx_timestamps(&msg->msg_hdr, &packet->times);
+    count_drops(draining, packet->times.drops);
+    return 1;
+}
+
+/**
+ * Checks whether a watched fd became ready during the last engine_wait: the error queue of a socket holds
+ * transmit timestamps, another fd is readable.
+ * @param fd The file descriptor.
+ * @return 1 if it's ready, 0 otherwise.
+ */
+int engine_ready(int fd)
+{
+    int index = find_watched(fd);
+    return (index >= 0) ? ready[index] : 0;
+}
+
+/**
+ * Gets the tag of the packet a transmit timestamp is about. The kernel numbers the timestamps with the packets
+ * a socket accepted (SOF_TIMESTAMPING_OPT_ID), so the packets it refused are skipped, as they must.
+ * @param sock The socket the timestamp was read from.
+ * @param key The number of the timestamp.
+ * @param tag Receives the tag the packet was queued with.
+ * @return 1 if the packet is one of the last ENGINE_TX_TAGS the socket accepted, 0 otherwise.
+ */
+int engine_tx_tag(int sock, unsigned int key, unsigned int *tag)
+{
+    int index = find_watched(sock);
+
+    if (index < 0 || key >= tx_keys[index] || tx_keys[index] - key > ENGINE_TX_TAGS)
+        return 0;
+
+    *tag = tx_tags[index * ENGINE_TX_TAGS + key % ENGINE_TX_TAGS];
+    return 1;
+}
+
+/**
+ * Gets the number of packets dropped because the transmit queue was full.
+ * @return The number of dropped packets.
+ */
+unsigned long engine_dropped(void)
+{
+    return dropped;
+}
+
+/**
+ * Gets the number of packets the kernel refused because they exceed the MTU and mustn't be fragmented
+ * (IP_PMTUDISC_DO or IP_PMTUDISC_PROBE).
+ * @return The number of oversized packets.
+ */
+unsigned long engine_oversized(void)
+{
+    return oversized;
+}
+
+/**
+ * Closes the engine (the watched fds are left open).
+ */
+void engine_close(void)
+{
+    if (backend == ENGINE_URING)
+        close_uring();
+
+    if (timer_fd >= 0)
+        close(timer_fd);
+
+    for (int i = 0; slots != NULL && i < ENGINE_MAX_BATCH; i++)
+        free(slots[i].data);
+
+    free(recv_iovs);
+    free(recv_msgs);
+    free(recv_buffers);
+    free(tx_tags);
+    free(batch_msgs);
+    free(send_msgs);
+    free(slots);
+    recv_iovs = NULL;
+    recv_msgs = NULL;
+    recv_buffers = NULL;
+    tx_tags = NULL;
+    batch_msgs = NULL;
+    send_msgs = NULL;
+    slots = NULL;
+    timer_fd = -1;
+    num_watched = 0;
+}
+
+/**
+ * Parses the name of a backend.
+ * @param name "poll" or "uring".
+ * @return ENGINE_POLL or ENGINE_URING, or -1 for an unknown name.
+ */
+int parse_engine(const char *name)
+{
+    if (strcmp(name, "poll") == 0)
+        return ENGINE_POLL;
+
+    if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+        return ENGINE_URING;
+
+    return -1;
+}
+
+/**
+ * Gets the name of a backend.
+ * @param engine ENGINE_POLL or ENGINE_URING.
+ * @return The name.
+ */
+const char *engine_name(int engine)
+{
+    return (engine == ENGINE_URING) ? "io_uring" : "poll";
+}
@@ -0,0 +1,45 @@
+#ifndef _ENGINE_H
+#define _ENGINE_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "timestamp.h"
+
+// I/O backends
+#define ENGINE_POLL 0 // poll(2), with sendmmsg(2) and recvmmsg(2) batches
+#define ENGINE_URING 1 // io_uring: batched send submissions, multishot receives into a provided buffer ring
+
+#define ENGINE_MAX_FDS 4 // Sockets and other file descriptors watched by the engine
+#define ENGINE_MAX_BATCH 1024 // Sends queued between two waits, and packets received per recvmmsg(2) call
+#define ENGINE_MAX_PACKET 65535 // Largest packet sent or received through the engine (an IPv4 datagram)
+#define ENGINE_BUFFERS 1024 // Maximum number of receive buffers of the io_uring buffer ring (power of 2)
+#define ENGINE_MIN_BUFFERS 16 // Minimum number of receive buffers of the io_uring buffer ring (power of 2)
+#define ENGINE_BUFFER_MEMORY (8 * 1024 * 1024) // Memory of the receive buffers beyond which there are fewer of them
+#define ENGINE_RING_ENTRIES 2048 // Submission queue entries of the io_uring (the completion queue has 4 times more)
+#define ENGINE_TX_TAGS 65536 // Packets per socket whose tag is kept for their transmit timestamp (power of 2)
+
+// Structure to hold a packet received through the engine
+struct engine_packet
+{
+    int sock; // Socket the packet was received on
+    char *data; // The packet, valid until the next call to engine_receive or engine_wait
+    int len; // Size of the packet
+    struct sockaddr_in6 source; // Source address of the packet (large enough for IPv4 too)
+    struct packet_times times; // Timestamps of the packet
+};
+
+// Function declarations
+int engine_open(int backend, int batch, int packet_size);
+int engine_watch(int fd, int is_socket);
+int engine_send(int sock, const struct msghdr *msg, unsigned int tag);
+int engine_wait(double deadline);
+int engine_receive(struct engine_packet *packet);
+int engine_ready(int fd);
+int engine_tx_tag(int sock, unsigned int key, unsigned int *tag);
+unsigned long engine_dropped(void);
+unsigned long engine_oversized(void);
+void engine_close(void);
+int parse_engine(const char *name);
+const char *engine_name(int backend);
+
+#endif // _ENGINE_H
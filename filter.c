@@ -0,0 +1,159 @@
+#include <stdio.h> // perror
+#include <arpa/inet.h> // ntohs
+#include <netinet/in.h> // IPPROTO_ICMPV6
+#include <netinet/ip_icmp.h> // ICMP_ECHOREPLY, ICMP_TIME_EXCEEDED, ICMP_DEST_UNREACH
+#include <netinet/icmp6.h> // ICMP6_FILTER and the ICMPv6 types
+#include <sys/socket.h> // setsockopt
+#include <linux/filter.h> // Classic BPF (struct sock_filter, SO_ATTACH_FILTER)
+#include "filter.h"
+
+// A raw ICMP socket receives a copy of every ICMP packet the host gets, so without a filter every instance wakes up
+// for the traffic of all the others. These classic BPF programs drop what isn't ours in the kernel instead.
+// An IPv4 raw socket sees the packet from its IP header, an IPv6 one from its ICMPv6 header.
+
+#define ACCEPT 0xFFFFFFFF // Return value of a filter that keeps the whole packet
+#define IPV6_QUOTE_NEXT (8 + 6) // Offset of the next header field of the IPv6 header an ICMPv6 error quotes
+#define IPV6_QUOTE_ID (8 + 40 + 4) // Offset of the identifier of the echo request an ICMPv6 error quotes
+#define IPV6_QUOTE_FRAGMENT_ID (IPV6_QUOTE_ID + 8) // Same, when the request was fragmented (after a Fragment header)
+
+/**
+ * Attaches a classic BPF program to a socket.
+ * @param sock The socket file descriptor.
+ * @param code The instructions of the program.
+ * @param length The number of instructions.
+ * @return 0 on success, or 1 on error.
+ */
+static int attach_program(int sock, struct sock_filter *code, unsigned short length)
+{
+    struct sock_fprog program = {.len = length, .filter = code};
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0)
+    {
+        perror("setsockopt(SO_ATTACH_FILTER)");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Lets only some ICMPv6 types through an IPv6 raw socket, before the BPF program even runs.
+ * @param sock The socket file descriptor.
+ * @param types The ICMPv6 types to let through.
+ * @param count The number of types.
+ * @return 0 on success, or 1 on error.
+ */
+static int filter_icmp6_types(int sock, const int *types, int count)
+{
+    struct icmp6_filter filter;
+    ICMP6_FILTER_SETBLOCKALL(&filter);
+
+    for (int i = 0; i < count; i++)
+        ICMP6_FILTER_SETPASS(types[i], &filter);
+
+    if (setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter)) != 0)
+    {
+        perror("setsockopt(ICMP6_FILTER)");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Makes a raw socket receive only the echo replies carrying our identifier (ping).
+ * @param sock The socket file descriptor.
+ * @param ip_type The IP type of the socket (4 or 6).
+ * @param id The ICMP identifier of our echo requests (network byte order).
+ * @return 0 on success, or 1 on error.
+ */
+int attach_echo_filter(int sock, int ip_type, unsigned short id)
+{
+    if (ip_type == 4)
+    {
+        struct sock_filter code[] = {
+            BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0), // X = length of the IP header
+            BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0), // A = ICMP type
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 3),
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4), // A = identifier
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(id), 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+            BPF_STMT(BPF_RET | BPF_K, 0),
+        };
+
+        return attach_program(sock, code, sizeof(code) / sizeof(code[0]));
+    }
+
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0), // A = ICMPv6 type
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4), // A = identifier
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(id), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    const int types[] = {ICMP6_ECHO_REPLY};
+
+    if (filter_icmp6_types(sock, types, 1) != 0)
+        return 1;
+
+    return attach_program(sock, code, sizeof(code) / sizeof(code[0]));
+}
+
+/**
+ * Makes a raw socket receive only the echo replies carrying our identifier, and the time exceeded and
+ * destination unreachable errors quoting one of our echo requests (traceroute).
+ * @param sock The socket file descriptor.
+ * @param ip_type The IP type of the socket (4 or 6).
+ * @param id The ICMP identifier of our echo requests (network byte order).
+ * @return 0 on success, or 1 on error.
+ */
+int attach_probe_filter(int sock, int ip_type, unsigned short id)
+{
+    if (ip_type == 4)
+    {
+        struct sock_filter code[] = {
+            BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0), // X = length of the IP header
+            BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0), // A = ICMP type
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 2, 0),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 3, 0),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 2, 10),
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4), // A = identifier of the echo reply
+            BPF_STMT(BPF_JMP | BPF_JA, 6),
+            BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8), // A = version and header length of the quoted IP header
+            BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xF),
+            BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+            BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+            BPF_STMT(BPF_MISC | BPF_TAX, 0), // X = length of both IP headers
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8 + 4), // A = identifier of the quoted echo request
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(id), 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+            BPF_STMT(BPF_RET | BPF_K, 0),
+        };
+
+        return attach_program(sock, code, sizeof(code) / sizeof(code[0]));
+    }
+
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0), // A = ICMPv6 type
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_TIME_EXCEEDED, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_DST_UNREACH, 2, 9),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4), // A = identifier of the echo reply
+        BPF_STMT(BPF_JMP | BPF_JA, 5),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, IPV6_QUOTE_NEXT), // A = header after the quoted IPv6 header
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_FRAGMENT, 2, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, IPV6_QUOTE_ID), // A = identifier of the quoted echo request
+        BPF_STMT(BPF_JMP | BPF_JA, 1),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, IPV6_QUOTE_FRAGMENT_ID), // A = identifier of the quoted first fragment
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(id), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    const int types[] = {ICMP6_ECHO_REPLY, ICMP6_TIME_EXCEEDED, ICMP6_DST_UNREACH};
+
+    if (filter_icmp6_types(sock, types, 3) != 0)
+        return 1;
+
+    return attach_program(sock, code, sizeof(code) / sizeof(code[0]));
+}
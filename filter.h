@@ -0,0 +1,8 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+// Function declarations
+int attach_echo_filter(int sock, int ip_type, unsigned short id);
+int attach_probe_filter(int sock, int ip_type, unsigned short id);
+
+#endif // _FILTER_H
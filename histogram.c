@@ -0,0 +1,152 @@
+#include <string.h> // memset
+#include "histogram.h"
+
+/**
+ * Gets the bucket of a value. The values below 2^sub_bits have a bucket each, and every
+ * power of 2 above is split into 2^(sub_bits - 1) buckets of equal width.
+ * @param value The value (clamped to HISTOGRAM_MAX_BITS bits).
+ * @param sub_bits HISTOGRAM_SUB_BITS, or COARSE_SUB_BITS.
+ * @return The index of the bucket.
+ */
+static int bucket_index(unsigned long long value, int sub_bits)
+{
+    if (value >= 1ULL << HISTOGRAM_MAX_BITS)
+        value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+
+    int shift = 63 - __builtin_clzll(value | ((1ULL << sub_bits) - 1)) - (sub_bits - 1);
+    return shift * (1 << (sub_bits - 1)) + (int)(value >> shift);
+}
+
+/**
+ * Gets the value a bucket stands for: the middle of the range of values it holds.
+ * @param index The index of the bucket.
+ * @param sub_bits HISTOGRAM_SUB_BITS, or COARSE_SUB_BITS.
+ * @return The value.
+ */
+static unsigned long long bucket_value(int index, int sub_bits)
+{
+    if (index < 1 << sub_bits)
+        return index;
+
+    int shift = index / (1 << (sub_bits - 1)) - 1;
+    unsigned long long low = (unsigned long long)(index - shift * (1 << (sub_bits - 1))) << shift;
+    return low + ((1ULL << shift) - 1) / 2;
+}
+
+/**
+ * Gets the rank of the sample of a quantile.
+ * @param total The number of samples.
+ * @param quantile The quantile, between 0 and 1.
+ * @return The rank, from 1 to total (rounded up).
+ */
+static unsigned long long quantile_rank(unsigned long long total, double quantile)
+{
+    double exact_rank = quantile * total;
+    unsigned long long rank = (unsigned long long)exact_rank;
+
+    if (rank < exact_rank || rank == 0)
+        rank++;
+
+    return rank;
+}
+
+/**
+ * Empties a histogram.
+ * @param histogram Pointer to the histogram.
+ */
+void histogram_init(struct histogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+/**
+ * Adds a sample to a histogram.
+ * @param histogram Pointer to the histogram.
+ * @param value The sample.
+ */
+void histogram_record(struct histogram *histogram, unsigned long long value)
+{
+    histogram->counts[bucket_index(value, HISTOGRAM_SUB_BITS)]++;
+    histogram->total++;
+}
+
+/**
+ * Gets a quantile of the samples of a histogram (e.g. 0.99 for the 99th percentile).
+ * @param histogram Pointer to the histogram.
+ * @param quantile The quantile, between 0 and 1.
+ * @return The value of the quantile, within the precision of the buckets, or 0 if the histogram is empty.
+ */
+unsigned long long histogram_quantile(const struct histogram *histogram, double quantile)
+{
+    unsigned long long rank = quantile_rank(histogram->total, quantile);
+    unsigned long long seen = 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+
+        if (seen >= rank)
+            return bucket_value(i, HISTOGRAM_SUB_BITS);
+    }
+
+    return 0;
+}
+
+/**
+ * Adds the samples of another histogram to a histogram. The buckets are the same, so nothing is lost.
+ * @param histogram Pointer to the histogram to add to.
+ * @param other Pointer to the histogram whose samples are added.
+ */
+void histogram_merge(struct histogram *histogram, const struct histogram *other)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        histogram->counts[i] += other->counts[i];
+
+    histogram->total += other->total;
+}
+
+/**
+ * Adds a sample to a coarse histogram.
+ * @param histogram Pointer to the histogram.
+ * @param value The sample.
+ */
+void coarse_histogram_record(struct coarse_histogram *histogram, unsigned long long value)
+{
+    histogram->counts[bucket_index(value, COARSE_SUB_BITS)]++;
+    histogram->total++;
+}
+
+/**
+ * Adds the samples of another coarse histogram to a coarse histogram.
+ * @param histogram Pointer to the histogram to add to.
+ * @param other Pointer to the histogram whose samples are added.
+ */
+void coarse_histogram_merge(struct coarse_histogram *histogram, const struct coarse_histogram *other)
+{
+    for (int i = 0; i < COARSE_BUCKETS; i++)
+        histogram->counts[i] += other->counts[i];
+
+    histogram->total += other->total;
+}
+
+/**
+ * Gets a quantile of the samples of a coarse histogram (e.g. 0.99 for the 99th percentile).
+ * @param histogram Pointer to the histogram.
+ * @param quantile The quantile, between 0 and 1.
+ * @return The value of the quantile, within the precision of the buckets, or 0 if the histogram is empty.
+ */
+unsigned long long coarse_histogram_quantile(const struct coarse_histogram *histogram, double quantile)
+{
+    unsigned long long rank = quantile_rank(histogram->total, quantile);
+    unsigned long long seen = 0;
+
+    for (int i = 0; i < COARSE_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+
+        if (seen >= rank)
+            return bucket_value(i, COARSE_SUB_BITS);
+    }
+
+    return 0;
+}
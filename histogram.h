@@ -0,0 +1,36 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#define HISTOGRAM_SUB_BITS 7 // Each power of 2 is split in 2^(7-1) = 64 buckets, so values are kept within 1/64 (1.6%)
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS) // Number of values below which every value has its own bucket
+#define HISTOGRAM_MAX_BITS 36 // Values up to 2^36 (69 seconds in nanoseconds), larger ones are clamped
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * (HISTOGRAM_SUB_COUNT / 2) + HISTOGRAM_SUB_COUNT)
+#define COARSE_SUB_BITS 5 // Coarse histograms split each power of 2 in 16 buckets, so values are kept within 1/16 (6%)
+#define COARSE_SUB_COUNT (1 << COARSE_SUB_BITS)
+#define COARSE_BUCKETS ((HISTOGRAM_MAX_BITS - COARSE_SUB_BITS) * (COARSE_SUB_COUNT / 2) + COARSE_SUB_COUNT)
+
+// Structure to hold a log-bucketed histogram (HDR-style): constant memory whatever the number of samples
+struct histogram
+{
+    unsigned long long counts[HISTOGRAM_BUCKETS]; // Number of samples in each bucket
+    unsigned long long total; // Number of samples
+};
+
+// Structure to hold a coarse histogram: fewer buckets and 32-bit counts, for the many histograms of the targets
+// and of the report windows (a tenth of the memory of a histogram)
+struct coarse_histogram
+{
+    unsigned int counts[COARSE_BUCKETS]; // Number of samples in each bucket
+    unsigned int total; // Number of samples
+};
+
+// Function declarations
+void histogram_init(struct histogram *histogram);
+void histogram_record(struct histogram *histogram, unsigned long long value);
+unsigned long long histogram_quantile(const struct histogram *histogram, double quantile);
+void histogram_merge(struct histogram *histogram, const struct histogram *other);
+void coarse_histogram_record(struct coarse_histogram *histogram, unsigned long long value);
+unsigned long long coarse_histogram_quantile(const struct coarse_histogram *histogram, double quantile);
+void coarse_histogram_merge(struct coarse_histogram *histogram, const struct coarse_histogram *other);
+
+#endif // _HISTOGRAM_H
@@ -0,0 +1,88 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h> // __get_cpuid
+#endif
+#include "instrument.h"
+
+int instrument_enabled = 0;
+int instrument_tsc = 0;
+__thread struct self_stats self_stats;
+
+static uint64_t start_ticks; // Ticks and monotonic time (ns) when the instrumentation was enabled,
+static uint64_t start_ns; // the reference the TSC is calibrated against
+
+/**
+ * Gets the current time of the monotonic clock in nanoseconds.
+ * @return The current time in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Turns the stage timers on, before the threads start. The TSC is used when the CPU says it's invariant
+ * (it ticks at a constant rate, in every power state, and is synchronized between the cores). Its rate isn't
+ * known, so it's calibrated against CLOCK_MONOTONIC over the whole run when the ticks are converted.
+ */
+void instrument_enable(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        instrument_tsc = (edx >> 8) & 1; // Invariant TSC
+#endif
+
+    start_ns = monotonic_ns();
+    start_ticks = instrument_ticks();
+    instrument_enabled = 1;
+}
+
+/**
+ * Converts ticks of the stage timers to microseconds.
+ * @param ticks The number of ticks.
+ * @return The time in microseconds.
+ */
+double instrument_ticks_to_us(uint64_t ticks)
+{
+    if (!instrument_tsc)
+        return ticks / 1000.0;
+
+    uint64_t elapsed_ticks = instrument_ticks() - start_ticks;
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+
+    return (elapsed_ticks > 0) ? ticks * ((double)elapsed_ns / elapsed_ticks) / 1000.0 : 0;
+}
+
+/**
+ * Adds the instrumentation of a thread to a total.
+ * @param total Pointer to the total.
+ * @param stats Pointer to the instrumentation to add.
+ */
+void merge_self_stats(struct self_stats *total, const struct self_stats *stats)
+{
+    for (int stage = 0; stage < STAGES; stage++)
+    {
+        total->calls[stage] += stats->calls[stage];
+        total->ticks[stage] += stats->ticks[stage];
+
+        if (stats->max_ticks[stage] > total->max_ticks[stage])
+            total->max_ticks[stage] = stats->max_ticks[stage];
+    }
+
+    for (int counter = 0; counter < COUNTERS; counter++)
+        total->counters[counter] += stats->counters[counter];
+}
+
+/**
+ * Gets the name of a stage.
+ * @param stage The stage (STAGE_*).
+ * @return The name of the stage.
+ */
+const char *stage_name(int stage)
+{
+    static const char *names[STAGES] = {"build", "send", "wait", "receive", "parse", "output"};
+    return (stage >= 0 && stage < STAGES) ? names[stage] : "unknown";
+}
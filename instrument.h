@@ -0,0 +1,97 @@
+#ifndef _INSTRUMENT_H
+#define _INSTRUMENT_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc
+#endif
+
+// Stages of the probe pipeline, timed when the instrumentation is on (--self-stats)
+#define STAGE_BUILD 0 // Building an echo request from its template
+#define STAGE_SEND 1 // Send system calls (sendmmsg); io_uring submits the sends with its waits
+#define STAGE_WAIT 2 // Waits for packets or deadlines (poll, io_uring_enter), from the call to the wake-up
+#define STAGE_RECEIVE 3 // Receive system calls (recvmmsg), or the reaping of the io_uring completions
+#define STAGE_PARSE 4 // Parsing, matching and accounting of a received packet
+#define STAGE_OUTPUT 5 // Printing the replies
+#define STAGES 6
+
+// Counters of the probe pipeline, always kept
+#define COUNTER_SYSCALLS 0 // System calls of the engine (sends, waits, receives)
+#define COUNTER_EAGAIN 1 // Sends and receives that failed with EAGAIN (or ENOBUFS)
+#define COUNTER_WAKEUPS 2 // Waits that returned
+#define COUNTER_FOREIGN 3 // Packets received that weren't replies to the program (other processes' pings, stray ICMP)
+#define COUNTER_FOREIGN_WAKEUPS 4 // Wake-ups that only brought foreign packets
+#define COUNTER_SOCKET_DROPS 5 // Packets the sockets dropped for lack of room in their receive buffer (SO_RXQ_OVFL)
+#define COUNTERS 6
+
+// USDT probes for bpftrace and perf (e.g. bpftrace -e 'usdt:./ping:ping:reply { @[arg2] = hist(arg3) }'),
+// compiled in when the systemtap SDT header is available and no-ops otherwise
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT(provider, name, ...) STAP_PROBEV(provider, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef USDT
+#define USDT(provider, name, ...) do { } while (0)
+#endif
+
+// Structure to hold the instrumentation of one thread
+struct self_stats
+{
+    unsigned long calls[STAGES]; // Times each stage ran
+    uint64_t ticks[STAGES]; // Time spent in each stage, in ticks
+    uint64_t max_ticks[STAGES]; // Longest run of each stage, in ticks
+    unsigned long counters[COUNTERS]; // COUNTER_*
+};
+
+extern int instrument_enabled; // Whether the stages are timed
+extern int instrument_tsc; // Whether the ticks are TSC cycles rather than nanoseconds
+extern __thread struct self_stats self_stats; // Instrumentation of the calling thread
+
+/**
+ * Reads the clock of the stage timers: the TSC when it's invariant (a few cycles, no system call),
+ * or CLOCK_MONOTONIC in nanoseconds otherwise.
+ * @return The current time, in ticks.
+ */
+static inline uint64_t instrument_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (instrument_tsc)
+        return __rdtsc();
+#endif
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Records a run of a stage that started at the given tick.
+ * @param stage The stage (STAGE_*).
+ * @param start The tick the stage started at, from instrument_ticks.
+ */
+static inline void stage_done(int stage, uint64_t start)
+{
+    uint64_t ticks = instrument_ticks() - start;
+
+    self_stats.calls[stage]++;
+    self_stats.ticks[stage] += ticks;
+
+    if (ticks > self_stats.max_ticks[stage])
+        self_stats.max_ticks[stage] = ticks;
+}
+
+// Times a stage: STAGE_START before it, STAGE_END after it. Both cost a branch when the instrumentation is off.
+#define STAGE_START() (instrument_enabled ? instrument_ticks() : 0)
+#define STAGE_END(stage, start) do { if (instrument_enabled) stage_done(stage, start); } while (0)
+
+// Function declarations
+void instrument_enable(void);
+double instrument_ticks_to_us(uint64_t ticks);
+void merge_self_stats(struct self_stats *total, const struct self_stats *stats);
+const char *stage_name(int stage);
+
+#endif // _INSTRUMENT_H
@@ -0,0 +1,327 @@
+#include <stdio.h> // fprintf, perror
+#include <string.h> // memset, memcpy, memcmp, strchr
+#include <errno.h> // EAGAIN, EMSGSIZE
+#include <unistd.h> // close
+#include <arpa/inet.h> // inet_pton, inet_ntop
+#include <linux/errqueue.h> // struct sock_extended_err
+#include "netaddr.h"
+
+/**
+ * Parses an IPv4 or IPv6 address.
+ * @param ip_type The IP type (4 for IPv4, 6 for IPv6, or 0 to detect it from the address).
+ * @param input_addr The address as a string.
+ * @param addr Pointer to the net_addr structure to fill.
+ * @return 0 on success, or 1 on error.
+ */
+int parse_address(int ip_type, const char *input_addr, struct net_addr *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (ip_type == 0)
+        ip_type = (strchr(input_addr, ':') != NULL) ? 6 : 4; // Only IPv6 addresses contain colons
+
+    if (ip_type == 4)
+    {
+        addr->v4.sin_family = AF_INET;
+
+        if (inet_pton(AF_INET, input_addr, &addr->v4.sin_addr) <= 0)
+        {
+            fprintf(stderr, "Error: \"%s\" is not a valid IPv4 address\n", input_addr);
+            return 1;
+        }
+    }
+
+    else if (ip_type == 6)
+    {
+        addr->v6.sin6_family = AF_INET6;
+
+        if (inet_pton(AF_INET6, input_addr, &addr->v6.sin6_addr) <= 0)
+        {
+            fprintf(stderr, "Error: \"%s\" is not a valid IPv6 address\n", input_addr);
+            return 1;
+        }
+    }
+
+    else
+    {
+        fprintf(stderr, "Invalid IP type. Must be 4 or 6\n");
+        return 1;
+    }
+
+    addr->type = ip_type;
+    return 0;
+}
+
+/**
+ * Fills a net_addr structure from a socket address, e.g. the source address of a received packet.
+ * @param addr Pointer to the net_addr structure to fill.
+ * @param sockaddr Pointer to a sockaddr_in or sockaddr_in6 structure.
+ */
+void address_from_sockaddr(struct net_addr *addr, const void *sockaddr)
+{
+    const struct sockaddr *sa = (const struct sockaddr *)sockaddr;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->type = (sa->sa_family == AF_INET6) ? 6 : 4;
+    memcpy(&addr->sa, sockaddr, address_length(addr));
+}
+
+/**
+ * Converts an address to a string.
+ * @param addr Pointer to the address.
+ * @param buffer The buffer to write the string to (ADDRESS_STRLEN bytes are always enough).
+ * @param size The size of the buffer.
+ */
+void format_address(const struct net_addr *addr, char *buffer, size_t size)
+{
+    inet_ntop((addr->type == 6) ? AF_INET6 : AF_INET, address_bytes(addr), buffer, size);
+}
+
+/**
+ * Gets the length of the socket address, as sendto(2) and friends expect it.
+ * @param addr Pointer to the address.
+ * @return The length of the sockaddr_in or sockaddr_in6 structure.
+ */
+socklen_t address_length(const struct net_addr *addr)
+{
+    return (addr->type == 6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+/**
+ * Gets the raw address (struct in_addr or struct in6_addr), as it appears in the IP headers.
+ * @param addr Pointer to the address.
+ * @return Pointer to the raw address.
+ */
+const void *address_bytes(const struct net_addr *addr)
+{
+    return (addr->type == 6) ? (const void *)&addr->v6.sin6_addr : (const void *)&addr->v4.sin_addr;
+}
+
+/**
+ * Gets the size of a raw address.
+ * @param ip_type The IP type (4 or 6).
+ * @return The size of struct in_addr or struct in6_addr.
+ */
+size_t address_size(int ip_type)
+{
+    return (ip_type == 6) ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+/**
+ * Compares an address with a raw address.
+ * @param addr Pointer to the address.
+ * @param ip_type The IP type of the raw address (4 or 6).
+ * @param bytes Pointer to the raw address (struct in_addr or struct in6_addr).
+ * @return 1 if both are the same address, 0 otherwise.
+ */
+int same_address(const struct net_addr *addr, int ip_type, const void *bytes)
+{
+    return addr->type == ip_type && memcmp(address_bytes(addr), bytes, address_size(ip_type)) == 0;
+}
+
+/**
+ * Hashes a raw address (FNV-1a over the address bytes).
+ * @param ip_type The IP type (4 or 6).
+ * @param bytes Pointer to the raw address (struct in_addr or struct in6_addr).
+ * @return The hash value.
+ */
+unsigned int hash_address(int ip_type, const void *bytes)
+{
+    const unsigned char *data = (const unsigned char *)bytes;
+    size_t len = address_size(ip_type);
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Creates a raw socket for sending ICMP or ICMPv6 packets.
+ * @param ip_type The IP type (4 for IPv4, 6 for IPv6).
+ * @return The socket file descriptor on success, or -1 on error.
+ */
+int create_socket(int ip_type)
+{
+    int sock_fd;
+
+    if (ip_type == 4)
+        sock_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+
+    else
+        sock_fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+
+    if (sock_fd < 0)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+/**
+ * Creates an unprivileged ICMP datagram socket ("ping socket"), and binds it so the kernel picks its identifier.
+ * The kernel sets the identifier of the echo requests sent through it, computes their checksum, and only delivers
+ * it the echo replies carrying that identifier. An IPv4 one receives the replies without their IP header.
+ * It needs the group of the process to be in the net.ipv4.ping_group_range sysctl (for IPv6 too).
+ * @param ip_type The IP type (4 or 6).
+ * @param id Receives the identifier of the socket (network byte order).
+ * @return The socket file descriptor, or -1 on error (without a message, so the caller can fall back to a raw socket).
+ */
+int create_datagram_socket(int ip_type, unsigned short *id)
+{
+    struct net_addr local = {.type = ip_type};
+    socklen_t length = address_length(&local);
+    int sock_fd = socket((ip_type == 6) ? AF_INET6 : AF_INET, SOCK_DGRAM, (ip_type == 6) ? IPPROTO_ICMPV6 : IPPROTO_ICMP);
+
+    if (sock_fd < 0)
+        return -1;
+
+    local.sa.sa_family = (ip_type == 6) ? AF_INET6 : AF_INET; // Any address, identifier 0 (picked by the kernel)
+
+    if (bind(sock_fd, &local.sa, length) != 0 || getsockname(sock_fd, &local.sa, &length) != 0)
+    {
+        close(sock_fd);
+        return -1;
+    }
+
+    *id = (ip_type == 6) ? local.v6.sin6_port : local.v4.sin_port; // The identifier is the port of the socket
+    return sock_fd;
+}
+
+/**
+ * Attaches the TTL (IPv4) or the hop limit (IPv6) of a packet to a message as a control message,
+ * so packets with different TTLs can be sent back to back without changing the socket options in between.
+ * @param msg Pointer to the message. Its control buffer must have HOP_LIMIT_CONTROL_SIZE bytes.
+ * @param ip_type The IP type of the socket (4 or 6).
+ * @param hops The TTL or hop limit.
+ */
+void set_hop_limit(struct msghdr *msg, int ip_type, int hops)
+{
+    memset(msg->msg_control, 0, HOP_LIMIT_CONTROL_SIZE);
+    msg->msg_controllen = HOP_LIMIT_CONTROL_SIZE;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = (ip_type == 6) ? IPPROTO_IPV6 : IPPROTO_IP;
+    cmsg->cmsg_type = (ip_type == 6) ? IPV6_HOPLIMIT : IP_TTL;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &hops, sizeof(hops));
+}
+
+/**
+ * Sets the path MTU discovery mode of a socket, i.e. whether its packets may be fragmented.
+ * The IPv6 modes have the same values as the IPv4 ones (IPv6 routers never fragment, the mode only covers the host).
+ * @param sock The socket.
+ * @param ip_type The IP type (4 or 6).
+ * @param mode IP_PMTUDISC_DONT (fragment), IP_PMTUDISC_WANT (the default), IP_PMTUDISC_DO (set DF, refuse packets
+ *             above the known path MTU) or IP_PMTUDISC_PROBE (set DF, ignore the known path MTU).
+ * @return 0 on success, or 1 on error.
+ */
+int set_pmtu_discovery(int sock, int ip_type, int mode)
+{
+    int ret = (ip_type == 6) ? setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode))
+                             : setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+
+    if (ret != 0)
+    {
+        perror("setsockopt(IP_MTU_DISCOVER)");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Asks for the errors of a socket on its error queue (IP_RECVERR / IPV6_RECVERR), so the "message too long"
+ * errors can be read with read_mtu_error, with the MTU that was exceeded.
+ * @param sock The socket.
+ * @param ip_type The IP type (4 or 6).
+ * @return 0 on success, or 1 on error.
+ */
+int enable_mtu_errors(int sock, int ip_type)
+{
+    int on = 1;
+    int ret = (ip_type == 6) ? setsockopt(sock, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on))
+                             : setsockopt(sock, IPPROTO_IP, IP_RECVERR, &on, sizeof(on));
+
+    if (ret != 0)
+    {
+        perror("setsockopt(IP_RECVERR)");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the path MTU the kernel knows for the destination of a connected socket: the MTU of the interface,
+ * lowered by the Fragmentation Needed / Packet Too Big errors received so far.
+ * @param sock The connected socket.
+ * @param ip_type The IP type (4 or 6).
+ * @return The path MTU, or -1 on error.
+ */
+int path_mtu(int sock, int ip_type)
+{
+    int mtu;
+    socklen_t length = sizeof(mtu);
+    int ret = (ip_type == 6) ? getsockopt(sock, IPPROTO_IPV6, IPV6_MTU, &mtu, &length)
+                             : getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &length);
+
+    return (ret == 0) ? mtu : -1;
+}
+
+/**
+ * Reads the next "message too long" error from the error queue of a socket (see enable_mtu_errors): either the local
+ * stack refused a packet larger than the MTU of the interface, or a router sent back a Fragmentation Needed (IPv4)
+ * or a Packet Too Big (IPv6). The other entries of the queue (transmit timestamps, other errors) are skipped.
+ * @param sock The socket.
+ * @param ip_type The IP type (4 or 6).
+ * @param error Pointer to the structure to fill.
+ * @return 1 if an error was read, 0 if the queue holds no more, or -1 on error.
+ */
+int read_mtu_error(int sock, int ip_type, struct mtu_error *error)
+{
+    char control[512];
+    unsigned char quote[8]; // The ICMP header of the echo request, quoted by the remote errors
+    struct iovec iov = {.iov_base = quote, .iov_len = sizeof(quote)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control};
+
+    while (1)
+    {
+        msg.msg_controllen = sizeof(control);
+        ssize_t bytes = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+
+        if (bytes < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+
+            if (err->ee_errno != EMSGSIZE || err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                continue;
+
+            memset(error, 0, sizeof(*error));
+            error->mtu = err->ee_info;
+            error->local = (err->ee_origin == SO_EE_ORIGIN_LOCAL);
+            error->offender.type = ip_type;
+
+            if (!error->local)
+                address_from_sockaddr(&error->offender, SO_EE_OFFENDER(err));
+
+            // The sequence number of an echo request is the last word of its ICMP (or ICMPv6) header
+            error->quoted = !error->local && bytes >= (ssize_t)sizeof(quote);
+            error->seq = error->quoted ? (quote[6] << 8 | quote[7]) : 0;
+            return 1;
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef _NETADDR_H
+#define _NETADDR_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define ADDRESS_STRLEN INET6_ADDRSTRLEN // Room for an IPv4 or IPv6 address as a string
+#define HOP_LIMIT_CONTROL_SIZE CMSG_SPACE(sizeof(int)) // Room for the TTL / hop limit control message
+
+// Structure to hold an IPv4 or IPv6 socket address
+struct net_addr
+{
+    int type; // IP type (4 or 6)
+    union
+    {
+        struct sockaddr sa;
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    };
+};
+
+// Structure to hold a "message too long" error read from the error queue of a socket
+struct mtu_error
+{
+    int mtu; // The MTU the packet exceeded
+    int local; // 1 if the local stack refused the packet, 0 if a router reported it (Fragmentation Needed / Packet Too Big)
+    struct net_addr offender; // Address of the router that reported the error (remote errors only)
+    int quoted; // Whether the error quotes the header of the echo request it's about
+    unsigned short seq; // Sequence number of that echo request (host byte order)
+};
+
+// Function declarations
+int parse_address(int ip_type, const char *input_addr, struct net_addr *addr);
+void address_from_sockaddr(struct net_addr *addr, const void *sockaddr);
+void format_address(const struct net_addr *addr, char *buffer, size_t size);
+socklen_t address_length(const struct net_addr *addr);
+const void *address_bytes(const struct net_addr *addr);
+size_t address_size(int ip_type);
+int same_address(const struct net_addr *addr, int ip_type, const void *bytes);
+unsigned int hash_address(int ip_type, const void *bytes);
+int create_socket(int ip_type);
+int create_datagram_socket(int ip_type, unsigned short *id);
+void set_hop_limit(struct msghdr *msg, int ip_type, int hops);
+int set_pmtu_discovery(int sock, int ip_type, int mode);
+int enable_mtu_errors(int sock, int ip_type);
+int path_mtu(int sock, int ip_type);
+int read_mtu_error(int sock, int ip_type, struct mtu_error *error);
+
+#endif // _NETADDR_H
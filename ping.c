@@ -1,455 +1,2233 @@
+#define _GNU_SOURCE // For SO_RCVBUFFORCE and the CPU affinity of threads
 #include <stdio.h> // Standard input/output definitions
-#include <arpa/inet.h> // Definitions for internet operations (inet_pton, inet_ntoa)
+#include <arpa/inet.h> // Definitions for internet operations (inet_pton, inet_ntop)
 #include <netinet/in.h> // Internet address family (AF_INET, AF_INET6)
 #include <netinet/ip.h> // Definitions for internet protocol operations (IP header)
 #include <netinet/ip6.h> // Definitions for IPv6 header
 #include <netinet/ip_icmp.h> // Definitions for internet control message protocol operations (ICMP header)
 #include <netinet/icmp6.h> // Added for IPv6
-#include <poll.h> // Poll API for monitoring file descriptors (poll)
 #include <errno.h> // Error number definitions. Used for error handling (EACCES, EPERM)
 #include <string.h> // String manipulation functions (strlen, memset, memcpy)
 #include <sys/socket.h> // Definitions for socket operations (socket, sendto, recvfrom)
-#include <sys/time.h> // Time types (struct timeval and gettimeofday)
 #include <unistd.h> // UNIX standard function definitions (getpid, close, sleep)
 #include <getopt.h> // Parser
 #include <stdlib.h> // For atoi()
 #include <signal.h> // Signal handling
-#include "ping.h" // Header file for the program (calculate_checksum function and some constants)
+#include <sys/signalfd.h> // Signals read as file descriptor events (signalfd)
+#include <sys/eventfd.h> // Wake-ups between the threads (eventfd)
+#include <poll.h> // Poll API for monitoring file descriptors (poll)
+#include <pthread.h> // Worker threads
+#include <sched.h> // CPU affinity of the worker threads
+#include <sys/prctl.h> // Timer slack (prctl)
+#include <math.h> // log
+#include <time.h> // time
+#include "ping.h" // Header file for the program (some constants)
+#include "checksum.h" // Internet checksum, shared with traceroute
+#include "timestamp.h" // Kernel and monotonic timestamps for the round-trip times
+#include "netaddr.h" // IPv4 and IPv6 addresses and sockets, shared with traceroute
+#include "stats.h" // Round-trip time statistics
+#include "report.h" // Periodic machine-readable reports of the statistics
+#include "filter.h" // BPF filters of the raw sockets
+#include "engine.h" // Batched sends and receives, over poll or io_uring
+#include "instrument.h" // Stage timers, counters and USDT probes of the probe pipeline (--self-stats)
+#include "resolver.h" // Names of the targets, resolved off the probe loops (-N)
+#include "capture.h" // Binary capture of the outcomes of the probes (-w)
 
 // Structure to hold ping options
 struct ping_options
 {
     char *address;
+    char *list; // File with the list of targets ("-" for the standard input)
     int type;
     int count;
     int flood;
+    int batch; // Number of packets sent and received per system call in flood mode
+    int engine; // ENGINE_POLL or ENGINE_URING
+    int threads; // Number of worker threads the targets are sharded across
+    int payload_size; // Size of the payload of the echo requests, in bytes (the largest one with -S and -D)
+    int pmtu_mode; // IP_PMTUDISC_* mode of the sockets (-M), or -1 to keep the system default
+    int discover; // Whether to search the path MTU to the target (-D) rather than ping it
+    int search_size; // Payload of the largest size the search tries (-s with -D), or -1 for the path MTU the kernel knows
+    int sweep_min, sweep_max, sweep_step; // Payload sizes of the sweep (-S), sweep_step is 0 without it
+    char *pattern; // Hexadecimal bytes the payload is filled with (-p), or NULL for the default text
+    double interval; // Seconds between two requests to the same target
+    int pacing; // PACING_FIXED, PACING_ADAPTIVE or PACING_POISSON
+    double report_interval; // Seconds between two reports of the statistics, or 0 for no reports
+    char *report_output; // Destination of the reports ("-", a file, or "unix:" and a socket path)
+    int report_format; // REPORT_JSON or REPORT_PROMETHEUS
+    int self_stats; // Whether to time the probe pipeline and report the program's own overhead (--self-stats)
+    int resolve; // Whether to print the names of the targets (-N)
+    char *hosts; // Hosts file the names are pre-warmed from (--hosts), or NULL
+    char *capture; // Capture file the outcome of each probe is appended to (-w), or NULL
+};
+
+// Structure to hold a target host and its own statistics
+struct ping_target
+{
+    struct net_addr addr; // Destination address of the target (and its IP type)
+    char name[ADDRESS_STRLEN]; // The address as a string, for printing
+    int transmitted; // Number of requests sent to the target, used as its own sequence number
+    int latest_answered; // Sequence number of the latest probe of the target answered in order, for the reordering
+    struct ping_stats stats; // Statistics of the target
+};
+
+// Structure to hold a probe that was sent and is waiting for its reply
+struct probe
+{
+    int seq; // Sequence number of the probe on the wire (shared by all the targets of its worker)
+    int target_seq; // Sequence number of the probe from the target's point of view
+    int target; // Index of the target the probe was sent to
+    int size; // Size of the payload of the probe
+    int in_flight; // 1 while the probe is waiting for its reply, 0 once it was answered or timed out
+    int answered; // 1 once the probe was answered, so another reply to it is a duplicate
+    double send_time; // Monotonic time the probe was sent, in milliseconds
+    struct packet_times sent; // Timestamps of the sent probe (the kernel ones arrive on the error queue)
 };
 
-// Structure to hold ping statistics
-struct ping_stats
+// Structure to hold a prebuilt echo request. Sending one only fills in the sequence number and the timestamp,
+// and adjusts the checksum incrementally.
+struct echo_template
 {
-    int transmitted;
-    int received;
-    double min_rtt;
-    double max_rtt;
-    double total_rtt;
-    struct timeval start_time;
+    char packet[BUFFER_SIZE]; // The echo request (ICMP header and payload), with sequence number 0 and no timestamp.
+                              // The requests of -S and -D send the start of it, with a smaller payload.
+    int size; // Size of the echo request
+    int stamped; // Whether the payload is large enough to start with the send time (struct timespec)
+    unsigned short base_checksum; // Checksum of the prebuilt IPv4 echo request
 };
 
-// Global variables 
-int keep_running = 1; // Flag to keep the main loop running
+// Structure to hold a worker: one thread probing a shard of the targets, with its own sockets, ICMP identifiers,
+// probe table and statistics, so the workers never share anything they write to
+struct worker
+{
+    int index; // Index of the worker
+    pthread_t thread; // The thread running the worker
+    int cpu; // CPU the thread is pinned to, or -1
+    int *shard; // Indexes of the targets of the worker, in the order they were given
+    int num_shard; // Number of targets of the worker
+    int socks[2]; // IPv4 and IPv6 sockets (-1 when no target of the shard is of that type)
+    unsigned short ping_ids[2]; // ICMP identifiers of the IPv4 and IPv6 probes (network byte order)
+    struct echo_template templates[2]; // Prebuilt IPv4 and IPv6 echo requests
+    struct probe *probes; // Table of the outstanding probes, indexed by sequence number (MAX_INFLIGHT entries)
+    int outstanding; // Number of probes waiting for their reply
+    int oldest_seq; // Sequence number of the oldest probe that may still be in flight
+    double base_interval; // Interval between two requests (to any target of the shard) given by -i, in milliseconds
+    double send_interval; // Current interval between two requests (to any target of the shard), in milliseconds
+    unsigned short random[3]; // State of the Poisson gaps (erand48)
+
+    struct ping_stats stats; // Statistics of all the targets of the shard, merged with the other workers' for the summary
+    struct histogram histogram; // Fine histogram of the statistics of the shard, for the percentiles of the summary
+    struct ping_stats *sweep_stats; // Statistics of each payload size of the sweep (NULL without -S)
+    unsigned long oversized; // Requests the kernel refused for exceeding the path MTU (-M do)
+    struct self_stats self_stats; // Instrumentation of the worker's thread, copied when it's over
+    struct capture_buffer *capture; // Capture records of the worker, written to the capture file (-w), or NULL
+    int ret; // Exit status of the worker
+};
+
+// Global variables
+volatile sig_atomic_t keep_running = 1; // Flag to keep the main loop running
+
+struct ping_target *targets = NULL; // Array of the targets, in the order they were given
+int num_targets = 0; // Number of targets
+int *target_table = NULL; // Hash table of the targets keyed by address (index + 1 into targets, 0 for an empty slot)
+unsigned int target_table_size = 0; // Number of slots in the hash table (power of 2)
+
+struct worker *workers = NULL; // The workers, each probing a shard of the targets
+int num_workers = 0; // Number of workers
+int stop_fd = -1; // eventfd that wakes the workers up when they must stop
+int done_fd = -1; // eventfd each worker adds 1 to when it's over
+int datagram_socket[2] = {0, 0}; // Whether the IPv4 and IPv6 sockets are ICMP datagram sockets rather than raw ones
+int connected = 0; // Whether the sockets are connected to the only target, so no address is passed when sending
+double start_time = 0; // Monotonic time the pings started, in milliseconds
+struct capture_writer writer; // The capture file (-w), whose address indexes are the indexes of the targets
 
 struct ping_options options = {
     .address = NULL,
+    .list = NULL,
     .type = 0,
     .count = -1,
-    .flood = 0
-    };
-
-struct ping_stats stats = {
-    .transmitted = 0,
-    .received = 0,
-    .min_rtt = 999999,
-    .max_rtt = 0,
-    .total_rtt = 0,
-    .start_time = {0, 0}
+    .flood = 0,
+    .batch = FLOOD_BATCH,
+    .engine = ENGINE_POLL,
+    .threads = 1,
+    .payload_size = DEFAULT_PAYLOAD,
+    .pmtu_mode = -1,
+    .discover = 0,
+    .search_size = -1,
+    .sweep_step = 0,
+    .pattern = NULL,
+    .interval = SLEEP_TIME,
+    .pacing = PACING_FIXED,
+    .report_interval = 0,
+    .report_output = "-",
+    .report_format = REPORT_JSON,
+    .self_stats = 0,
+    .resolve = 0,
+    .hosts = NULL,
+    .capture = NULL
     };
 
 /**
- * Signal handler function to display statistics and exit.
- * @param signum The signal number.
+ * Gets the string a target is printed with: "name (address)" once its name is resolved (-N), its address otherwise.
+ * @param target Pointer to the target.
+ * @param buffer Buffer for the name and the address (HOST_STRLEN bytes).
+ * @param size The size of the buffer.
+ * @return The string to print.
  */
-void display_statistics(int signum)
+const char *target_host(const struct ping_target *target, char *buffer, size_t size)
 {
-    (void)signum; // Mark parameter as unused
-    struct timeval end_time;
-    gettimeofday(&end_time, NULL);
-    double total_time = (end_time.tv_sec - stats.start_time.tv_sec) * 1000.0 +
-                        (end_time.tv_usec - stats.start_time.tv_usec) / 1000.0;
+    if (!options.resolve)
+        return target->name;
 
-    printf("\n--- %s ping statistics ---\n", options.address);
-    printf("%d packets transmitted, %d received, time %.1fms\n",
-           stats.transmitted,
-           stats.received,
-           total_time);
+    format_host(&target->addr, buffer, size);
+    return buffer;
+}
 
-    if (stats.received > 0)
+/**
+ * Prints the number of each kind of anomalous reply (duplicate, reordered, late, corrupted) that was received,
+ * as ", N <kind>" items of the current summary line.
+ * @param stats Pointer to the snapshot of the statistics.
+ */
+void display_replies(const struct ping_stats *stats)
+{
+    for (int kind = 0; kind < REPLY_KINDS; kind++)
     {
-        double avg_rtt = stats.total_rtt / stats.received;
-        printf("rtt min/avg/max = %.3f/%.3f/%.3fms\n",
-               stats.min_rtt, avg_rtt, stats.max_rtt);
+        if (stats->replies[kind] > 0)
+            printf(", %d %s", stats->replies[kind], reply_kind_name(kind));
     }
-
-    keep_running = 0; // Stop the main loop
 }
 
 /**
- * Creates and configures a raw socket for sending ICMP or ICMPv6 packets.
- * @param ip_type The IP type (4 for IPv4, 6 for IPv6).
- * @param input_addr The destination IP address as a string.
- * @param dest_addr4 Pointer to a sockaddr_in structure for IPv4.
- * @param dest_addr6 Pointer to a sockaddr_in6 structure for IPv6.
- * @return The socket file descriptor on success, or 1 on error.
+ * Displays the statistics, at the end or as a snapshot while the pings go on.
+ * With a single target the classic summary is printed, otherwise one summary line per target.
+ * It runs from the main loop, never from a signal handler, and reads consistent snapshots of the statistics.
+ * The totals merge the snapshots of the workers' statistics, so the workers never wait for it.
  */
-int create_socket(int ip_type, char *input_addr, void *dest_addr4, void *dest_addr6)
+void display_statistics(void)
 {
-    int sock_fd;
+    static struct ping_stats snapshot, total; // Large (histogram), so kept off the stack
+    static struct histogram snapshot_histogram, total_histogram; // Fine histograms of the workers' snapshots and totals
+    double total_time = monotonic_time_ms() - start_time;
 
-    if (ip_type == 4)
+    if (num_targets > 1)
     {
-        struct sockaddr_in *dest_addr_v4 = (struct sockaddr_in *)dest_addr4;
-        memset(dest_addr_v4, 0, sizeof(struct sockaddr_in));
-        dest_addr_v4->sin_family = AF_INET;
+        printf("\n--- ping statistics for %d targets ---\n", num_targets);
 
-        if (inet_pton(AF_INET, input_addr, &dest_addr_v4->sin_addr) <= 0)
+        for (int i = 0; i < num_targets; i++)
         {
-            fprintf(stderr, "Error: \"%s\" is not a valid IPv4 address\n", input_addr);
-            return 1;
-        }
+            struct ping_stats *target_stats = &snapshot;
+            snapshot_stats(target_stats, &targets[i].stats);
+            int loss = (target_stats->transmitted > 0) ? 100 - target_stats->rtt.received * 100 / target_stats->transmitted : 0;
 
-        sock_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-    }
+            char host[HOST_STRLEN];
+            printf("%s : xmt/rcv/%%loss = %d/%d/%d%%", target_host(&targets[i], host, sizeof(host)),
+                   target_stats->transmitted, target_stats->rtt.received, loss);
+            display_replies(target_stats);
 
-    else if (ip_type == 6)
-    {
-        struct sockaddr_in6 *dest_addr_v6 = (struct sockaddr_in6 *)dest_addr6;
-        memset(dest_addr_v6, 0, sizeof(struct sockaddr_in6));
-        dest_addr_v6->sin6_family = AF_INET6;
+            if (target_stats->rtt.received > 0)
+            {
+                printf(", min/avg/max/mdev = %.3f/%.3f/%.3f/%.3fms, p50/p99 = %.3f/%.3fms",
+                       target_stats->rtt.min, target_stats->rtt.total / target_stats->rtt.received, target_stats->rtt.max,
+                       rtt_mdev(target_stats),
+                       rtt_percentile(target_stats, 50), rtt_percentile(target_stats, 99));
+            }
 
-        if (inet_pton(AF_INET6, input_addr, &dest_addr_v6->sin6_addr) <= 0)
-        {
-            fprintf(stderr, "Error: \"%s\" is not a valid IPv6 address\n", input_addr);
-            return 1;
+            printf("\n");
         }
-
-        sock_fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
     }
 
     else
     {
-        fprintf(stderr, "Invalid IP type. Must be 4 or 6\n");
-        return 1;
+        char host[HOST_STRLEN];
+        printf("\n--- %s ping statistics ---\n", target_host(&targets[0], host, sizeof(host)));
     }
 
-    if (sock_fd < 0)
+    reset_stats(&total, &total_histogram);
+    reset_stats(&snapshot, &snapshot_histogram); // The snapshots of the targets have none
+
+    for (int i = 0; i < num_workers; i++)
     {
-        perror("Socket creation failed");
-        return 1;
+        snapshot_stats(&snapshot, &workers[i].stats);
+        merge_stats(&total, &snapshot);
+    }
+
+    printf("%d packets transmitted, %d received",
+           total.transmitted,
+           total.rtt.received);
+    display_replies(&total);
+    printf(", time %.1fms\n", total_time);
+
+    if (total.rtt.received > 0)
+    {
+        double avg_rtt = total.rtt.total / total.rtt.received;
+        printf("rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3fms\n",
+               total.rtt.min, avg_rtt, total.rtt.max, rtt_mdev(&total));
+        printf("rtt p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3fms, jitter = %.3fms\n",
+               rtt_percentile(&total, 50), rtt_percentile(&total, 90), rtt_percentile(&total, 99),
+               rtt_percentile(&total, 99.9), total.rtt.jitter);
     }
 
-    return sock_fd;
+    fflush(stdout);
 }
 
 /**
- * Parses arguments into a ping_options structure.
- * @param argc The argument count.
- * @param argv The argument array.
- * @param options Pointer to a ping_options structure to stordisplaye parsed options.
- * @return 0 on success, or 1 on error.
+ * Displays the instrumentation of the workers (--self-stats): the time spent in each stage of the probe pipeline,
+ * the counters of the engine, and the program's own overhead per probe next to the round-trip time it measured.
+ * The waits are idle time, so they aren't part of the overhead. It runs once the workers are over.
  */
-int parse_arguments(int argc, char *argv[], struct ping_options *options)
+void display_self_stats(void)
 {
-    int opt;
-    int a_flag = 0, t_flag = 0;
+    struct self_stats total = {0};
+    static struct ping_stats rtts; // Large (histogram), so kept off the stack
+    double busy = 0; // Time spent building, sending, receiving and parsing, in microseconds
 
-    while ((opt = getopt(argc, argv, "a:t:c:f")) != -1)
+    reset_stats(&rtts, NULL); // Only the average is shown
+
+    for (int i = 0; i < num_workers; i++)
     {
-        switch (opt)
-        {
-        case 'a':
-            options->address = optarg; // Store the address argument
-            a_flag = 1; // Indicate that the address flag is set
-            break;
-        case 't':
-            options->type = atoi(optarg); // Convert type argument to integer
-            if (options->type != 4 && options->type != 6)
-            {
-                fprintf(stderr, "Type must be either 4 or 6\n");
-                return 1;
-            }
-            t_flag = 1; // Indicate that the type flag is set
-            break;
-        case 'c':
-            options->count = atoi(optarg); // Convert count argument to integer
-            if (options->count <= 0)
-            {
-                fprintf(stderr, "Count must be positive\n");
-                return 1;
-            }
-            break;
-        case 'f':
-            options->flood = 1; // Set flood flag if -f is specified
-            break;
-        default:
-            fprintf(stderr, "Usage: %s -a <address> -t <4|6> [-c count] [-f]\n", argv[0]);
-            return 1;
-        }
+        merge_self_stats(&total, &workers[i].self_stats);
+        merge_stats(&rtts, &workers[i].stats);
     }
 
-    if (!a_flag || !t_flag)
+    printf("\n--- self statistics (%s timers) ---\n", instrument_tsc ? "TSC" : "CLOCK_MONOTONIC");
+    printf("%-8s %10s %10s %10s %12s\n", "stage", "calls", "avg(us)", "max(us)", "total(ms)");
+
+    for (int stage = 0; stage < STAGES; stage++)
     {
-        fprintf(stderr, "Both -a and -t flags are required\n");
-        return 1;
+        double time = instrument_ticks_to_us(total.ticks[stage]);
+
+        printf("%-8s %10lu %10.3f %10.3f %12.3f\n", stage_name(stage), total.calls[stage],
+               (total.calls[stage] > 0) ? time / total.calls[stage] : 0,
+               instrument_ticks_to_us(total.max_ticks[stage]), time / 1000);
+
+        if (stage != STAGE_WAIT && stage != STAGE_OUTPUT) // The output is timed within the parsing
+            busy += time;
     }
-    return 0;
+
+    printf("%lu system calls (%lu EAGAIN), %lu wake-ups (%lu with only foreign packets), %lu foreign packets, "
+           "%lu socket drops\n", total.counters[COUNTER_SYSCALLS], total.counters[COUNTER_EAGAIN],
+           total.counters[COUNTER_WAKEUPS], total.counters[COUNTER_FOREIGN_WAKEUPS], total.counters[COUNTER_FOREIGN],
+           total.counters[COUNTER_SOCKET_DROPS]);
+
+    if (rtts.transmitted > 0)
+    {
+        printf("overhead %.3fus per probe", busy / rtts.transmitted);
+
+        if (rtts.rtt.received > 0)
+            printf(", rtt avg %.3fus", rtts.rtt.total * 1000 / rtts.rtt.received);
+
+        printf("\n");
+    }
+
+    fflush(stdout);
 }
 
-int main(int argc, char *argv[])
+/**
+ * Displays the round-trip times of each payload size of the sweep, with a bar plotting the median of each.
+ * A least-squares line is fit through the medians: its intercept is the time of an empty request, and its slope
+ * the time each byte of payload adds. Both the request and the reply carry the payload, so the slope estimates
+ * the bandwidth of the bottleneck, while a step in the bars shows where the requests or replies get fragmented.
+ * It runs once the workers are over.
+ */
+void display_sweep(void)
 {
-    if (parse_arguments(argc, argv, &options) != 0)
+    int steps = (options.sweep_max - options.sweep_min) / options.sweep_step + 1;
+    struct ping_stats *total = calloc(steps, sizeof(struct ping_stats));
+    double highest = 0; // Highest median, the length of a full bar
+    double n = 0, sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0; // Sums of the least-squares fit
+
+    if (total == NULL)
     {
-        return 1;
+        perror("calloc(3)");
+        return;
     }
 
-    // Set up signal handler for SIGINT (Ctrl+C)
-    signal(SIGINT, display_statistics);
+    for (int step = 0; step < steps; step++)
+    {
+        reset_stats(&total[step], NULL);
+
+        for (int i = 0; i < num_workers; i++)
+            merge_stats(&total[step], &workers[i].sweep_stats[step]);
 
-    // Structure to store the destination address.
-    // Even though we are using raw sockets, creating from zero the IP header is a bit complex,
-    // we use the structure to store the destination address.
-    struct sockaddr_in dest_addr_v4;
-    struct sockaddr_in6 dest_addr_v6;
+        if (total[step].rtt.received > 0 && rtt_percentile(&total[step], 50) > highest)
+            highest = rtt_percentile(&total[step], 50);
+    }
 
-    // Create a raw socket with the ICMP protocol.
-    int sock = create_socket(options.type, options.address, &dest_addr_v4, &dest_addr_v6);
+    printf("\n--- payload size sweep ---\n");
+    printf("%7s %7s %7s %5s %10s %10s %10s %10s\n", "size", "xmt", "rcv", "loss", "min", "avg", "p50", "p99");
 
-    // Error handling if the socket creation fails (could happen if the program isn't run with sudo).
-    if (sock < 0)
+    for (int step = 0; step < steps; step++)
     {
-        perror("socket(2)");
+        struct ping_stats *size_stats = &total[step];
+        int size = options.sweep_min + step * options.sweep_step;
+        int loss = (size_stats->transmitted > 0) ? 100 - size_stats->rtt.received * 100 / size_stats->transmitted : 0;
 
-        // Check if the error is due to permissions and print a message to the user.
-        // Some magic constants for the error numbers, which are defined in the errno.h header file.
-        if (errno == EACCES || errno == EPERM)
-            fprintf(stderr, "You need to run the program with sudo.\n");
+        printf("%7d %7d %7d %4d%%", size, size_stats->transmitted, size_stats->rtt.received, loss);
 
-        return 1;
+        if (size_stats->rtt.received == 0)
+        {
+            printf("\n");
+            continue;
+        }
+
+        double median = rtt_percentile(size_stats, 50);
+        int bar = (highest > 0) ? (int)(median / highest * SWEEP_BAR_WIDTH + 0.5) : 0;
+
+        printf(" %10.3f %10.3f %10.3f %10.3f ", size_stats->rtt.min, size_stats->rtt.total / size_stats->rtt.received,
+               median, rtt_percentile(size_stats, 99));
+
+        for (int i = 0; i < bar; i++)
+            putchar('#');
+
+        printf("\n");
+        n++;
+        sum_x += size;
+        sum_y += median;
+        sum_xx += (double)size * size;
+        sum_xy += size * median;
     }
 
-    gettimeofday(&stats.start_time, NULL); // Record the start time
+    double spread = n * sum_xx - sum_x * sum_x;
 
-    // Just some buffer to store the ICMP packet itself. We zero it out to make sure there are no garbage values.
-    char buffer[BUFFER_SIZE];
+    if (n >= 2 && spread > 0)
+    {
+        double slope = (n * sum_xy - sum_x * sum_y) / spread; // Milliseconds per byte
+        double intercept = (sum_y - slope * sum_x) / n;
 
-    // The payload of the ICMP packet. Can be anything, as long as it's a valid string.
-    // We use some garbage characters, as well as some ASCII characters, to test the program.
-    char *msg = "ABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890!@#$^&*()_+{}|:<>?~`-=[]',.";
+        printf("rtt = %.3fms + %.3fus/byte", intercept, slope * 1000);
 
-    // Payload size of the ICMP packet.
-    // We need to add 1 to the size of the payload, as we need to include the null-terminator of the string.
-    int payload_size = strlen(msg) + 1;
+        // Each byte crosses the bottleneck twice, so it takes slope / 2 milliseconds in each direction
+        if (slope > 0)
+            printf(" (bottleneck ~%.1f Mbit/s)", 0.016 / slope);
 
-    // The sequence number of the ping request.
-    // It starts at 0 and is incremented by 1 for each new request.
-    // Good for identifying the order of the requests.
-    int seq = 0;
+        printf("\n");
+    }
 
-    // Create a pollfd structure to wait for the socket to become ready for reading.
-    // Used for receiving the ICMP reply packet, as it may take some time to arrive or not arrive at all.
-    struct pollfd fds[1];
+    free(total);
+    fflush(stdout);
+}
 
-    // Set the file descriptor of the socket to the pollfd structure.
-    fds[0].fd = sock;
+/**
+ * Stops the workers: they leave their loops at the next wake-up, which the stop eventfd triggers right away.
+ */
+void stop_workers(void)
+{
+    keep_running = 0;
 
-    // Set the events to wait for to POLLIN, which means the socket is ready for reading.
-    fds[0].events = POLLIN;
+    if (write(stop_fd, &(unsigned long long){1}, sizeof(unsigned long long)) < 0)
+        perror("write(2)"); // The workers still stop at their next deadline
+}
 
-    fprintf(stdout, "Pinging %s with %d bytes of data:\n", options.address, payload_size);
+/**
+ * Handles the signals that arrived on the signalfd: SIGINT and SIGTERM stop the workers,
+ * SIGUSR1 and SIGQUIT print a snapshot of the statistics and let the pings go on.
+ * @param signal_fd The signalfd file descriptor.
+ */
+void handle_signals(int signal_fd)
+{
+    struct signalfd_siginfo info;
 
-    // The main loop of the program.
-    while (keep_running && (options.count == -1 || stats.transmitted < options.count))
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
     {
-        // Zero out the buffer to make sure there are no garbage values.
-        memset(buffer, 0, sizeof(buffer)); // Clear the buffer
+        if (info.ssi_signo == SIGUSR1 || info.ssi_signo == SIGQUIT)
+            display_statistics();
 
-        if (options.type == 4)
-        {
-            struct icmphdr *icmp_header = (struct icmphdr *)buffer;
-            icmp_header->type = ICMP_ECHO; // Set the type of the ICMP packet to ECHO REQUEST (PING).
-            icmp_header->code = 0; // Set the code of the ICMP packet to 0 (As it isn't used in the ECHO type).
-            icmp_header->un.echo.id = htons(getpid()); // Set the ICMP identifier.
-            icmp_header->un.echo.sequence = htons(seq); // Set the sequence number.
-            memcpy(buffer + sizeof(struct icmphdr), msg, payload_size); // Copy the payload to the buffer.
-            icmp_header->checksum = 0; // Set the checksum of the ICMP packet to 0, as we need to calculate it.
-            icmp_header->checksum = calculate_checksum(buffer, sizeof(struct icmphdr) + payload_size); // Calculate the checksum of the ICMP packet.
-        }
+        else
+            stop_workers(); // The statistics are displayed once they're over
+    }
+}
+
+/**
+ * Looks up a target by its address in the hash table.
+ * @param ip_type The IP type (4 or 6).
+ * @param addr Pointer to the raw address (struct in_addr or struct in6_addr).
+ * @param slot If not NULL, receives the slot of the target, or the empty slot where it should be inserted.
+ * @return The index of the target, or -1 if the address isn't one of our targets.
+ */
+int find_target(int ip_type, const void *addr, unsigned int *slot)
+{
+    unsigned int mask = target_table_size - 1;
+    unsigned int i = hash_address(ip_type, addr) & mask;
+
+    // Linear probing, the table is never more than half full
+    while (target_table[i] != 0)
+    {
+        struct ping_target *target = &targets[target_table[i] - 1];
 
-        else if (options.type == 6)
+        if (same_address(&target->addr, ip_type, addr))
         {
-            struct icmp6_hdr *icmp6_header = (struct icmp6_hdr *)buffer;
-            icmp6_header->icmp6_type = ICMP6_ECHO_REQUEST; // Set the type of the ICMP packet to ICMP6 ECHO REQUEST (PING).
-            icmp6_header->icmp6_code = 0; // Set the code of the ICMP packet to 0 (As it isn't used in the ECHO type).
-            icmp6_header->icmp6_id = htons(getpid()); // Set the ICMP identifier.
-            icmp6_header->icmp6_seq = htons(seq); // Set the sequence number.
-            memcpy(buffer + sizeof(struct icmp6_hdr), msg, payload_size); // Copy the payload to the buffer.
-            icmp6_header->icmp6_cksum = 0; // Set the checksum of the ICMP packet to 0, as we need to calculate it.
+            break;
         }
 
-        // Calculate the time it takes to send and receive the packet.
-        struct timeval start, end;
-        gettimeofday(&start, NULL);
+        i = (i + 1) & mask;
+    }
 
-        int bytes_sent; // Number of bytes sent
+    if (slot != NULL)
+        *slot = i;
 
-        // Send the ICMP packet
-        if (options.type == 4)
-        {
-            bytes_sent = sendto(sock, buffer, sizeof(struct icmphdr) + payload_size, 0, (struct sockaddr *)&dest_addr_v4, sizeof(dest_addr_v4));
-        }
+    return target_table[i] - 1;
+}
 
-        else if (options.type == 6)
-        {
-            bytes_sent = sendto(sock, buffer, sizeof(struct icmp6_hdr) + payload_size, 0, (struct sockaddr *)&dest_addr_v6, sizeof(dest_addr_v6));
-        }
+/**
+ * Adds a target to the target array and the hash table. Duplicate addresses are ignored.
+ * @param ip_type The IP type (4, 6, or 0 to detect it from the address).
+ * @param input_addr The destination IP address as a string.
+ * @return 0 on success, or 1 on error.
+ */
+int add_target(int ip_type, const char *input_addr)
+{
+    static int capacity = 0; // Number of targets the array has room for
 
-        // If the packet sending fails, print an error message and close the socket
-        if (bytes_sent <= 0)
+    if (num_targets == capacity)
+    {
+        capacity = (capacity == 0) ? 16 : capacity * 2;
+        struct ping_target *new_targets = realloc(targets, capacity * sizeof(struct ping_target));
+
+        if (new_targets == NULL)
         {
-            perror("sendto(2)");
-            close(sock);
+            perror("realloc(3)");
             return 1;
         }
 
-        stats.transmitted++; // Increment the transmitted counter
+        targets = new_targets;
+    }
 
-        int ret = poll(fds, 1, TIMEOUT); // Poll the socket to wait for the ICMP reply packet
+    // Keep the hash table at most half full, rebuilding it when it grows.
+    if ((unsigned int)(num_targets + 1) * 2 > target_table_size)
+    {
+        free(target_table);
+        target_table_size = (target_table_size == 0) ? 32 : target_table_size * 2;
+        target_table = calloc(target_table_size, sizeof(int));
 
-        // The poll(2) function returns 0 if the socket is not ready for reading after the timeout.
-        if (ret == 0)
+        if (target_table == NULL)
         {
-            fprintf(stderr, "Request timeout for icmp_seq %d\n", seq + 1);
-            continue;
+            perror("calloc(3)");
+            return 1;
         }
 
-        // The poll(2) function returns a negative value if an error occurs.
-        else if (ret < 0)
+        for (int i = 0; i < num_targets; i++)
         {
-            perror("poll(2)");
-            close(sock);
-            return 1;
+            unsigned int slot;
+            find_target(targets[i].addr.type, address_bytes(&targets[i].addr), &slot);
+            target_table[slot] = i + 1;
         }
+    }
 
-        if (fds[0].revents & POLLIN)
-        { // Check if the socket is ready for reading
-            if (options.type == 4)
-            {
-                struct sockaddr_in source_addr; // Temporary structure to store the source address of the ICMP reply packet.
+    struct ping_target *target = &targets[num_targets];
 
-                int bytes_received = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&source_addr, &(socklen_t){sizeof(source_addr)});
-                if (bytes_received <= 0)
-                {
-                    perror("recvfrom(2)");
-                    close(sock);
-                    return 1;
-                }
+    memset(target, 0, sizeof(*target));
+    target->latest_answered = -1;
+    reset_stats(&target->stats, NULL);
 
-                gettimeofday(&end, NULL); // Record the receive time
-                struct iphdr *ip_header = (struct iphdr *)buffer;
-                struct icmphdr *icmp_reply = (struct icmphdr *)(buffer + ip_header->ihl * 4);
+    if (parse_address(ip_type, input_addr, &target->addr) != 0)
+        return 1;
 
-                if (icmp_reply->type == ICMP_ECHOREPLY)
-                {
-                    double rtt = (end.tv_sec - start.tv_sec) * 1000.0 +
-                                 (end.tv_usec - start.tv_usec) / 1000.0; // Calculate round-trip time
-
-                    stats.received++; // Increment the received counter
-                    stats.min_rtt = (rtt < stats.min_rtt) ? rtt : stats.min_rtt; // Update minimum RTT
-                    stats.max_rtt = (rtt > stats.max_rtt) ? rtt : stats.max_rtt; // Update maximum RTT
-                    stats.total_rtt += rtt; // Update total RTT
-
-                    // Print the result of the ping request
-                    fprintf(stdout, "%d bytes from %s: icmp_seq=%d ttl=%d time=%.2fms\n",
-                            bytes_received - ip_header->ihl * 4, // Print the size of the ICMP reply packet
-                            inet_ntoa(source_addr.sin_addr), // Print source IP address
-                            seq + 1, // Print sequence number
-                            ip_header->ttl, // Print TTL
-                            rtt); // Print round-trip time
-                    seq++;
-                }
-            }
+    format_address(&target->addr, target->name, sizeof(target->name));
 
-            else if (options.type == 6)
-            {
-                struct sockaddr_in6 source_addr; // Temporary structure to store the source address of the ICMPv6 reply packet.
-                char addr_str[46]; // Buffer to store the source address as a string
+    unsigned int slot;
 
-                // Receive the ICMPv6 reply packet
-                int bytes_received = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&source_addr, &(socklen_t){sizeof(source_addr)});
-                if (bytes_received <= 0)
-                {
-                    perror("recvfrom(2)");
-                    close(sock);
-                    return 1;
-                }
+    if (find_target(target->addr.type, address_bytes(&target->addr), &slot) >= 0)
+        return 0; // Already in the list
 
-                gettimeofday(&end, NULL); // Record the receive time
-                struct icmp6_hdr *icmp6_reply = (struct icmp6_hdr *)buffer;
+    target_table[slot] = ++num_targets;
+    return 0;
+}
 
-                if (icmp6_reply->icmp6_type == ICMP6_ECHO_REPLY)
-                {
-                    double rtt = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0; // Calculate round-trip time
-
-                    stats.received++; // Increment the received counter
-                    stats.min_rtt = (rtt < stats.min_rtt) ? rtt : stats.min_rtt; // Update minimum RTT
-                    stats.max_rtt = (rtt > stats.max_rtt) ? rtt : stats.max_rtt; // Update maximum RTT
-                    stats.total_rtt += rtt; // Update total RTT
-
-                    inet_ntop(AF_INET6, &source_addr.sin6_addr, addr_str, 46); // Convert source address to string
-
-                    // Print the result of the ping request
-                    fprintf(stdout, "%d bytes from %s: icmp_seq=%d ttl=%d time=%.2fms\n",
-                            bytes_received,
-                            addr_str, // Print source address
-                            seq + 1, // Print sequence number
-                            64, // Print TTL
-                            rtt); // Print round-trip time
-                    seq++;
-                }
-            }
-        }
+/**
+ * Reads the list of targets, one address per line. Empty lines and lines starting with '#' are skipped.
+ * @param path The path of the file, or "-" for the standard input.
+ * @return 0 on success, or 1 on error.
+ */
+int read_target_list(const char *path)
+{
+    FILE *file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+
+    if (file == NULL)
+    {
+        perror("fopen(3)");
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int ret = 0;
+
+    while (getline(&line, &line_size, file) != -1)
+    {
+        char *addr = line + strspn(line, " \t"); // Skip the leading whitespace
+        addr[strcspn(addr, " \t\r\n")] = '\0'; // Cut the trailing whitespace
+
+        if (addr[0] == '\0' || addr[0] == '#')
+            continue;
 
-        // Sleep for 1 second before sending the next request, if not in flood mode
-        if (!options.flood)
+        if (add_target(options.type, addr) != 0)
         {
-            sleep(SLEEP_TIME);
+            ret = 1;
+            break;
         }
     }
 
-    if(keep_running) {
-        display_statistics(SIGINT); // Display statistics
-    }
+    free(line);
 
-    // Close the socket and return 0 to the operating system.
-    close(sock);
-    return 0;
+    if (file != stdin)
+        fclose(file);
+
+    return ret;
 }
 
 /**
- * Calculates the checksum for the given data.
- * @param data Pointer to the data for which the checksum is to be calculated.
- * @param bytes The number of bytes in the data.
- * @return The calculated checksum as an unsigned short integer.
+ * Parses arguments into a ping_options structure.
+ * @param argc The argument count.
+ * @param argv The argument array.
+ * @param options Pointer to a ping_options structure to store parsed options.
+ * @return 0 on success, or 1 on error.
  */
-unsigned short int calculate_checksum(void *data, unsigned int bytes)
+int parse_arguments(int argc, char *argv[], struct ping_options *options)
 {
-    unsigned short int *data_pointer = (unsigned short int *)data;
-    unsigned int total_sum = 0;
-
-    // Main summing loop.
-    while (bytes > 1)
+    int opt;
+    int a_flag = 0, t_flag = 0, l_flag = 0, s_flag = 0;
+    static const struct option long_options[] = {
+        {"self-stats", no_argument, NULL, OPT_SELF_STATS},
+        {"hosts", required_argument, NULL, OPT_HOSTS},
+        {NULL, 0, NULL, 0}
+        };
+
+    while ((opt = getopt_long(argc, argv, "a:t:c:fl:b:R:o:e:i:APs:p:E:T:M:DS:Nw:", long_options, NULL)) != -1)
     {
-        total_sum += *data_pointer++; // Some magic pointer arithmetic.
-        bytes -= 2;
-    }
+        switch (opt)
+        {
+        case 'a':
+            options->address = optarg; // Store the address argument
+            a_flag = 1; // Indicate that the address flag is set
+            break;
+        case 't':
+            options->type = atoi(optarg); // Convert type argument to integer
+            if (options->type != 4 && options->type != 6)
+            {
+                fprintf(stderr, "Type must be either 4 or 6\n");
+                return 1;
+            }
+            t_flag = 1; // Indicate that the type flag is set
+            break;
+        case 'c':
+            options->count = atoi(optarg); // Convert count argument to integer
+            if (options->count <= 0)
+            {
+                fprintf(stderr, "Count must be positive\n");
+                return 1;
+            }
+            break;
+        case 'f':
+            options->flood = 1; // Set flood flag if -f is specified
+            break;
+        case 'l':
+            options->list = optarg; // Store the target list argument
+            l_flag = 1; // Indicate that the list flag is set
+            break;
+        case 'b':
+            options->batch = atoi(optarg); // Convert batch size argument to integer
+            if (options->batch <= 0 || options->batch > FLOOD_MAX_BATCH)
+            {
+                fprintf(stderr, "Batch size must be between 1 and %d\n", FLOOD_MAX_BATCH);
+                return 1;
+            }
+            break;
+        case 'E':
+            options->engine = parse_engine(optarg); // Convert backend argument
+            if (options->engine < 0)
+            {
+                fprintf(stderr, "Engine must be either poll or uring\n");
+                return 1;
+            }
+            break;
+        case 'T':
+            options->threads = atoi(optarg); // Convert thread count argument to integer
+            if (options->threads <= 0 || options->threads > MAX_WORKERS)
+            {
+                fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 's':
+            options->payload_size = atoi(optarg); // Convert payload size argument to integer
+            if (options->payload_size < 0 || options->payload_size > MAX_PAYLOAD)
+            {
+                fprintf(stderr, "Payload size must be between 0 and %d\n", MAX_PAYLOAD);
+                return 1;
+            }
+            s_flag = 1; // Indicate that the size flag is set
+            break;
+        case 'M':
+            if (strcmp(optarg, "do") == 0)
+                options->pmtu_mode = IP_PMTUDISC_DO; // Set DF, and refuse the requests larger than the path MTU
+            else if (strcmp(optarg, "want") == 0)
+                options->pmtu_mode = IP_PMTUDISC_WANT; // Set DF, but fragment above the path MTU
+            else if (strcmp(optarg, "dont") == 0)
+                options->pmtu_mode = IP_PMTUDISC_DONT; // Never set DF
+            else if (strcmp(optarg, "probe") == 0)
+                options->pmtu_mode = IP_PMTUDISC_PROBE; // Set DF, and ignore the path MTU the kernel knows
+            else
+            {
+                fprintf(stderr, "Path MTU discovery mode must be do, want, dont or probe\n");
+                return 1;
+            }
+            break;
+        case 'D':
+            options->discover = 1; // Search the path MTU
+            break;
+        case 'S':
+        {
+            int fields = sscanf(optarg, "%d:%d:%d", &options->sweep_min, &options->sweep_max, &options->sweep_step);
 
-    // Add left-over byte, if any.
-    if (bytes > 0)
-        total_sum += *((unsigned char *)data_pointer);
+            if (fields < 2 || options->sweep_min < 0 || options->sweep_max > MAX_PAYLOAD || options->sweep_min > options->sweep_max)
+            {
+                fprintf(stderr, "Sweep must be min:max[:step], with 0 <= min <= max <= %d\n", MAX_PAYLOAD);
+                return 1;
+            }
+
+            // Without a step, the sweep covers the range in about SWEEP_DEFAULT_STEPS sizes
+            if (fields == 2)
+                options->sweep_step = (options->sweep_max - options->sweep_min + SWEEP_DEFAULT_STEPS - 2) / (SWEEP_DEFAULT_STEPS - 1);
 
-    // Fold 32-bit sum to 16 bits.
-    while (total_sum >> 16)
-        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
+            if (options->sweep_step <= 0)
+                options->sweep_step = 1;
 
-    // Return the one's complement of the result.
-    return (~((unsigned short int)total_sum));
-}
\ No newline at end of file
+            if ((options->sweep_max - options->sweep_min) / options->sweep_step + 1 > SWEEP_MAX_STEPS)
+            {
+                fprintf(stderr, "Sweep must have at most %d sizes\n", SWEEP_MAX_STEPS);
+                return 1;
+            }
+            break;
+        }
+        case 'p':
+            options->pattern = optarg; // Store the payload pattern argument
+            if (strlen(optarg) == 0 || strlen(optarg) > 2 * MAX_PATTERN || strspn(optarg, "0123456789abcdefABCDEF") != strlen(optarg))
+            {
+                fprintf(stderr, "Pattern must be 1 to %d hexadecimal bytes\n", MAX_PATTERN);
+                return 1;
+            }
+            break;
+        case 'i':
+            options->interval = atof(optarg); // Convert interval argument to seconds
+            if (options->interval < 0.000001)
+            {
+                fprintf(stderr, "Interval must be at least 1 microsecond\n");
+                return 1;
+            }
+            break;
+        case 'A':
+            options->pacing = PACING_ADAPTIVE; // Slow down under loss
+            break;
+        case 'P':
+            options->pacing = PACING_POISSON; // Exponentially distributed gaps
+            break;
+        case 'R':
+            options->report_interval = atof(optarg); // Convert report interval argument to seconds
+            if (options->report_interval <= 0)
+            {
+                fprintf(stderr, "Report interval must be positive\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            options->report_output = optarg; // Store the report destination argument
+            break;
+        case 'e':
+            if (strcmp(optarg, "json") == 0)
+                options->report_format = REPORT_JSON;
+            else if (strcmp(optarg, "prometheus") == 0)
+                options->report_format = REPORT_PROMETHEUS;
+            else
+            {
+                fprintf(stderr, "Report format must be either json or prometheus\n");
+                return 1;
+            }
+            break;
+        case OPT_SELF_STATS:
+            options->self_stats = 1;
+            break;
+        case 'N':
+            options->resolve = 1;
+            break;
+        case OPT_HOSTS:
+            options->hosts = optarg;
+            options->resolve = 1;
+            break;
+        case 'w':
+            options->capture = optarg; // Store the capture file argument
+            break;
+        default:
+            fprintf(stderr, "Usage: %s {-a <address> -t <4|6> | -l <file|->} [-c count] [-s size | -S min:max[:step]] [-p pattern] "
+                            "[-M do|want|dont|probe] [-f [-b batch]] [-i interval [-A | -P]] [-E poll|uring] [-T threads] "
+                            "[-R seconds [-o <file|unix:path|->] [-e json|prometheus]] [-N [--hosts file]] [-w file] [--self-stats]\n"
+                            "       %s -D -a <address> -t <4|6> [-s size] [-p pattern] [-E poll|uring] [-N [--hosts file]] [--self-stats]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (options->flood && options->pacing != PACING_FIXED)
+    {
+        fprintf(stderr, "The -A and -P flags can't be used with -f\n");
+        return 1;
+    }
+
+    if (options->discover && (l_flag || options->flood || options->sweep_step > 0 || options->pmtu_mode >= 0))
+    {
+        fprintf(stderr, "The -D flag can't be used with -l, -f, -S or -M\n");
+        return 1;
+    }
+
+    if (options->sweep_step > 0 && s_flag)
+    {
+        fprintf(stderr, "The -s and -S flags can't be used together\n");
+        return 1;
+    }
+
+    if (a_flag && l_flag)
+    {
+        fprintf(stderr, "The -a and -l flags can't be used together\n");
+        return 1;
+    }
+
+    // The IP type of each target in a list is detected from its address, unless -t is given
+    if (!l_flag && (!a_flag || !t_flag))
+    {
+        fprintf(stderr, "Both -a and -t flags are required\n");
+        return 1;
+    }
+
+    // The templates are built for the largest request, and the smaller ones send the start of them
+    if (options->sweep_step > 0)
+        options->payload_size = options->sweep_max;
+
+    if (options->discover)
+    {
+        options->search_size = s_flag ? options->payload_size : -1;
+        options->payload_size = MAX_PAYLOAD;
+        options->pmtu_mode = IP_PMTUDISC_PROBE; // Set DF on every size, whatever path MTU the kernel already knows
+    }
+
+    return 0;
+}
+
+/**
+ * Adapts the interval between the requests in adaptive mode: it doubles on each lost request, and shrinks back
+ * by ADAPTIVE_RECOVERY on each reply. It stays between the -i interval and ADAPTIVE_MAX_BACKOFF times it.
+ * @param worker Pointer to the worker.
+ * @param lost 1 if a request timed out, 0 if it was answered.
+ */
+void adapt_interval(struct worker *worker, int lost)
+{
+    if (options.pacing != PACING_ADAPTIVE)
+        return;
+
+    worker->send_interval = lost ? worker->send_interval * 2 : worker->send_interval * ADAPTIVE_RECOVERY;
+
+    if (worker->send_interval > worker->base_interval * ADAPTIVE_MAX_BACKOFF)
+        worker->send_interval = worker->base_interval * ADAPTIVE_MAX_BACKOFF;
+
+    if (worker->send_interval < worker->base_interval)
+        worker->send_interval = worker->base_interval;
+}
+
+/**
+ * Gets the time between the current request and the next one.
+ * In Poisson mode the gaps are drawn from an exponential distribution, so the requests don't sample
+ * the network in phase with any periodic behavior of it.
+ * @param worker Pointer to the worker.
+ * @return The gap in milliseconds.
+ */
+double next_gap(struct worker *worker)
+{
+    if (options.pacing == PACING_POISSON)
+        return -log(1.0 - erand48(worker->random)) * worker->send_interval;
+
+    return worker->send_interval;
+}
+
+/**
+ * Gets the size of the payload of the next request to a target: the -s size, or with -S the sizes of the sweep
+ * in turn, so each round over the sizes samples them all under the same network conditions.
+ * @param target Pointer to the target.
+ * @return The size of the payload in bytes.
+ */
+int next_payload_size(const struct ping_target *target)
+{
+    if (options.sweep_step == 0)
+        return options.payload_size;
+
+    int steps = (options.sweep_max - options.sweep_min) / options.sweep_step + 1;
+    return options.sweep_min + (target->transmitted % steps) * options.sweep_step;
+}
+
+/**
+ * Records a sent probe in the outstanding probe table, so its reply can be matched later.
+ * @param worker Pointer to the worker.
+ * @param target_index The index of the target the probe was sent to.
+ * @param seq The sequence number of the probe.
+ * @param size The size of the payload of the probe.
+ * @param send_time Pointer to the monotonic time the probe was sent.
+ */
+void record_sent(struct worker *worker, int target_index, int seq, int size, const struct timespec *send_time)
+{
+    struct ping_target *target = &targets[target_index];
+    struct probe *probe = &worker->probes[seq % MAX_INFLIGHT]; // Slot of this probe in the outstanding probe table
+    memset(&probe->sent, 0, sizeof(probe->sent));
+    probe->sent.user = *send_time;
+    probe->send_time = send_time->tv_sec * 1000.0 + send_time->tv_nsec / 1000000.0;
+    probe->seq = seq;
+    probe->target = target_index;
+    probe->size = size;
+    probe->target_seq = target->transmitted++;
+    probe->in_flight = 1; // The probe is now waiting for its reply
+    probe->answered = 0;
+    worker->outstanding++;
+    record_transmit(&target->stats);
+    record_transmit(&worker->stats); // Increment the transmitted counter
+
+    if (worker->sweep_stats != NULL)
+        record_transmit(&worker->sweep_stats[(size - options.sweep_min) / options.sweep_step]);
+
+    if (options.report_interval > 0)
+        report_transmit(target_index);
+}
+
+/**
+ * Prebuilds the IPv4 and IPv6 echo requests once, so sending one only fills in its sequence number and timestamp.
+ * The payload is the -p pattern repeated, or a text of printable characters by default.
+ * @param worker Pointer to the worker, whose ICMP identifiers the requests carry.
+ * @param payload_size The size of the payload in bytes.
+ * @param pattern The hexadecimal bytes of the pattern, or NULL for the default text.
+ */
+void build_templates(struct worker *worker, int payload_size, const char *pattern)
+{
+    // The payload of the ICMP packet. Can be anything, as long as it's a valid string.
+    // We use some garbage characters, as well as some ASCII characters, to test the program.
+    const char *msg = "ABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890!@#$^&*()_+{}|:<>?~`-=[]',.";
+    unsigned char fill[MAX_PATTERN]; // The bytes of the -p pattern
+    int fill_size = 0;
+
+    for (size_t i = 0; pattern != NULL && i < strlen(pattern); i += 2)
+    {
+        unsigned int byte;
+        sscanf(pattern + i, "%2x", &byte); // An odd last digit is read alone
+        fill[fill_size++] = byte;
+    }
+
+    for (int type = 0; type < 2; type++)
+    {
+        struct echo_template *template = &worker->templates[type];
+        struct icmphdr *icmp_header = (struct icmphdr *)template->packet; // Same layout as the ICMPv6 echo header
+        char *payload = template->packet + sizeof(struct icmphdr);
+
+        memset(template->packet, 0, sizeof(template->packet));
+        icmp_header->type = (type == 0) ? ICMP_ECHO : ICMP6_ECHO_REQUEST; // ECHO REQUEST (PING)
+        icmp_header->code = 0; // Not used by the ECHO type
+        icmp_header->un.echo.id = worker->ping_ids[type]; // Set the ICMP identifier (the kernel sets it on datagram sockets).
+        template->size = sizeof(struct icmphdr) + payload_size;
+        template->stamped = (payload_size >= (int)sizeof(struct timespec));
+
+        // The send time is left zeroed: it's added to the checksum when the request is sent
+        for (int i = template->stamped ? sizeof(struct timespec) : 0; i < payload_size; i++)
+            payload[i] = (fill_size > 0) ? fill[i % fill_size] : msg[i % (strlen(msg) + 1)];
+
+        // The kernel calculates the ICMPv6 checksum for us.
+        template->base_checksum = (type == 0) ? calculate_checksum(template->packet, template->size) : 0;
+    }
+}
+
+/**
+ * Fills in the sequence number and the send time of an echo request copied from its template, and for IPv4
+ * adjusts the checksum of the template by the words that changed (RFC 1624) rather than summing the packet again.
+ * A request cut to a smaller payload than the template's (-S, -D) is summed in full.
+ * @param worker Pointer to the worker.
+ * @param packet The echo request.
+ * @param ip_type The IP type of the echo request (4 or 6).
+ * @param seq The sequence number of the request.
+ * @param size The size of the payload of the request.
+ * @param send_time Pointer to the monotonic send time, embedded at the start of the payload if there is room.
+ */
+void fill_request(struct worker *worker, char *packet, int ip_type, int seq, int size, const struct timespec *send_time)
+{
+    struct echo_template *template = &worker->templates[ip_type == 6];
+    struct icmphdr *icmp_header = (struct icmphdr *)packet;
+    int stamped = template->stamped && size >= (int)sizeof(*send_time);
+
+    icmp_header->un.echo.sequence = htons(seq); // Set the sequence number.
+
+    if (stamped)
+        memcpy(packet + sizeof(struct icmphdr), send_time, sizeof(*send_time));
+
+    if (ip_type == 6)
+        return;
+
+    if ((int)sizeof(struct icmphdr) + size != template->size)
+    {
+        icmp_header->checksum = 0;
+        icmp_header->checksum = calculate_checksum(packet, sizeof(struct icmphdr) + size);
+        return;
+    }
+
+    // Both fields are zero in the template, so their new words are simply added to its sum
+    unsigned long long sum = (unsigned short)~template->base_checksum + (unsigned int)icmp_header->un.echo.sequence;
+
+    if (template->stamped)
+        sum = checksum_add(sum, send_time, sizeof(*send_time));
+
+    icmp_header->checksum = ~checksum_fold(sum);
+}
+
+/**
+ * Queues the echo request with the given sequence number to the target, straight from its template.
+ * The engine copies it, and sends it with the other queued requests when the main loop waits.
+ * The probe is recorded in the outstanding probe table, so the reply can be matched later.
+ * @param worker Pointer to the worker.
+ * @param target_index The index of the target.
+ * @param seq The sequence number of the probe.
+ * @param size The size of the payload of the probe (at most the template's).
+ * @param send_time Pointer to the monotonic time the probe is sent.
+ * @return 0 on success, or 1 on error.
+ */
+int send_request(struct worker *worker, int target_index, int seq, int size, const struct timespec *send_time)
+{
+    struct ping_target *target = &targets[target_index];
+    struct echo_template *template = &worker->templates[target->addr.type == 6];
+    struct iovec iov = {.iov_base = template->packet, .iov_len = sizeof(struct icmphdr) + size};
+    struct msghdr msg = {
+        .msg_name = connected ? NULL : &target->addr.sa,
+        .msg_namelen = connected ? 0 : address_length(&target->addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1};
+
+    uint64_t start = STAGE_START();
+    fill_request(worker, template->packet, target->addr.type, seq, size, send_time);
+    STAGE_END(STAGE_BUILD, start);
+    USDT(ping, request, target_index, target->transmitted + 1, size);
+
+    if (engine_send(worker->socks[target->addr.type == 6], &msg, seq) != 0)
+        return 1;
+
+    record_sent(worker, target_index, seq, size, send_time);
+    return 0;
+}
+
+/**
+ * Checks the payload of an echo reply against its request: the same size, and past the send time (which differs
+ * in each request) the same bytes as the template. A reply can pass the checksum and still have been altered.
+ * @param worker Pointer to the worker.
+ * @param ip_type The IP type of the reply (4 or 6).
+ * @param payload The payload of the reply.
+ * @param size The size of the payload of the reply.
+ * @param expected The size of the payload of the request.
+ * @return 1 if the payload is intact, 0 otherwise.
+ */
+int payload_intact(struct worker *worker, int ip_type, const char *payload, int size, int expected)
+{
+    struct echo_template *template = &worker->templates[ip_type == 6];
+    int skip = template->stamped ? (int)sizeof(struct timespec) : 0;
+
+    if (size != expected || size > template->size - (int)sizeof(struct icmphdr))
+        return 0;
+
+    skip = (skip > size) ? size : skip;
+    return memcmp(payload + skip, template->packet + sizeof(struct icmphdr) + skip, size - skip) == 0;
+}
+
+/**
+ * Classifies an echo reply, and finds the probe it answers. The probe is looked up by the identifier and the sequence
+ * number of the reply, and must have been sent to the host the reply comes from. When the payload carries the send
+ * time, it must be the one of that probe too, otherwise the reply answers an older probe whose sequence number was
+ * reused since. The reply is a duplicate if the probe was already answered, and late if it timed out.
+ * @param worker Pointer to the worker.
+ * @param ip_type The IP type of the reply (4 or 6).
+ * @param target_index The index of the target the reply comes from.
+ * @param icmp The ICMP (or ICMPv6) echo reply: its header and its payload.
+ * @param bytes The size of the echo reply.
+ * @param checksum_ok Whether the checksum of the echo reply is right.
+ * @param probe Receives the probe the reply answers, or NULL if it answers an older probe than the one in its slot.
+ * @return REPLY_ANSWER for the first reply to a probe in flight, or the kind of reply (REPLY_*) otherwise.
+ */
+int classify_reply(struct worker *worker, int ip_type, int target_index, const char *icmp, int bytes, int checksum_ok,
+                   struct probe **probe)
+{
+    const struct icmphdr *header = (const struct icmphdr *)icmp; // Same layout as the ICMPv6 echo header
+    const char *payload = icmp + sizeof(struct icmphdr);
+    int size = bytes - sizeof(struct icmphdr);
+    int seq = ntohs(header->un.echo.sequence);
+    struct probe *slot = &worker->probes[seq % MAX_INFLIGHT];
+
+    *probe = slot;
+
+    if (slot->send_time == 0 || (slot->seq & 0xFFFF) != seq || slot->target != target_index ||
+        (worker->templates[ip_type == 6].stamped && size >= (int)sizeof(struct timespec) &&
+         memcmp(payload, &slot->sent.user, sizeof(struct timespec)) != 0))
+        *probe = NULL; // Never sent, or sent again since
+
+    if (!checksum_ok || !payload_intact(worker, ip_type, payload, size, (*probe != NULL) ? (*probe)->size : size))
+        return REPLY_CORRUPTED;
+
+    if (*probe == NULL || (!slot->in_flight && !slot->answered))
+        return REPLY_LATE;
+
+    if (!slot->in_flight)
+        return REPLY_DUPLICATE;
+
+    if (slot->target_seq < targets[target_index].latest_answered)
+        return REPLY_REORDERED; // Still answers the probe
+
+    return REPLY_ANSWER;
+}
+
+/**
+ * Appends the outcome of a probe to the worker's capture records (-w). The replies come from their target,
+ * so it's their responder; the probes without a reply have none.
+ * @param worker Pointer to the worker.
+ * @param outcome Pointer to the outcome, whose responder, ICMP type and time are filled in.
+ * @param sent Pointer to the monotonic time the probe was sent.
+ */
+void capture_outcome(struct worker *worker, struct probe_outcome *outcome, const struct timespec *sent)
+{
+    int answered = (outcome->outcome != OUTCOME_TIMEOUT && outcome->outcome != OUTCOME_UNANSWERED);
+
+    outcome->responder = answered ? outcome->target : CAPTURE_NONE;
+    outcome->type = !answered ? 0 : (targets[outcome->target].addr.type == 6) ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY;
+    outcome->sent = capture_time(&writer, sent);
+    capture_probe(worker->capture, outcome);
+}
+
+/**
+ * Completes an answered probe: updates the statistics of its target and prints the reply.
+ * @param worker Pointer to the worker.
+ * @param probe Pointer to the probe.
+ * @param bytes The size of the ICMP reply packet.
+ * @param ttl The TTL of the reply.
+ * @param received Pointer to the timestamps of the reply.
+ * @param reordered Whether a later probe of the target was answered first.
+ */
+void complete_probe(struct worker *worker, struct probe *probe, int bytes, int ttl, const struct packet_times *received, int reordered)
+{
+    struct ping_target *target = &targets[probe->target];
+    int source; // Source of the timestamps the round-trip time was measured with
+    double rtt = elapsed_ms(&probe->sent, received, &source); // Calculate round-trip time
+
+    probe->in_flight = 0;
+    probe->answered = 1;
+    worker->outstanding--;
+
+    if (!reordered)
+        target->latest_answered = probe->target_seq;
+
+    USDT(ping, reply, probe->target, probe->target_seq + 1, (long)(rtt * 1000)); // Round-trip time in microseconds
+    adapt_interval(worker, 0);
+    record_rtt(&target->stats, rtt);
+    record_rtt(&worker->stats, rtt);
+
+    if (worker->sweep_stats != NULL)
+        record_rtt(&worker->sweep_stats[(probe->size - options.sweep_min) / options.sweep_step], rtt);
+
+    if (options.report_interval > 0)
+        report_rtt(probe->target, rtt);
+
+    if (worker->capture != NULL)
+        capture_outcome(worker, &(struct probe_outcome){.outcome = reordered ? OUTCOME_REORDERED : OUTCOME_REPLY,
+                                                        .source = source, .ttl = ttl, .target = probe->target,
+                                                        .seq = probe->target_seq + 1, .rtt = rtt, .size = bytes},
+                        &probe->sent.user);
+
+    // In flood mode every reply just erases one of the dots printed for the requests
+    if (options.flood)
+    {
+        putchar('\b');
+        return;
+    }
+
+    // Print the result of the ping request
+    uint64_t start = STAGE_START();
+    char host[HOST_STRLEN];
+    fprintf(stdout, "%d bytes from %s: icmp_seq=%d ttl=%d time=%.3fms ts=%s%s\n",
+            bytes, // Print the size of the ICMP reply packet
+            target_host(target, host, sizeof(host)), // Print source IP address (and name)
+            probe->target_seq + 1, // Print sequence number
+            ttl, // Print TTL
+            rtt, // Print round-trip time
+            timestamp_source_name(source), // Print the source of the timestamps
+            reordered ? " (out of order)" : "");
+    STAGE_END(STAGE_OUTPUT, start);
+}
+
+/**
+ * Handles an echo reply from one of the targets: completes the probe it answers, or counts and prints it
+ * as a duplicate, late or corrupted reply. The round-trip time of those is measured from the send time the payload
+ * carries, when it's intact, since their probe may be gone.
+ * @param worker Pointer to the worker.
+ * @param ip_type The IP type of the reply (4 or 6).
+ * @param source Pointer to the raw source address of the reply (struct in_addr or struct in6_addr).
+ * @param icmp The ICMP (or ICMPv6) echo reply: its header and its payload.
+ * @param bytes The size of the echo reply.
+ * @param checksum_ok Whether the checksum of the echo reply is right.
+ * @param ttl The TTL of the reply.
+ * @param received Pointer to the timestamps of the reply.
+ */
+void handle_reply(struct worker *worker, int ip_type, const void *source, const char *icmp, int bytes, int checksum_ok,
+                  int ttl, const struct packet_times *received)
+{
+    int target_index = find_target(ip_type, source, NULL);
+
+    if (((const struct icmphdr *)icmp)->un.echo.id != worker->ping_ids[ip_type == 6] || target_index < 0)
+    {
+        self_stats.counters[COUNTER_FOREIGN]++;
+        return; // Reply to another process' (or worker's) ping, or from a host we don't ping
+    }
+
+    struct probe *probe;
+    int kind = classify_reply(worker, ip_type, target_index, icmp, bytes, checksum_ok, &probe);
+
+    if (kind == REPLY_ANSWER || kind == REPLY_REORDERED)
+        complete_probe(worker, probe, bytes, ttl, received, kind == REPLY_REORDERED);
+
+    if (kind == REPLY_ANSWER)
+        return;
+
+    struct ping_target *target = &targets[target_index];
+
+    USDT(ping, anomaly, target_index, (probe != NULL) ? probe->target_seq + 1 : 0, kind);
+    record_reply(&target->stats, kind);
+    record_reply(&worker->stats, kind);
+
+    if (options.report_interval > 0)
+        report_reply(target_index, kind);
+
+    if (kind == REPLY_REORDERED)
+        return;
+
+    struct timespec sent = received->user; // Send time of the probe, from the payload
+    double rtt = -1;
+
+    if (kind != REPLY_CORRUPTED && worker->templates[ip_type == 6].stamped && bytes >= (int)(sizeof(struct icmphdr) + sizeof(struct timespec)))
+    {
+        memcpy(&sent, icmp + sizeof(struct icmphdr), sizeof(sent));
+        rtt = (received->user.tv_sec - sent.tv_sec) * 1000.0 + (received->user.tv_nsec - sent.tv_nsec) / 1000000.0;
+    }
+
+    if (worker->capture != NULL)
+    {
+        int outcome = (kind == REPLY_DUPLICATE) ? OUTCOME_DUPLICATE : (kind == REPLY_LATE) ? OUTCOME_LATE : OUTCOME_CORRUPTED;
+        capture_outcome(worker, &(struct probe_outcome){.outcome = outcome, .bad_checksum = !checksum_ok, .ttl = ttl,
+                                                        .target = target_index, .seq = (probe != NULL) ? (unsigned int)probe->target_seq + 1 : CAPTURE_NONE,
+                                                        .rtt = rtt, .size = bytes},
+                        (probe != NULL) ? &probe->sent.user : &sent);
+    }
+
+    if (options.flood)
+        return;
+
+    uint64_t start = STAGE_START();
+    char host[HOST_STRLEN];
+    fprintf(stdout, "%d bytes from %s: ", bytes, target_host(target, host, sizeof(host)));
+
+    if (probe != NULL)
+        fprintf(stdout, "icmp_seq=%d ", probe->target_seq + 1);
+
+    fprintf(stdout, "ttl=%d", ttl);
+
+    if (rtt >= 0)
+        fprintf(stdout, " time=%.3fms", rtt);
+
+    if (kind == REPLY_CORRUPTED)
+        fprintf(stdout, " (%s)\n", checksum_ok ? "corrupted payload" : "bad checksum");
+
+    else
+        fprintf(stdout, " (%s)\n", (kind == REPLY_DUPLICATE) ? "DUP!" : "late");
+
+    STAGE_END(STAGE_OUTPUT, start);
+}
+
+/**
+ * Reads the pending transmit timestamps from a socket's error queue and attaches them to their probes.
+ * @param worker Pointer to the worker.
+ * @param v6 0 for the IPv4 socket of the worker, 1 for the IPv6 one.
+ */
+void receive_tx_timestamps(struct worker *worker, int v6)
+{
+    struct packet_times tx;
+    unsigned int key, seq;
+
+    while (read_tx_timestamp(worker->socks[v6], &key, &tx) > 0)
+    {
+        // Ignore the timestamps of packets too old for the engine to know their probe
+        if (!engine_tx_tag(worker->socks[v6], key, &seq))
+            continue;
+
+        struct probe *probe = &worker->probes[seq % MAX_INFLIGHT];
+
+        if (probe->in_flight && probe->seq == (int)seq)
+        {
+            probe->sent.software = tx.software;
+            probe->sent.hardware = tx.hardware;
+        }
+    }
+}
+
+/**
+ * Parses a received packet and, if it is an echo reply, hands it over to handle_reply.
+ * The kernel verifies the checksum of the ICMPv6 packets and of the ICMP ones of datagram sockets,
+ * but an IPv4 raw socket gets the packets before ICMP does, so their checksum is verified here.
+ * @param worker Pointer to the worker.
+ * @param ip_type The IP type of the socket the packet was received on (4 or 6).
+ * @param buffer The received packet (starting with the IP header for IPv4, and with the ICMPv6 header for IPv6).
+ * @param bytes The size of the received packet.
+ * @param source_addr Pointer to the source address of the packet (sockaddr_in or sockaddr_in6).
+ * @param received Pointer to the timestamps of the packet.
+ */
+void handle_packet(struct worker *worker, int ip_type, char *buffer, int bytes, void *source_addr, const struct packet_times *received)
+{
+    if (ip_type == 4)
+    {
+        struct iphdr *ip_header = (struct iphdr *)buffer;
+        int header_size = datagram_socket[0] ? 0 : ip_header->ihl * 4; // Datagram sockets don't pass the IP header
+        struct icmphdr *icmp_reply = (struct icmphdr *)(buffer + header_size);
+
+        if (bytes < header_size + (int)sizeof(struct icmphdr) || icmp_reply->type != ICMP_ECHOREPLY)
+        {
+            self_stats.counters[COUNTER_FOREIGN]++;
+            return; // Not an echo reply (e.g. our own request on the loopback interface)
+        }
+
+        int checksum_ok = datagram_socket[0] || calculate_checksum(icmp_reply, bytes - header_size) == 0;
+
+        handle_reply(worker, 4, &((struct sockaddr_in *)source_addr)->sin_addr, (char *)icmp_reply, bytes - header_size,
+                     checksum_ok, datagram_socket[0] ? received->hops : ip_header->ttl, received);
+    }
+
+    else
+    {
+        struct icmp6_hdr *icmp6_reply = (struct icmp6_hdr *)buffer;
+
+        if (bytes < (int)sizeof(struct icmp6_hdr) || icmp6_reply->icmp6_type != ICMP6_ECHO_REPLY)
+        {
+            self_stats.counters[COUNTER_FOREIGN]++;
+            return; // Not an echo reply
+        }
+
+        handle_reply(worker, 6, &((struct sockaddr_in6 *)source_addr)->sin6_addr, buffer, bytes, 1, received->hops, received);
+    }
+}
+
+/**
+ * Matches the packets received during the last wait to their probes.
+ * The transmit timestamps of a socket are attached before its replies are matched.
+ * @param worker Pointer to the worker.
+ * @return 0 on success, or 1 on error.
+ */
+int receive_replies(struct worker *worker)
+{
+    struct engine_packet packet;
+    int drained[2] = {0, 0}; // Whether the error queue of each socket was read
+
+    for (int v6 = 0; v6 < 2; v6++)
+    {
+        if (worker->socks[v6] >= 0 && engine_ready(worker->socks[v6]))
+        {
+            receive_tx_timestamps(worker, v6);
+            drained[v6] = 1;
+        }
+    }
+
+    int ret, packets = 0;
+    unsigned long foreign = self_stats.counters[COUNTER_FOREIGN];
+
+    while ((ret = engine_receive(&packet)) > 0)
+    {
+        int v6 = (packet.sock == worker->socks[1]);
+        uint64_t start = STAGE_START();
+
+        // The transmit timestamp may be queued without its poll event yet
+        if (!drained[v6])
+        {
+            receive_tx_timestamps(worker, v6);
+            drained[v6] = 1;
+        }
+
+        handle_packet(worker, v6 ? 6 : 4, packet.data, packet.len, &packet.source, &packet.times);
+        STAGE_END(STAGE_PARSE, start);
+        packets++;
+    }
+
+    // The filter of a raw socket drops most of the others' packets in the kernel, but not all of them
+    if (packets > 0 && self_stats.counters[COUNTER_FOREIGN] - foreign == (unsigned long)packets)
+        self_stats.counters[COUNTER_FOREIGN_WAKEUPS]++;
+
+    if (options.flood)
+        fflush(stdout);
+
+    return (ret < 0) ? 1 : 0;
+}
+
+/**
+ * Queues one batch of echo requests. The engine sends them with as few system calls as the backend allows.
+ * @param worker Pointer to the worker.
+ * @param seq Pointer to the sequence number of the next request, advanced past the requests of the batch.
+ * @param total The number of requests to send in total, or -1 for no limit.
+ * @return 0 on success, or 1 on error.
+ */
+int flood_send(struct worker *worker, int *seq, long total)
+{
+    struct timespec send_time;
+    monotonic_time(&send_time); // One send time for the whole batch
+
+    // Queue the next requests, as long as there is room for them in the probe table.
+    for (int count = 0; count < options.batch && (total == -1 || *seq < total) && !worker->probes[*seq % MAX_INFLIGHT].in_flight; count++)
+    {
+        int target_index = worker->shard[*seq % worker->num_shard];
+
+        if (send_request(worker, target_index, *seq, next_payload_size(&targets[target_index]), &send_time) != 0)
+            return 1;
+
+        putchar('.'); // One dot per request, erased by its reply
+        (*seq)++;
+    }
+
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Reports and releases the probes that have been waiting for their reply longer than TIMEOUT.
+ * Probes are sent in sequence order with the same timeout, so the oldest one always expires first.
+ * @param worker Pointer to the worker.
+ * @param now The current time in milliseconds.
+ * @param next_seq The sequence number of the next probe to be sent.
+ */
+void expire_probes(struct worker *worker, double now, int next_seq)
+{
+    while (worker->oldest_seq < next_seq)
+    {
+        struct probe *probe = &worker->probes[worker->oldest_seq % MAX_INFLIGHT];
+
+        if (probe->in_flight && probe->seq == worker->oldest_seq)
+        {
+            if (now - probe->send_time < TIMEOUT)
+                break; // The oldest probe hasn't expired yet, so neither have the newer ones
+
+            char host[HOST_STRLEN];
+
+            if (num_targets > 1)
+                fprintf(stderr, "Request timeout for %s icmp_seq %d\n", target_host(&targets[probe->target], host, sizeof(host)),
+                        probe->target_seq + 1);
+
+            else
+                fprintf(stderr, "Request timeout for icmp_seq %d\n", probe->target_seq + 1);
+
+            USDT(ping, timeout, probe->target, probe->target_seq + 1);
+
+            if (worker->capture != NULL)
+                capture_outcome(worker, &(struct probe_outcome){.outcome = OUTCOME_TIMEOUT, .target = probe->target,
+                                                                .seq = probe->target_seq + 1, .rtt = -1},
+                                &probe->sent.user);
+
+            probe->in_flight = 0;
+            worker->outstanding--;
+            adapt_interval(worker, 1);
+        }
+
+        worker->oldest_seq++;
+    }
+}
+
+/**
+ * Creates the sockets of a worker, one per IP type of its targets.
+ * @param worker Pointer to the worker.
+ * @return 0 on success, or 1 on error.
+ */
+int open_sockets(struct worker *worker)
+{
+    // The ICMP identifier of the worker's probes, unless the kernel picks one. Each worker has its own,
+    // so the filter of a raw socket only lets the replies of its own worker through.
+    worker->ping_ids[0] = worker->ping_ids[1] = htons(getpid() + worker->index);
+
+    for (int i = 0; i < worker->num_shard; i++)
+    {
+        struct ping_target *target = &targets[worker->shard[i]];
+        int type = target->addr.type;
+        int *sock = &worker->socks[type == 6];
+
+        if (*sock >= 0)
+            continue;
+
+        // Prefer an ICMP datagram socket: it needs no privileges, and the kernel only delivers it our replies.
+        // Otherwise use a raw socket, with a BPF filter that drops the ICMP packets of the others in the kernel.
+        *sock = create_datagram_socket(type, &worker->ping_ids[type == 6]);
+        datagram_socket[type == 6] = (*sock >= 0);
+
+        if (*sock < 0)
+            *sock = create_socket(type);
+
+        // Error handling if the socket creation fails (could happen if the program isn't run with sudo).
+        if (*sock < 0)
+        {
+            // Check if the error is due to permissions and print a message to the user.
+            // Some magic constants for the error numbers, which are defined in the errno.h header file.
+            if (errno == EACCES || errno == EPERM)
+                fprintf(stderr, "You need to run the program with sudo, or with a group in net.ipv4.ping_group_range.\n");
+
+            return 1;
+        }
+
+        if (!datagram_socket[type == 6] && attach_echo_filter(*sock, type, worker->ping_ids[type == 6]) != 0)
+            return 1;
+
+        // Whether the requests may be fragmented (-M). The path MTU search (-D) reads the MTU its requests exceeded
+        // from the errors queued on the socket.
+        if (options.pmtu_mode >= 0 && set_pmtu_discovery(*sock, type, options.pmtu_mode) != 0)
+            return 1;
+
+        if (options.discover && enable_mtu_errors(*sock, type) != 0)
+            return 1;
+
+        // An IPv4 raw socket reads the TTL of the replies from their IP header, the others get it as a control message
+        int on = 1;
+        if (type == 6)
+            setsockopt(*sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on));
+
+        else if (datagram_socket[0])
+            setsockopt(*sock, IPPROTO_IP, IP_RECVTTL, &on, sizeof(on));
+
+        // With a single target, connect the socket to it: the kernel then skips the route lookup of each send,
+        // and a raw socket only receives the packets of that host.
+        if (num_targets == 1 && connect(*sock, &target->addr.sa, address_length(&target->addr)) == 0)
+            connected = 1;
+
+        // In flood mode, make room for the bursts of replies that arrive between two batches.
+        // SO_RCVBUFFORCE lets root go over the system limit, otherwise SO_RCVBUF is capped by it.
+        int rcvbuf = FLOOD_RCVBUF;
+        if (options.flood && setsockopt(*sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) != 0)
+            setsockopt(*sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        // Without kernel timestamps the round-trip times are measured with the monotonic clock.
+        if (enable_timestamping(*sock) != 0 && worker->index == 0)
+            fprintf(stderr, "Kernel timestamping unavailable, using the monotonic clock\n");
+
+        // Each received packet then carries the number of packets the socket dropped, for --self-stats
+        enable_drop_count(*sock);
+    }
+
+    return 0;
+}
+
+/**
+ * Splits the targets into the shards of the workers by hashing their addresses, so a target always lands on the
+ * same worker whatever the order of the list. Workers whose shard would be empty aren't created.
+ * @param threads The number of worker threads asked for.
+ * @return 0 on success, or 1 on error.
+ */
+int shard_targets(int threads)
+{
+    workers = calloc(threads, sizeof(struct worker));
+    int *shard_of = malloc(num_targets * sizeof(int)); // Worker of each target
+
+    if (workers == NULL || shard_of == NULL)
+    {
+        perror("calloc(3)");
+        free(shard_of);
+        return 1;
+    }
+
+    for (int i = 0; i < num_targets; i++)
+    {
+        shard_of[i] = (threads > 1) ? hash_address(targets[i].addr.type, address_bytes(&targets[i].addr)) % threads : 0;
+        workers[shard_of[i]].num_shard++;
+    }
+
+    // Drop the empty shards, keeping the others in order
+    int *index = malloc(threads * sizeof(int)); // Index of each shard among the workers that are created
+
+    if (index == NULL)
+    {
+        perror("malloc(3)");
+        free(shard_of);
+        return 1;
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        index[i] = num_workers;
+
+        if (workers[i].num_shard > 0)
+            workers[num_workers++].num_shard = workers[i].num_shard;
+    }
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        struct worker *worker = &workers[i];
+
+        worker->index = i;
+        worker->cpu = -1;
+        worker->socks[0] = worker->socks[1] = -1;
+        worker->shard = malloc(worker->num_shard * sizeof(int));
+        worker->probes = calloc(MAX_INFLIGHT, sizeof(struct probe));
+        worker->num_shard = 0; // Counted again as the shard is filled in
+        reset_stats(&worker->stats, &worker->histogram);
+
+        if (options.sweep_step > 0)
+        {
+            int steps = (options.sweep_max - options.sweep_min) / options.sweep_step + 1;
+            worker->sweep_stats = calloc(steps, sizeof(struct ping_stats));
+
+            for (int step = 0; worker->sweep_stats != NULL && step < steps; step++)
+                reset_stats(&worker->sweep_stats[step], NULL);
+        }
+
+        if (worker->shard == NULL || worker->probes == NULL || (options.sweep_step > 0 && worker->sweep_stats == NULL))
+        {
+            perror("calloc(3)");
+            free(index);
+            free(shard_of);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < num_targets; i++)
+    {
+        struct worker *worker = &workers[index[shard_of[i]]];
+        worker->shard[worker->num_shard++] = i;
+    }
+
+    free(index);
+    free(shard_of);
+    return 0;
+}
+
+/**
+ * Frees the workers and closes their sockets.
+ */
+void free_workers(void)
+{
+    for (int i = 0; workers != NULL && i < num_workers; i++)
+    {
+        close(workers[i].socks[0]);
+        close(workers[i].socks[1]);
+        free(workers[i].shard);
+        free(workers[i].probes);
+        free(workers[i].sweep_stats);
+        free(workers[i].capture);
+    }
+
+    free(workers);
+}
+
+/**
+ * Runs the probe loop of a worker over its shard of the targets, until all its requests were answered
+ * or timed out, or until the workers are stopped.
+ * @param worker Pointer to the worker.
+ * @return 0 on success, or 1 on error.
+ */
+int probe_targets(struct worker *worker)
+{
+    // The sequence number of the next ping request, shared by all the targets of the worker.
+    // It starts at 0 and is incremented by 1 for each new request.
+    // Good for identifying the order of the requests, and for matching the replies to their requests.
+    int seq = 0;
+
+    // Each target gets one request per interval (-i), and the requests to the different targets are spread evenly
+    // over that time. In flood mode batches of requests are sent as long as the replies keep up with them.
+    worker->base_interval = options.flood ? 0 : options.interval * 1000.0 / worker->num_shard;
+    worker->send_interval = worker->base_interval;
+    int window = options.batch * FLOOD_WINDOW; // Number of requests in flight before the flood waits for replies
+
+    double next_send = monotonic_time_ms(); // Time at which the next request is due
+    long total = (options.count == -1) ? -1 : (long)options.count * worker->num_shard; // Number of requests to send
+
+    // The main loop of the worker.
+    // Sending and receiving are decoupled: requests are sent on their schedule, and replies are matched
+    // to the outstanding probes whenever they arrive, so a lost reply doesn't stall the following requests.
+    while (keep_running)
+    {
+        double now = monotonic_time_ms();
+        int sending = (total == -1 || seq < total); // Whether there are still requests to send
+
+        // In flood mode, send a batch while the window has room, and at least every FLOOD_INTERVAL
+        // so that lost replies can't stall the flood.
+        if (options.flood && sending && (worker->outstanding < window || now >= next_send))
+        {
+            if (flood_send(worker, &seq, total) != 0)
+                return 1;
+
+            next_send = now + FLOOD_INTERVAL;
+            sending = (total == -1 || seq < total);
+        }
+
+        // Send all the requests that are due, as long as there is room for them in the probe table.
+        // The targets are probed in a round-robin order.
+        while (!options.flood && sending && now >= next_send && !worker->probes[seq % MAX_INFLIGHT].in_flight)
+        {
+            struct timespec send_time;
+            monotonic_time(&send_time); // Record the send time of the probe
+
+            int target_index = worker->shard[seq % worker->num_shard];
+
+            if (send_request(worker, target_index, seq, next_payload_size(&targets[target_index]), &send_time) != 0)
+                return 1;
+
+            seq++;
+            next_send += next_gap(worker); // From the deadline rather than from now, so the schedule doesn't drift
+            sending = (total == -1 || seq < total);
+        }
+
+        expire_probes(worker, now, seq);
+
+        // Stop once all the requests were sent and each of them was either answered or timed out.
+        if (!sending && worker->outstanding == 0)
+            break;
+
+        // Sleep until the next request is due or the oldest probe expires, whichever comes first,
+        // unless a reply arrives earlier.
+        double wait = sending ? next_send - now : TIMEOUT;
+
+        if (options.flood && sending && worker->outstanding < window)
+            wait = 0; // Only collect the replies that are already there before the next batch
+
+        if (worker->outstanding > 0)
+        {
+            double expiry = worker->probes[worker->oldest_seq % MAX_INFLIGHT].send_time + TIMEOUT - now;
+            wait = (expiry < wait) ? expiry : wait;
+        }
+
+        // Send the queued requests and sleep until the deadline, unless a reply arrives or the workers are stopped.
+        // The reporter doesn't wait for a sleeping worker, which records nothing until it's back online.
+        if (options.report_interval > 0)
+            report_offline(worker->index);
+
+        if (engine_wait((wait > 0) ? now + wait : 0) != 0)
+            return 1;
+
+        if (options.report_interval > 0)
+            report_quiescent(worker->index);
+
+        // With -M do, the kernel refuses the requests larger than the path MTU rather than fragmenting them
+        if (engine_oversized() > worker->oversized)
+        {
+            worker->oversized = engine_oversized();
+            fprintf(stderr, "Local error: message too long for the path MTU (%lu requests refused)\n", worker->oversized);
+        }
+
+        if (receive_replies(worker) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Probes one size of the path MTU search: sends echo requests of that size, with DF set, until one is answered,
+ * a "message too long" error comes back for it, or PMTU_TRIES of them are lost.
+ * The errors are read from the error queue of the socket, with the MTU that was exceeded: the MTU of the interface
+ * when the kernel refuses the request, the next-hop MTU when a router sends back a Fragmentation Needed (IPv4)
+ * or a Packet Too Big (IPv6).
+ * @param worker Pointer to the worker, whose only target is the one of the search.
+ * @param seq Pointer to the sequence number of the next request, advanced past the requests sent.
+ * @param mtu The size to probe, as the size of the IP packet.
+ * @param error Pointer to the structure receiving the error, for PMTU_TOO_BIG.
+ * @return PMTU_REPLY, PMTU_TOO_BIG or PMTU_SILENT, or -1 on error or if the workers were stopped.
+ */
+int probe_mtu(struct worker *worker, int *seq, int mtu, struct mtu_error *error)
+{
+    struct ping_target *target = &targets[worker->shard[0]];
+    int v6 = (target->addr.type == 6);
+    int size = mtu - (v6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr)) - sizeof(struct icmphdr); // Size of the payload
+
+    for (int try = 0; try < PMTU_TRIES && keep_running; try++)
+    {
+        struct timespec send_time;
+        struct probe *probe = &worker->probes[*seq % MAX_INFLIGHT];
+        unsigned long oversized = engine_oversized();
+        int probe_seq = (*seq)++;
+
+        monotonic_time(&send_time);
+
+        if (send_request(worker, worker->shard[0], probe_seq, size, &send_time) != 0)
+            return -1;
+
+        double deadline = probe->send_time + PMTU_TIMEOUT;
+
+        while (keep_running && probe->in_flight && monotonic_time_ms() < deadline)
+        {
+            struct engine_packet packet;
+            int ret;
+
+            if (engine_wait(deadline) != 0)
+                return -1;
+
+            // An error quotes the request it's about, except a local one, which is about the request just sent
+            while (read_mtu_error(worker->socks[v6], target->addr.type, error) > 0)
+            {
+                if (!error->quoted || error->seq == (probe_seq & 0xFFFF))
+                {
+                    probe->in_flight = 0;
+                    worker->outstanding--;
+                    return PMTU_TOO_BIG;
+                }
+            }
+
+            // Refused by the kernel without an error on the queue: the MTU is the one it knows for the path
+            if (engine_oversized() > oversized)
+            {
+                memset(error, 0, sizeof(*error));
+                error->mtu = path_mtu(worker->socks[v6], target->addr.type);
+                error->local = 1;
+                probe->in_flight = 0;
+                worker->outstanding--;
+                return PMTU_TOO_BIG;
+            }
+
+            while ((ret = engine_receive(&packet)) > 0)
+                handle_packet(worker, target->addr.type, packet.data, packet.len, &packet.source, &packet.times);
+
+            if (ret < 0)
+                return -1;
+        }
+
+        if (!probe->in_flight)
+            return PMTU_REPLY;
+
+        probe->in_flight = 0; // Lost, a late reply only counts as late
+        worker->outstanding--;
+    }
+
+    return keep_running ? PMTU_SILENT : -1;
+}
+
+/**
+ * Searches the path MTU to the only target: the largest packet that gets through without being fragmented.
+ * It starts from the -s size, or from the path MTU the kernel knows (at most the MTU of the interface, lowered by
+ * the errors it already received, so -s finds a path MTU that grew back), and narrows the range between
+ * the largest size that was answered and the smallest one that wasn't. An MTU reported by an error is tried next,
+ * otherwise the range is halved, which also finds the path MTU of a black hole: a link that drops the packets
+ * too large for it without sending back any error.
+ * @param worker Pointer to the worker.
+ * @return 0 on success, or 1 on error.
+ */
+int discover_pmtu(struct worker *worker)
+{
+    struct ping_target *target = &targets[worker->shard[0]];
+    int v6 = (target->addr.type == 6);
+    int headers = (v6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr)) + sizeof(struct icmphdr);
+    int lowest = v6 ? PMTU_MIN_IPV6 : PMTU_MIN_IPV4; // Every link carries packets of this size
+    int mtu = (options.search_size >= 0) ? options.search_size + headers : path_mtu(worker->socks[v6], target->addr.type);
+    int seq = 0;
+
+    if (mtu < 0)
+    {
+        perror("getsockopt(IP_MTU)");
+        return 1;
+    }
+
+    mtu = (mtu > MAX_PACKET) ? MAX_PACKET : (mtu < lowest) ? lowest : mtu;
+
+    int passed = lowest - 1; // Largest size that was answered (none yet)
+    int failed = mtu + 1; // Smallest size that didn't get through
+    int silent = 0; // Whether a size was lost without any error
+
+    char host[HOST_STRLEN];
+    printf("Path MTU discovery to %s, from %d to %d bytes\n", target_host(target, host, sizeof(host)), lowest, mtu);
+
+    for (int size = mtu; passed + 1 < failed; )
+    {
+        struct mtu_error error;
+        int result = probe_mtu(worker, &seq, size, &error);
+        int next = -1; // Size suggested by an error
+
+        if (result < 0)
+            return keep_running ? 1 : 0;
+
+        if (result == PMTU_REPLY)
+            passed = size;
+
+        else if (result == PMTU_TOO_BIG)
+        {
+            char offender[ADDRESS_STRLEN];
+
+            // Everything above the reported MTU fails too, so it's the next size to try
+            next = error.mtu;
+            failed = (next > passed && next < size) ? next + 1 : size;
+
+            if (error.local)
+                printf("%d bytes: message too long, local mtu=%d\n", size, error.mtu);
+
+            else
+            {
+                format_address(&error.offender, offender, sizeof(offender));
+                printf("%d bytes: %s from %s, mtu=%d\n", size, v6 ? "packet too big" : "fragmentation needed", offender, error.mtu);
+            }
+        }
+
+        else
+        {
+            failed = size;
+            silent = 1;
+            printf("%d bytes: no reply\n", size);
+        }
+
+        fflush(stdout);
+        size = (next > passed && next < failed) ? next : passed + (failed - passed) / 2;
+    }
+
+    if (passed < lowest)
+    {
+        printf("No reply from %s at any size\n", target_host(target, host, sizeof(host)));
+        return 0;
+    }
+
+    printf("Path MTU to %s: %d bytes (payload %d bytes)\n", target_host(target, host, sizeof(host)), passed, passed - headers);
+
+    if (silent)
+        printf("Larger packets were lost without any error: possible PMTU black hole above %d bytes\n", passed);
+
+    return 0;
+}
+
+/**
+ * Records the probes of a worker that were still waiting for their reply when it stopped, and writes out
+ * the rest of its capture records.
+ * @param worker Pointer to the worker.
+ */
+void finish_capture(struct worker *worker)
+{
+    for (int i = 0; i < MAX_INFLIGHT && worker->outstanding > 0; i++)
+    {
+        struct probe *probe = &worker->probes[i];
+
+        if (probe->in_flight)
+            capture_outcome(worker, &(struct probe_outcome){.outcome = OUTCOME_UNANSWERED, .target = probe->target,
+                                                            .seq = probe->target_seq + 1, .rtt = -1},
+                            &probe->sent.user);
+    }
+
+    capture_flush(worker->capture);
+}
+
+/**
+ * Main function of a worker thread: opens its engine, runs its probe loop, and tells the main thread it's over.
+ * On error, the other workers are stopped too.
+ * @param arg Pointer to the worker.
+ * @return NULL.
+ */
+void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+
+    prctl(PR_SET_TIMERSLACK, 1); // In nanoseconds, so the kernel wakes us up right on time
+
+    if (options.report_interval > 0)
+        report_quiescent(worker->index);
+
+    // The engine sends the queued requests, waits until the next deadline, and receives the replies in batches.
+    // It sleeps until an absolute monotonic deadline, so the schedule keeps its microsecond resolution and doesn't drift.
+    // Each worker has its own engine, watching its own sockets and the stop eventfd.
+    // Its buffers have room for the largest request, and for its reply with the IP header.
+    worker->ret = (engine_open(options.engine, options.batch, worker->templates[0].size + REPLY_HEADROOM) < 0) ||
+                  (worker->socks[0] >= 0 && engine_watch(worker->socks[0], 1) != 0) ||
+                  (worker->socks[1] >= 0 && engine_watch(worker->socks[1], 1) != 0) ||
+                  engine_watch(stop_fd, 0) != 0;
+
+    if (worker->ret == 0)
+        worker->ret = options.discover ? discover_pmtu(worker) : probe_targets(worker);
+
+    if (worker->ret != 0)
+        stop_workers();
+
+    if (worker->capture != NULL)
+        finish_capture(worker);
+
+    engine_close();
+    worker->self_stats = self_stats;
+
+    if (options.report_interval > 0)
+        report_offline(worker->index);
+
+    if (write(done_fd, &(unsigned long long){1}, sizeof(unsigned long long)) < 0)
+        perror("write(2)");
+
+    return NULL;
+}
+
+/**
+ * Starts the worker threads. With more than one, each is pinned to its own CPU (round-robin over the CPUs
+ * the process may run on), so its sockets, probe table and statistics stay in that CPU's caches.
+ * @return The number of workers started (all of them on success).
+ */
+int start_workers(void)
+{
+    cpu_set_t allowed;
+    int num_cpus = 0;
+    int cpus[CPU_SETSIZE]; // The CPUs the process may run on
+
+    if (num_workers > 1 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus[num_cpus++] = cpu;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+
+        if (num_cpus > 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            workers[i].cpu = cpus[i % num_cpus];
+            CPU_SET(workers[i].cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+
+        int ret = pthread_create(&workers[i].thread, &attr, run_worker, &workers[i]);
+        pthread_attr_destroy(&attr);
+
+        if (ret != 0)
+        {
+            fprintf(stderr, "Failed to start worker thread %d\n", i);
+            stop_workers();
+            return i;
+        }
+    }
+
+    return num_workers;
+}
+
+int main(int argc, char *argv[])
+{
+    if (parse_arguments(argc, argv, &options) != 0)
+    {
+        return 1;
+    }
+
+    // Build the list of targets, either the single -a address or the contents of the -l list.
+    if ((options.list != NULL) ? read_target_list(options.list) : add_target(options.type, options.address))
+    {
+        return 1;
+    }
+
+    if (num_targets == 0)
+    {
+        fprintf(stderr, "No targets to ping\n");
+        return 1;
+    }
+
+    // Block the signals we handle and read them from a signalfd in the main loop instead, so the statistics are
+    // never printed halfway through an update. They're blocked before any thread starts, so all threads inherit this.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT); // Ctrl+C
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGQUIT); // Ctrl+Backslash
+
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) != 0)
+    {
+        perror("sigprocmask(2)");
+        return 1;
+    }
+
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (signal_fd < 0)
+    {
+        perror("signalfd(2)");
+        return 1;
+    }
+
+    // The names of the targets are resolved by a pool of threads (started with the signals blocked), each address once.
+    // The replies are printed right away, with the name of their target once it's known.
+    if (options.resolve)
+    {
+        if (resolver_start(RESOLVER_THREADS, 0) != 0 || (options.hosts != NULL && resolver_load_hosts(options.hosts) != 0))
+            return 1;
+
+        for (int i = 0; i < num_targets; i++)
+            resolver_request(&targets[i].addr);
+    }
+
+    // The main thread wakes the workers up with stop_fd when they must stop, and they tell it they're over with done_fd
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (stop_fd < 0 || done_fd < 0)
+    {
+        perror("eventfd(2)");
+        return 1;
+    }
+
+    // Shard the targets across the workers, and create the sockets of each worker (one per IP type in use,
+    // shared by all the targets of that type in the shard).
+    if (shard_targets(options.threads) != 0)
+    {
+        free_workers();
+        return 1;
+    }
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (open_sockets(&workers[i]) != 0)
+        {
+            free_workers();
+            return 1;
+        }
+
+        workers[i].random[0] = getpid() ^ time(NULL); // Gaps of the Poisson mode
+        workers[i].random[1] = i;
+        build_templates(&workers[i], options.payload_size, options.pattern); // Prebuilt echo requests, filled in as they are sent
+    }
+
+    // The capture file starts with the targets, so their indexes are the ones of the targets. Each worker then buffers
+    // the records of its probes, and appends them in chunks.
+    if (options.capture != NULL)
+    {
+        if (capture_open(&writer, options.capture, CAPTURE_TOOL_PING, 0, options.payload_size, num_targets, TIMEOUT) != 0)
+        {
+            free_workers();
+            return 1;
+        }
+
+        for (int i = 0; i < num_targets; i++)
+            capture_address(&writer, &targets[i].addr);
+
+        capture_flush(&writer.buffer); // Ahead of the records of the workers
+
+        for (int i = 0; i < num_workers; i++)
+        {
+            workers[i].capture = malloc(sizeof(struct capture_buffer));
+
+            if (workers[i].capture == NULL)
+            {
+                perror("malloc(3)");
+                capture_close(&writer);
+                free_workers();
+                return 1;
+            }
+
+            capture_buffer_init(workers[i].capture, &writer);
+        }
+    }
+
+    // The reporter thread writes out the statistics of each interval while the probes keep going.
+    const char **report_names = NULL; // Names of the targets, as the reporter prints them
+
+    if (options.report_interval > 0)
+    {
+        report_names = malloc(num_targets * sizeof(char *));
+
+        if (report_names == NULL)
+        {
+            perror("malloc(3)");
+            free_workers();
+            return 1;
+        }
+
+        for (int i = 0; i < num_targets; i++)
+            report_names[i] = targets[i].name;
+
+        if (start_reporter(options.report_output, options.report_format, num_targets, report_names, num_workers) != 0)
+        {
+            free(report_names);
+            free_workers();
+            return 1;
+        }
+    }
+
+    if (options.sweep_step > 0)
+        fprintf(stdout, "Pinging %s with %d to %d bytes of data, by %d:\n", (num_targets > 1) ? "the targets" : options.address,
+                options.sweep_min, options.sweep_max, options.sweep_step);
+
+    else if (num_targets > 1)
+        fprintf(stdout, "Pinging %d targets with %d bytes of data:\n", num_targets, options.payload_size);
+
+    else if (!options.discover) // The path MTU search prints its own header
+        fprintf(stdout, "Pinging %s with %d bytes of data:\n", options.address, options.payload_size);
+
+    fflush(stdout);
+    if (options.self_stats)
+        instrument_enable();
+
+    start_time = monotonic_time_ms(); // Record the start time
+
+    for (int i = 0; i < num_workers; i++)
+        workers[i].stats.start_time = start_time;
+
+    // The main thread only handles the signals and hands the statistics of each elapsed interval over to the
+    // reporter thread, while the workers probe their shards.
+    int started = start_workers();
+    int finished = 0; // Number of workers that are over
+    double next_report = start_time + options.report_interval * 1000; // Time at which the next report is due
+    struct pollfd fds[2] = {{.fd = signal_fd, .events = POLLIN}, {.fd = done_fd, .events = POLLIN}};
+
+    while (finished < started)
+    {
+        int timeout = -1;
+
+        if (options.report_interval > 0)
+        {
+            double now = monotonic_time_ms();
+
+            if (now >= next_report)
+            {
+                rotate_report();
+
+                while (next_report <= now)
+                    next_report += options.report_interval * 1000;
+            }
+
+            timeout = (int)(next_report - now) + 1;
+        }
+
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll(2)");
+            stop_workers();
+        }
+
+        if (fds[0].revents & POLLIN)
+            handle_signals(signal_fd);
+
+        unsigned long long count;
+
+        if ((fds[1].revents & POLLIN) && read(done_fd, &count, sizeof(count)) == sizeof(count))
+            finished += count;
+    }
+
+    int ret = (started < num_workers);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        ret |= workers[i].ret;
+    }
+
+    if (options.capture != NULL && capture_close(&writer) != 0)
+        ret = 1;
+
+    display_statistics(); // Display statistics
+
+    if (options.sweep_step > 0)
+        display_sweep();
+
+    if (options.self_stats)
+        display_self_stats();
+
+    if (options.report_interval > 0)
+    {
+        stop_reporter(); // Report the last, partial interval
+        free(report_names);
+    }
+
+    // Close the sockets, free the workers and the targets, and return to the operating system.
+    free_workers();
+    close(signal_fd);
+    close(stop_fd);
+    close(done_fd);
+    free(target_table);
+    free(targets);
+    return ret;
+}
@@ -1,11 +1,49 @@
 #ifndef _PING_H
 #define _PING_H
 
-#define TIMEOUT 10000  // 10 seconds timeout
-#define BUFFER_SIZE 1024
-#define SLEEP_TIME 1 // seconds
+#define TIMEOUT 10000  // 10 seconds timeout (per probe)
+#define BUFFER_SIZE 65536 // Room for the largest echo request
+#define DEFAULT_PAYLOAD 64 // Default payload size of the echo requests, in bytes
+#define MAX_PACKET 65535 // Largest IP packet
+#define MAX_PAYLOAD (MAX_PACKET - 20 - 8) // Largest payload of an echo request, in an IPv4 packet without options
+#define REPLY_HEADROOM 60 // Room for the IP header (with options) of the replies, on top of the echo request
+#define MAX_PATTERN 16 // Maximum size of the payload pattern (-p), in bytes
+#define SLEEP_TIME 1 // seconds, default interval between two requests to a target
+#define FLOOD_BATCH 32 // Default number of packets per sendmmsg/recvmmsg call in flood mode
+#define FLOOD_MAX_BATCH 1024 // Maximum batch size in flood mode
+#define FLOOD_WINDOW 8 // Batches in flight before the flood waits for replies
+#define FLOOD_INTERVAL 10 // milliseconds, the flood sends a batch at least this often
+#define FLOOD_RCVBUF (4 * 1024 * 1024) // Receive buffer size of the sockets in flood mode
 
-// Function prototype
-unsigned short int calculate_checksum(void *data, unsigned int bytes);
+// Pacing of the requests
+#define PACING_FIXED 0 // One request per interval, on an absolute schedule that doesn't drift
+#define PACING_ADAPTIVE 1 // The interval grows under loss and shrinks back as the replies come in
+#define PACING_POISSON 2 // Exponentially distributed gaps with the interval as their mean (unbiased sampling)
+#define ADAPTIVE_MAX_BACKOFF 16 // The adaptive interval grows up to this many times the -i interval
+#define ADAPTIVE_RECOVERY 0.9 // Each reply shrinks the adaptive interval by this factor, down to the -i interval
+
+// Payload size sweep (-S)
+#define SWEEP_MAX_STEPS 256 // Maximum number of payload sizes in a sweep
+#define SWEEP_DEFAULT_STEPS 32 // Number of payload sizes in a sweep whose step isn't given
+#define SWEEP_BAR_WIDTH 40 // Width of the bars plotting the median round-trip time of each size
+
+// Path MTU discovery (-D)
+#define PMTU_TIMEOUT 1000 // milliseconds, time after which a probe of the search is considered lost
+#define PMTU_TRIES 3 // Lost probes of a size before the search assumes the size doesn't get through
+#define PMTU_MIN_IPV4 68 // Smallest MTU of an IPv4 link (RFC 791)
+#define PMTU_MIN_IPV6 1280 // Smallest MTU of an IPv6 link (RFC 8200)
+#define PMTU_REPLY 0 // Outcomes of the probes of a size: answered,
+#define PMTU_TOO_BIG 1 // refused with a "message too long" error (local, Fragmentation Needed or Packet Too Big),
+#define PMTU_SILENT 2 // or lost without any error
+
+// Classes of an echo reply, besides the REPLY_* kinds of stats.h
+#define REPLY_ANSWER -1 // The first reply to a probe in flight, in order
+
+#define OPT_SELF_STATS 256 // getopt_long values of --self-stats and --hosts, past the values of the single-character options
+#define OPT_HOSTS 257
+
+#define MAX_WORKERS 64 // Maximum number of worker threads (-T)
+
+#define MAX_INFLIGHT 65536 // Maximum number of probes waiting for their reply at the same time, per worker (must divide 65536)
 
 #endif // _PING_H
\ No newline at end of file
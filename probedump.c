@@ -0,0 +1,732 @@
+#include <stdio.h> // Standard input/output definitions
+#include <stdlib.h> // calloc, realloc, free
+#include <string.h> // memset
+#include <unistd.h> // getopt
+#include <endian.h> // le32toh, le64toh
+#include "capture.h" // Capture files written by ping and traceroute (-w)
+#include "netaddr.h" // IPv4 and IPv6 addresses
+#include "timestamp.h" // Names of the timestamp sources
+#include "stats.h" // Round-trip time statistics, as ping keeps them
+#include "traceroute.h" // MAX_HOPS and TRIES_PER_HOP, as traceroute prints its hops
+
+// Reads capture files (ping -w, traceroute -w): prints their probes the way the programs printed them, and the
+// statistics of ping's targets. With several files, the files are merged by the send time of their probes, so
+// the captures of many probers (or of many runs) read as one; each file is read in the order it was written.
+// The files are mapped in memory, so a large capture is read at the speed of the page cache.
+
+#define DUMP_HOP_PROBES 128 // Probes of a hop gathered before it's printed (more than the multipath mode sends)
+
+// Structure to hold a target of ping, whose statistics are merged across the files
+struct dump_target
+{
+    struct net_addr addr; // Address of the target
+    char name[ADDRESS_STRLEN]; // The address as a string, for printing
+    struct ping_stats stats; // Statistics of the target
+};
+
+// Structure to hold a capture file being read
+struct input
+{
+    struct capture_file file; // The mapped file
+    size_t next; // Index of the next record to read
+    int tool; // CAPTURE_TOOL_* of the current session
+    int flags; // Flags of the current session (CAPTURE_MULTIPATH)
+    int size; // Payload (ping) or probe (traceroute) size of the current session
+    int targets; // Number of targets of the current session
+    uint64_t timeout; // Time after which the probes of the current session were given up, in nanoseconds
+    uint64_t start; // Wall-clock time the current session started, in nanoseconds since the epoch
+    struct net_addr *addresses; // Addresses of the current session, by index
+    int *summary; // Index of the target of each address among dump_targets, or -1 until it's looked up
+    unsigned int num_addresses; // Number of addresses of the current session
+    unsigned int capacity; // Number of addresses the arrays have room for
+    struct probe_outcome probe; // The next probe record, decoded
+    uint64_t time; // Wall-clock time the next probe was sent, in nanoseconds since the epoch (the merge key)
+    struct probe_outcome hop[DUMP_HOP_PROBES]; // Probes of the hop of traceroute being gathered
+    int hop_count; // Number of probes of that hop
+    int tracing; // Whether a trace of the current session is being printed
+    unsigned int trace_target; // Index of the destination of that trace
+};
+
+// Global variables
+static struct dump_target *dump_targets = NULL; // Targets of ping, in the order they were first seen
+static int num_targets = 0; // Number of targets
+static int *target_table = NULL; // Hash table of the targets keyed by address (index + 1 into dump_targets, 0 for an empty slot)
+static unsigned int target_table_size = 0; // Number of slots in the hash table (power of 2)
+static struct ping_stats total; // Statistics of all the targets
+static struct histogram total_histogram; // Fine histogram of the statistics of all the targets
+static uint64_t first_sent = UINT64_MAX; // Wall-clock time the first probe of ping was sent, in nanoseconds since the epoch
+static uint64_t last_event = 0; // Wall-clock time of the last send or reply of ping, in nanoseconds since the epoch
+
+static int quiet = 0; // Whether to print the statistics only (-q)
+static int print_time = 0; // Whether to print the wall-clock time of each line (-t)
+static unsigned long skipped = 0; // Records that were skipped, being unknown or inconsistent
+
+/**
+ * Finds a target of ping by address, or adds it.
+ * @param addr Pointer to the address.
+ * @return The index of the target, or -1 on error.
+ */
+static int find_target(const struct net_addr *addr)
+{
+    // Keep the hash table at most half full, rebuilding it when it grows.
+    if ((unsigned int)(num_targets + 1) * 2 > target_table_size)
+    {
+        unsigned int size = (target_table_size == 0) ? 32 : target_table_size * 2;
+        int *table = calloc(size, sizeof(int));
+        struct dump_target *new_targets = realloc(dump_targets, size / 2 * sizeof(struct dump_target));
+
+        if (table == NULL || new_targets == NULL)
+        {
+            perror("calloc(3)");
+            free(table);
+            dump_targets = (new_targets != NULL) ? new_targets : dump_targets;
+            return -1;
+        }
+
+        dump_targets = new_targets;
+
+        for (int i = 0; i < num_targets; i++)
+        {
+            unsigned int slot = hash_address(dump_targets[i].addr.type, address_bytes(&dump_targets[i].addr)) & (size - 1);
+
+            while (table[slot] != 0)
+                slot = (slot + 1) & (size - 1);
+
+            table[slot] = i + 1;
+        }
+
+        free(target_table);
+        target_table = table;
+        target_table_size = size;
+    }
+
+    const void *bytes = address_bytes(addr);
+    unsigned int slot = hash_address(addr->type, bytes) & (target_table_size - 1);
+
+    while (target_table[slot] != 0)
+    {
+        if (same_address(&dump_targets[target_table[slot] - 1].addr, addr->type, bytes))
+            return target_table[slot] - 1;
+
+        slot = (slot + 1) & (target_table_size - 1);
+    }
+
+    struct dump_target *target = &dump_targets[num_targets];
+    target->addr = *addr;
+    format_address(addr, target->name, sizeof(target->name));
+    reset_stats(&target->stats, NULL);
+    target_table[slot] = ++num_targets;
+    return num_targets - 1;
+}
+
+/**
+ * Prints the wall-clock time of a line (-t).
+ * @param time The time, in nanoseconds since the epoch.
+ */
+static void display_time(uint64_t time)
+{
+    if (print_time)
+        printf("[%llu.%06llu] ", (unsigned long long)(time / 1000000000), (unsigned long long)(time % 1000000000 / 1000));
+}
+
+/**
+ * Prints a probe of ping the way ping printed it.
+ * @param input Pointer to the input the probe was read from.
+ * @param probe Pointer to the probe.
+ */
+static void display_ping_probe(const struct input *input, const struct probe_outcome *probe)
+{
+    char host[ADDRESS_STRLEN];
+    format_address(&input->addresses[probe->target], host, sizeof(host));
+
+    switch (probe->outcome)
+    {
+    case OUTCOME_REPLY:
+    case OUTCOME_REORDERED:
+        display_time(input->time + (uint64_t)(probe->rtt * 1000000));
+        printf("%d bytes from %s: icmp_seq=%u ttl=%d time=%.3fms ts=%s%s\n", probe->size, host, probe->seq, probe->ttl,
+               probe->rtt, timestamp_source_name(probe->source), (probe->outcome == OUTCOME_REORDERED) ? " (out of order)" : "");
+        break;
+    case OUTCOME_DUPLICATE:
+    case OUTCOME_LATE:
+    case OUTCOME_CORRUPTED:
+        display_time(input->time + (uint64_t)((probe->rtt > 0) ? probe->rtt * 1000000 : 0));
+        printf("%d bytes from %s: ", probe->size, host);
+
+        if (probe->seq != CAPTURE_NONE)
+            printf("icmp_seq=%u ", probe->seq);
+
+        printf("ttl=%d", probe->ttl);
+
+        if (probe->rtt >= 0)
+            printf(" time=%.3fms", probe->rtt);
+
+        if (probe->outcome == OUTCOME_CORRUPTED)
+            printf(" (%s)\n", probe->bad_checksum ? "bad checksum" : "corrupted payload");
+
+        else
+            printf(" (%s)\n", (probe->outcome == OUTCOME_DUPLICATE) ? "DUP!" : "late");
+
+        break;
+    case OUTCOME_TIMEOUT:
+        display_time(input->time + input->timeout);
+
+        if (input->targets > 1)
+            printf("Request timeout for %s icmp_seq %u\n", host, probe->seq);
+
+        else
+            printf("Request timeout for icmp_seq %u\n", probe->seq);
+
+        break;
+    default:
+        break; // The probes left unanswered at the end of a run weren't printed
+    }
+}
+
+/**
+ * Accounts a probe of ping in the statistics of its target and in the totals, the way ping did.
+ * @param input Pointer to the input the probe was read from.
+ * @param probe Pointer to the probe.
+ * @return 0 on success, or 1 on error.
+ */
+static int account_ping_probe(struct input *input, const struct probe_outcome *probe)
+{
+    int *index = &input->summary[probe->target];
+
+    if (*index < 0)
+        *index = find_target(&input->addresses[probe->target]);
+
+    if (*index < 0)
+        return 1;
+
+    struct ping_stats *stats = &dump_targets[*index].stats;
+    uint64_t event = input->time;
+
+    switch (probe->outcome)
+    {
+    case OUTCOME_REPLY:
+    case OUTCOME_REORDERED:
+        record_transmit(stats);
+        record_transmit(&total);
+        record_rtt(stats, probe->rtt);
+        record_rtt(&total, probe->rtt);
+        event += (uint64_t)(probe->rtt * 1000000);
+
+        if (probe->outcome == OUTCOME_REORDERED)
+        {
+            record_reply(stats, REPLY_REORDERED);
+            record_reply(&total, REPLY_REORDERED);
+        }
+
+        break;
+    case OUTCOME_DUPLICATE:
+    case OUTCOME_LATE:
+    case OUTCOME_CORRUPTED:
+    {
+        int kind = (probe->outcome == OUTCOME_DUPLICATE) ? REPLY_DUPLICATE : (probe->outcome == OUTCOME_LATE) ? REPLY_LATE : REPLY_CORRUPTED;
+        record_reply(stats, kind);
+        record_reply(&total, kind);
+        break;
+    }
+    case OUTCOME_TIMEOUT:
+        record_transmit(stats);
+        record_transmit(&total);
+        event += input->timeout;
+        break;
+    default: // Unanswered when the run ended
+        record_transmit(stats);
+        record_transmit(&total);
+        break;
+    }
+
+    first_sent = (input->time < first_sent) ? input->time : first_sent;
+    last_event = (event > last_event) ? event : last_event;
+    return 0;
+}
+
+/**
+ * Prints the gathered hop of traceroute the way traceroute printed it: the first responder and the round-trip
+ * times of the answered probes, or in the multipath mode each responder with the flows that went through it.
+ * @param input Pointer to the input.
+ */
+static void display_hop(struct input *input)
+{
+    struct probe_outcome *hop = input->hop;
+    int count = input->hop_count;
+    char host[ADDRESS_STRLEN];
+
+    if (count == 0)
+        return;
+
+    input->hop_count = 0;
+    display_time(input->start + hop[0].sent);
+
+    if (input->flags & CAPTURE_MULTIPATH)
+    {
+        int printed[DUMP_HOP_PROBES] = {0}; // Whether the responder of a probe was already printed
+        int interfaces = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (hop[i].outcome != OUTCOME_REPLY || printed[i])
+                continue;
+
+            int flows = 0;
+            double min_rtt = hop[i].rtt, total_rtt = 0;
+
+            for (int j = i; j < count; j++)
+            {
+                if (hop[j].outcome == OUTCOME_REPLY && hop[j].responder == hop[i].responder)
+                {
+                    printed[j] = 1;
+                    flows++;
+                    total_rtt += hop[j].rtt;
+                    min_rtt = (hop[j].rtt < min_rtt) ? hop[j].rtt : min_rtt;
+                }
+            }
+
+            format_address(&input->addresses[hop[i].responder], host, sizeof(host));
+
+            if (interfaces++ == 0)
+                printf("%2d  ", hop[i].ttl);
+
+            else
+                printf("    ");
+
+            printf("%-15s  %2d/%d flows  %.3f/%.3fms  (%s)\n", host, flows, count, min_rtt, total_rtt / flows,
+                   timestamp_source_name(hop[i].source));
+        }
+
+        if (interfaces == 0)
+            printf("%2d  * * *\n", hop[0].ttl);
+
+        return;
+    }
+
+    int first = -1; // The first answered probe, whose responder is printed
+    int replies = 0;
+    int source = TS_SOURCE_USER;
+
+    printf("%2d  ", hop[0].ttl);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (hop[i].outcome == OUTCOME_REPLY)
+        {
+            first = (first < 0) ? i : first;
+            source = hop[i].source;
+            replies++;
+        }
+    }
+
+    if (first < 0)
+    {
+        printf("* * *\n");
+        return;
+    }
+
+    format_address(&input->addresses[hop[first].responder], host, sizeof(host));
+    printf("%s  ", host);
+
+    int printed = 0;
+    int slots = (count > TRIES_PER_HOP) ? count : TRIES_PER_HOP;
+
+    for (int i = 0; i < slots; i++)
+    {
+        // The answered probes first, then a "*" for each missing reply
+        while (printed < count && hop[printed].outcome != OUTCOME_REPLY)
+            printed++;
+
+        if (i < replies)
+            printf("%.3fms", hop[printed++].rtt);
+
+        else
+            printf("*");
+
+        if (i < slots - 1)
+            printf("  ");
+    }
+
+    printf("  (%s)\n", timestamp_source_name(source));
+}
+
+/**
+ * Ends the trace of traceroute being printed: prints its last hop, and the blank line that follows each trace
+ * of the multi-destination mode.
+ * @param input Pointer to the input.
+ */
+static void end_trace(struct input *input)
+{
+    if (!input->tracing)
+        return;
+
+    display_hop(input);
+
+    if (input->targets > 1)
+        printf("\n");
+
+    input->tracing = 0;
+}
+
+/**
+ * Gathers a probe of traceroute into its hop, printing the previous hop (and the header of a new trace) first.
+ * @param input Pointer to the input the probe was read from.
+ * @param probe Pointer to the probe.
+ */
+static void display_trace_probe(struct input *input, const struct probe_outcome *probe)
+{
+    if (input->hop_count > 0)
+    {
+        const struct probe_outcome *last = &input->hop[input->hop_count - 1];
+
+        if (last->target != probe->target || last->ttl != probe->ttl || input->hop_count == DUMP_HOP_PROBES)
+            display_hop(input);
+    }
+
+    // A trace starts at its first TTL, or when the destination changes
+    if (input->tracing && (input->trace_target != probe->target || (probe->ttl == 1 && probe->seq == 0)))
+        end_trace(input);
+
+    if (!input->tracing)
+    {
+        char host[ADDRESS_STRLEN];
+        format_address(&input->addresses[probe->target], host, sizeof(host));
+        display_time(input->time);
+        printf("traceroute to %s, %d hops max, %d byte packets\n", host, MAX_HOPS, input->size);
+        input->tracing = 1;
+        input->trace_target = probe->target;
+    }
+
+    input->hop[input->hop_count++] = *probe;
+}
+
+/**
+ * Starts a session of an input: forgets the addresses of the previous one, and prints the header ping printed.
+ * @param input Pointer to the input.
+ * @param session Pointer to the session record.
+ */
+static void start_session(struct input *input, const struct capture_session *session)
+{
+    end_trace(input);
+    input->tool = session->tool;
+    input->flags = session->flags;
+    input->size = le32toh(session->size);
+    input->targets = le32toh(session->targets);
+    input->timeout = (uint64_t)le32toh(session->timeout) * 1000000;
+    input->start = le64toh(session->start);
+    input->num_addresses = 0;
+}
+
+/**
+ * Prints the header of a ping session, once its addresses are read (the first one is the target of a single-target run).
+ * @param input Pointer to the input.
+ */
+static void display_ping_header(const struct input *input)
+{
+    char host[ADDRESS_STRLEN];
+
+    if (quiet)
+        return;
+
+    display_time(input->start);
+
+    if (input->targets > 1)
+        printf("Pinging %d targets with %d bytes of data:\n", input->targets, input->size);
+
+    else
+    {
+        format_address(&input->addresses[0], host, sizeof(host));
+        printf("Pinging %s with %d bytes of data:\n", host, input->size);
+    }
+}
+
+/**
+ * Reads the records of an input up to its next probe record: the sessions and the addresses that precede it.
+ * @param input Pointer to the input.
+ * @return 1 if a probe record is ready, 0 at the end of the file, or -1 on error.
+ */
+static int advance(struct input *input)
+{
+    while (input->next < input->file.count)
+    {
+        const union capture_record *record = &input->file.records[input->next++];
+
+        switch (record->kind)
+        {
+        case CAPTURE_SESSION:
+            start_session(input, &record->session);
+            break;
+        case CAPTURE_ADDRESS:
+        {
+            unsigned int index = le32toh(record->address.index);
+
+            // The writer gives the indexes in order, so a later one would leave slots without an address
+            if (index > input->num_addresses)
+            {
+                skipped++;
+                break;
+            }
+
+            if (index >= input->capacity)
+            {
+                unsigned int capacity = (input->capacity > 0) ? input->capacity * 2 : 64;
+                struct net_addr *addresses = realloc(input->addresses, capacity * sizeof(struct net_addr));
+                int *summary = (addresses != NULL) ? realloc(input->summary, capacity * sizeof(int)) : NULL;
+
+                if (addresses != NULL)
+                    input->addresses = addresses;
+
+                if (summary == NULL)
+                {
+                    perror("realloc(3)");
+                    return -1;
+                }
+
+                input->summary = summary;
+                input->capacity = capacity;
+            }
+
+            capture_decode_address(&record->address, &input->addresses[index]);
+            input->summary[index] = -1;
+            input->num_addresses = (index == input->num_addresses) ? index + 1 : input->num_addresses;
+
+            if (input->tool == CAPTURE_TOOL_PING && input->num_addresses == (unsigned int)input->targets &&
+                index == input->num_addresses - 1)
+                display_ping_header(input); // All the targets of the run are known
+
+            break;
+        }
+        case CAPTURE_PROBE:
+            capture_decode_probe(&record->probe, &input->probe);
+
+            if (input->probe.target >= input->num_addresses ||
+                (input->probe.responder != CAPTURE_NONE && input->probe.responder >= input->num_addresses))
+            {
+                skipped++; // Refers to an address the file doesn't name
+                break;
+            }
+
+            input->time = input->start + input->probe.sent;
+            return 1;
+        default:
+            skipped++;
+            break;
+        }
+    }
+
+    end_trace(input);
+    return 0;
+}
+
+/**
+ * Handles the next probe record of an input.
+ * @param input Pointer to the input.
+ * @return 0 on success, or 1 on error.
+ */
+static int handle_probe(struct input *input)
+{
+    if (input->tool == CAPTURE_TOOL_TRACEROUTE)
+    {
+        if (!quiet)
+            display_trace_probe(input, &input->probe);
+
+        return 0;
+    }
+
+    if (!quiet)
+        display_ping_probe(input, &input->probe);
+
+    return account_ping_probe(input, &input->probe);
+}
+
+/**
+ * Moves an input of the merge heap up or down to its place, by the send time of its next probe.
+ * @param heap The heap of inputs (the one with the earliest next probe first).
+ * @param size Number of inputs in the heap.
+ * @param i Index of the input to move.
+ */
+static void sift(struct input **heap, int size, int i)
+{
+    while (i > 0 && heap[i]->time < heap[(i - 1) / 2]->time)
+    {
+        struct input *swap = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+
+    for (;;)
+    {
+        int smallest = i;
+
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < size; child++)
+        {
+            if (heap[child]->time < heap[smallest]->time)
+                smallest = child;
+        }
+
+        if (smallest == i)
+            return;
+
+        struct input *swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+/**
+ * Prints the number of each kind of anomalous reply, as ", N <kind>" items of the current summary line.
+ * @param stats Pointer to the statistics.
+ */
+static void display_replies(const struct ping_stats *stats)
+{
+    for (int kind = 0; kind < REPLY_KINDS; kind++)
+    {
+        if (stats->replies[kind] > 0)
+            printf(", %d %s", stats->replies[kind], reply_kind_name(kind));
+    }
+}
+
+/**
+ * Displays the statistics of the targets of ping the way ping does at the end of a run, over all the files.
+ * The time is the one from the first probe sent to the last send or reply.
+ */
+static void display_statistics(void)
+{
+    if (num_targets > 1)
+    {
+        printf("\n--- ping statistics for %d targets ---\n", num_targets);
+
+        for (int i = 0; i < num_targets; i++)
+        {
+            const struct ping_stats *stats = &dump_targets[i].stats;
+            int loss = (stats->transmitted > 0) ? 100 - stats->rtt.received * 100 / stats->transmitted : 0;
+
+            printf("%s : xmt/rcv/%%loss = %d/%d/%d%%", dump_targets[i].name, stats->transmitted, stats->rtt.received, loss);
+            display_replies(stats);
+
+            if (stats->rtt.received > 0)
+            {
+                printf(", min/avg/max/mdev = %.3f/%.3f/%.3f/%.3fms, p50/p99 = %.3f/%.3fms",
+                       stats->rtt.min, stats->rtt.total / stats->rtt.received, stats->rtt.max, rtt_mdev(stats),
+                       rtt_percentile(stats, 50), rtt_percentile(stats, 99));
+            }
+
+            printf("\n");
+        }
+    }
+
+    else
+        printf("\n--- %s ping statistics ---\n", dump_targets[0].name);
+
+    printf("%d packets transmitted, %d received", total.transmitted, total.rtt.received);
+    display_replies(&total);
+    printf(", time %.1fms\n", (last_event - first_sent) / 1000000.0);
+
+    if (total.rtt.received > 0)
+    {
+        printf("rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3fms\n",
+               total.rtt.min, total.rtt.total / total.rtt.received, total.rtt.max, rtt_mdev(&total));
+        printf("rtt p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3fms, jitter = %.3fms\n",
+               rtt_percentile(&total, 50), rtt_percentile(&total, 90), rtt_percentile(&total, 99),
+               rtt_percentile(&total, 99.9), total.rtt.jitter);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qt")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            quiet = 1; // Only the statistics
+            break;
+        case 't':
+            print_time = 1; // Wall-clock time of each line
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-t] <file>...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int num_inputs = argc - optind;
+
+    if (num_inputs == 0)
+    {
+        fprintf(stderr, "Usage: %s [-q] [-t] <file>...\n", argv[0]);
+        return 1;
+    }
+
+    struct input *inputs = calloc(num_inputs, sizeof(struct input));
+    struct input **heap = calloc(num_inputs, sizeof(struct input *)); // Inputs with a probe left, the earliest first
+
+    if (inputs == NULL || heap == NULL)
+    {
+        perror("calloc(3)");
+        free(inputs);
+        free(heap);
+        return 1;
+    }
+
+    int ret = 0;
+    int size = 0; // Number of inputs in the heap
+    reset_stats(&total, &total_histogram);
+
+    for (int i = 0; i < num_inputs && ret == 0; i++)
+    {
+        ret = capture_map(argv[optind + i], &inputs[i].file);
+
+        if (ret == 0 && advance(&inputs[i]) > 0)
+        {
+            heap[size] = &inputs[i];
+            sift(heap, size + 1, size);
+            size++;
+        }
+    }
+
+    // Merge: handle the earliest pending probe of all the files, then move its file to the time of its next one
+    while (ret == 0 && size > 0)
+    {
+        struct input *input = heap[0];
+
+        if (handle_probe(input) != 0)
+        {
+            ret = 1;
+            break;
+        }
+
+        int next = advance(input);
+
+        if (next < 0)
+            ret = 1;
+
+        else if (next == 0)
+            heap[0] = heap[--size];
+
+        sift(heap, size, 0);
+    }
+
+    if (ret == 0 && num_targets > 0)
+        display_statistics();
+
+    if (skipped > 0)
+        fprintf(stderr, "%lu records skipped\n", skipped);
+
+    for (int i = 0; i < num_inputs; i++)
+    {
+        capture_unmap(&inputs[i].file);
+        free(inputs[i].addresses);
+        free(inputs[i].summary);
+    }
+
+    free(inputs);
+    free(heap);
+    free(target_table);
+    free(dump_targets);
+    return ret;
+}
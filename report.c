@@ -0,0 +1,494 @@
+#define _GNU_SOURCE // For open_memstream
+#include <stdio.h> // FILE, fprintf, open_memstream
+#include <stdlib.h> // calloc, free
+#include <string.h> // strncmp, strlen, strncpy
+#include <errno.h> // EINTR
+#include <time.h> // clock_gettime, nanosleep
+#include <unistd.h> // close
+#include <pthread.h> // The reporter thread
+#include <sys/socket.h> // socket, connect, send
+#include <sys/un.h> // struct sockaddr_un
+#include "report.h"
+
+// The probe loops record into one window of statistics per target while the reporter thread formats and
+// writes out the other one, so the probe loops never wait for the formatting or the I/O.
+// With several probe threads (writers), the reporter waits until each of them either went through a quiescent
+// point after the windows were swapped or is offline (asleep between two iterations, or done), so none is still
+// recording into the window being reported.
+
+// Structure to hold the statistics of a target over a window: the fields of struct ping_stats the reports print,
+// with a coarse histogram, so the two windows of each of thousands of targets stay compact
+struct report_window
+{
+    int transmitted;
+    struct rtt_summary rtt; // Round-trip times of the replies
+    int replies[REPLY_KINDS]; // Replies of each kind (REPLY_*)
+    struct coarse_histogram histogram; // Round-trip times in nanoseconds, for the percentiles
+};
+
+static struct report_window *windows = NULL; // Two windows per target: the ones of target i are 2 * i and 2 * i + 1
+static int current = 0; // Window the probe loops record into (only rotate_report changes it)
+static unsigned int report_epoch = 0; // Number of rotations so far
+static unsigned int *writer_epochs = NULL; // Last rotation each writer has seen, or REPORT_OFFLINE
+static int num_writers = 0; // Number of probe threads
+static int num_sources = 0; // Number of targets
+static const char **source_names = NULL; // Names of the targets
+
+static int report_format = REPORT_JSON; // Format of the reports
+static const char *report_destination = NULL; // "-" for the standard output, a file, or "unix:" and a socket path
+static FILE *report_file = NULL; // Open destination of the JSON lines (standard output or file)
+static int report_socket = -1; // Connected Unix socket, or -1
+
+static pthread_t reporter; // The reporter thread
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the fields below
+static pthread_cond_t report_cond = PTHREAD_COND_INITIALIZER; // Signals a window to report, or the end of a report
+static int pending = 0; // Whether a window is waiting to be (or being) reported
+static int stopping = 0; // Whether the reporter thread must exit once the pending window is reported
+static int reported = 0; // Window being reported
+static double window_start = 0; // Wall clock time the current window started, in seconds
+static double report_start = 0, report_end = 0; // Wall clock times the reported window started and ended
+
+/**
+ * Gets the current time of the wall clock in seconds, to timestamp the reports.
+ * @return The current time in seconds since the epoch.
+ */
+static double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Empties a window.
+ * @param window Pointer to the window.
+ */
+static void reset_window(struct report_window *window)
+{
+    memset(window, 0, sizeof(*window));
+    reset_summary(&window->rtt);
+}
+
+/**
+ * Gets a percentile of the round-trip times of a window.
+ * @param window Pointer to the window.
+ * @param percentile The percentile (e.g. 99.9).
+ * @return The round-trip time of the percentile in milliseconds.
+ */
+static double window_percentile(const struct report_window *window, double percentile)
+{
+    return coarse_histogram_quantile(&window->histogram, percentile / 100) / 1000000.0;
+}
+
+/**
+ * Formats a window of statistics as JSON lines, one per target (round-trip times in milliseconds).
+ * @param out The stream to write to.
+ * @param window The window to format (0 or 1).
+ */
+static void format_json(FILE *out, int window)
+{
+    for (int i = 0; i < num_sources; i++)
+    {
+        const struct report_window *stats = &windows[2 * i + window];
+        double loss = (stats->transmitted > 0) ? 1.0 - (double)stats->rtt.received / stats->transmitted : 0;
+
+        if (loss < 0)
+            loss = 0; // Replies to requests of the previous window
+
+        fprintf(out, "{\"time\":%.3f,\"target\":\"%s\",\"interval\":%.3f,\"transmitted\":%d,\"received\":%d,\"loss\":%.4f",
+                report_end, source_names[i], report_end - report_start, stats->transmitted, stats->rtt.received, loss);
+
+        for (int kind = 0; kind < REPLY_KINDS; kind++)
+            fprintf(out, ",\"%s\":%d", reply_kind_name(kind), stats->replies[kind]);
+
+        if (stats->rtt.received > 0)
+        {
+            fprintf(out, ",\"rtt_min\":%.3f,\"rtt_avg\":%.3f,\"rtt_max\":%.3f,\"rtt_mdev\":%.3f,"
+                         "\"rtt_p50\":%.3f,\"rtt_p90\":%.3f,\"rtt_p99\":%.3f,\"rtt_p999\":%.3f,\"jitter\":%.3f}\n",
+                    stats->rtt.min, stats->rtt.total / stats->rtt.received, stats->rtt.max, summary_mdev(&stats->rtt),
+                    window_percentile(stats, 50), window_percentile(stats, 90), window_percentile(stats, 99),
+                    window_percentile(stats, 99.9), stats->rtt.jitter);
+        }
+
+        else
+        {
+            fprintf(out, ",\"rtt_min\":null,\"rtt_avg\":null,\"rtt_max\":null,\"rtt_mdev\":null,"
+                         "\"rtt_p50\":null,\"rtt_p90\":null,\"rtt_p99\":null,\"rtt_p999\":null,\"jitter\":null}\n");
+        }
+    }
+}
+
+/**
+ * Formats a window of statistics in the Prometheus text exposition format (round-trip times in seconds).
+ * @param out The stream to write to.
+ * @param window The window to format (0 or 1).
+ */
+static void format_prometheus(FILE *out, int window)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    fprintf(out, "# HELP ping_window_seconds Length of the window the other metrics cover.\n# TYPE ping_window_seconds gauge\n");
+    fprintf(out, "ping_window_seconds %.3f\n", report_end - report_start);
+
+    fprintf(out, "# HELP ping_transmitted Echo requests sent during the window.\n# TYPE ping_transmitted gauge\n");
+    for (int i = 0; i < num_sources; i++)
+        fprintf(out, "ping_transmitted{target=\"%s\"} %d\n", source_names[i], windows[2 * i + window].transmitted);
+
+    fprintf(out, "# HELP ping_received Echo replies received during the window.\n# TYPE ping_received gauge\n");
+    for (int i = 0; i < num_sources; i++)
+        fprintf(out, "ping_received{target=\"%s\"} %d\n", source_names[i], windows[2 * i + window].rtt.received);
+
+    fprintf(out, "# HELP ping_replies Replies that didn't simply answer a probe in flight during the window, by kind.\n"
+                 "# TYPE ping_replies gauge\n");
+    for (int i = 0; i < num_sources; i++)
+    {
+        for (int kind = 0; kind < REPLY_KINDS; kind++)
+            fprintf(out, "ping_replies{target=\"%s\",kind=\"%s\"} %d\n", source_names[i], reply_kind_name(kind),
+                    windows[2 * i + window].replies[kind]);
+    }
+
+    fprintf(out, "# HELP ping_rtt_seconds Round-trip times during the window.\n# TYPE ping_rtt_seconds summary\n");
+    for (int i = 0; i < num_sources; i++)
+    {
+        const struct report_window *stats = &windows[2 * i + window];
+
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && stats->rtt.received > 0; q++)
+            fprintf(out, "ping_rtt_seconds{target=\"%s\",quantile=\"%g\"} %.9f\n",
+                    source_names[i], quantiles[q], window_percentile(stats, quantiles[q] * 100) / 1000);
+
+        fprintf(out, "ping_rtt_seconds_sum{target=\"%s\"} %.9f\n", source_names[i], stats->rtt.total / 1000);
+        fprintf(out, "ping_rtt_seconds_count{target=\"%s\"} %d\n", source_names[i], stats->rtt.received);
+    }
+
+    fprintf(out, "# HELP ping_rtt_stddev_seconds Standard deviation of the round-trip times during the window.\n"
+                 "# TYPE ping_rtt_stddev_seconds gauge\n");
+    for (int i = 0; i < num_sources; i++)
+        fprintf(out, "ping_rtt_stddev_seconds{target=\"%s\"} %.9f\n", source_names[i], summary_mdev(&windows[2 * i + window].rtt) / 1000);
+
+    fprintf(out, "# HELP ping_jitter_seconds Interarrival jitter (RFC 3550) at the end of the window.\n# TYPE ping_jitter_seconds gauge\n");
+    for (int i = 0; i < num_sources; i++)
+        fprintf(out, "ping_jitter_seconds{target=\"%s\"} %.9f\n", source_names[i], windows[2 * i + window].rtt.jitter / 1000);
+}
+
+/**
+ * Sends a report to the Unix socket, connecting to it first if needed.
+ * A reader that isn't there or went away only costs this report: the next one connects again.
+ * @param report The formatted report.
+ * @param size The size of the report.
+ */
+static void send_report(const char *report, size_t size)
+{
+    if (report_socket < 0)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strncpy(addr.sun_path, report_destination + strlen(REPORT_UNIX_PREFIX), sizeof(addr.sun_path) - 1);
+        report_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (report_socket < 0 || connect(report_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            if (report_socket >= 0)
+                close(report_socket);
+
+            report_socket = -1;
+            return;
+        }
+    }
+
+    while (size > 0)
+    {
+        ssize_t sent = send(report_socket, report, size, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+
+        if (sent <= 0)
+        {
+            close(report_socket);
+            report_socket = -1;
+            return;
+        }
+
+        report += sent;
+        size -= sent;
+    }
+}
+
+/**
+ * Writes a Prometheus report to the file, replacing the previous one atomically
+ * (like the node exporter's textfile collector expects).
+ * @param report The formatted report.
+ * @param size The size of the report.
+ */
+static void replace_report(const char *report, size_t size)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.tmp", report_destination);
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+        return;
+
+    int written = (fwrite(report, 1, size, file) == size);
+
+    if (fclose(file) == 0 && written)
+        rename(path, report_destination);
+}
+
+/**
+ * Main function of the reporter thread: waits for a window to report, formats it, writes it out and clears it.
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *reporter_main(void *arg)
+{
+    (void)arg; // Mark parameter as unused
+
+    while (1)
+    {
+        pthread_mutex_lock(&report_lock);
+
+        while (!pending && !stopping)
+            pthread_cond_wait(&report_cond, &report_lock);
+
+        if (!pending)
+        {
+            pthread_mutex_unlock(&report_lock);
+            break; // Stopping, and everything was reported
+        }
+
+        int window = reported;
+        unsigned int epoch = report_epoch;
+        pthread_mutex_unlock(&report_lock);
+
+        // Wait until all the writers moved on to the other window. They're at most one iteration of their loop away.
+        for (int i = 0; i < num_writers; i++)
+        {
+            unsigned int seen;
+
+            while ((seen = __atomic_load_n(&writer_epochs[i], __ATOMIC_SEQ_CST)) != epoch && seen != REPORT_OFFLINE)
+                nanosleep(&(struct timespec){.tv_nsec = 100000}, NULL);
+        }
+
+        // Format the report in memory, then write it out in one go
+        char *report = NULL;
+        size_t size = 0;
+        FILE *out = open_memstream(&report, &size);
+
+        if (out != NULL)
+        {
+            if (report_format == REPORT_PROMETHEUS)
+                format_prometheus(out, window);
+
+            else
+                format_json(out, window);
+
+            fclose(out);
+
+            if (strncmp(report_destination, REPORT_UNIX_PREFIX, strlen(REPORT_UNIX_PREFIX)) == 0)
+                send_report(report, size);
+
+            else if (report_file != NULL)
+            {
+                fwrite(report, 1, size, report_file);
+                fflush(report_file);
+            }
+
+            else
+                replace_report(report, size);
+
+            free(report);
+        }
+
+        for (int i = 0; i < num_sources; i++)
+            reset_window(&windows[2 * i + window]);
+
+        pthread_mutex_lock(&report_lock);
+        pending = 0;
+        pthread_cond_broadcast(&report_cond);
+        pthread_mutex_unlock(&report_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the reporter thread.
+ * @param destination Where to write the reports: "-" for the standard output, "unix:" and the path of a listening
+ * Unix stream socket, or a file (JSON lines are appended to it, Prometheus reports replace it).
+ * @param format REPORT_JSON or REPORT_PROMETHEUS.
+ * @param count The number of targets.
+ * @param names The names of the targets (they must stay valid until the reporter stops).
+ * @param writers The number of probe threads recording into the windows, each calling report_quiescent.
+ * @return 0 on success, or 1 on error.
+ */
+int start_reporter(const char *destination, int format, int count, const char **names, int writers)
+{
+    report_destination = destination;
+    report_format = format;
+    num_sources = count;
+    source_names = names;
+    num_writers = writers;
+    windows = calloc(2 * count, sizeof(struct report_window));
+    writer_epochs = calloc(writers, sizeof(unsigned int));
+
+    if (windows == NULL || writer_epochs == NULL)
+    {
+        perror("calloc(3)");
+        free(windows);
+        free(writer_epochs);
+        return 1;
+    }
+
+    for (int i = 0; i < 2 * count; i++)
+        reset_window(&windows[i]);
+
+    if (strcmp(destination, "-") == 0)
+        report_file = stdout;
+
+    else if (strncmp(destination, REPORT_UNIX_PREFIX, strlen(REPORT_UNIX_PREFIX)) != 0 && format == REPORT_JSON)
+    {
+        report_file = fopen(destination, "a");
+
+        if (report_file == NULL)
+        {
+            perror("fopen(3)");
+            free(windows);
+            free(writer_epochs);
+            return 1;
+        }
+    }
+
+    window_start = wall_time();
+
+    if (pthread_create(&reporter, NULL, reporter_main, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to start the reporter thread\n");
+        free(windows);
+        free(writer_epochs);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the window the probe loop records into for a target.
+ * Only the thread that probes the target records into its windows.
+ * @param index The index of the target.
+ * @return Pointer to the window.
+ */
+static struct report_window *current_window(int index)
+{
+    return &windows[2 * index + __atomic_load_n(&current, __ATOMIC_ACQUIRE)];
+}
+
+/**
+ * Counts a sent request in the current window of a target.
+ * @param index The index of the target.
+ */
+void report_transmit(int index)
+{
+    current_window(index)->transmitted++;
+}
+
+/**
+ * Records a round-trip time in the current window of a target, as record_rtt does in its statistics.
+ * @param index The index of the target.
+ * @param rtt The round-trip time in milliseconds.
+ */
+void report_rtt(int index, double rtt)
+{
+    struct report_window *window = current_window(index);
+    summary_record(&window->rtt, rtt);
+    coarse_histogram_record(&window->histogram, (unsigned long long)(rtt * 1000000.0)); // In nanoseconds
+}
+
+/**
+ * Counts a reply that doesn't simply answer a probe in flight in the current window of a target.
+ * @param index The index of the target.
+ * @param kind The kind of reply (REPLY_*).
+ */
+void report_reply(int index, int kind)
+{
+    current_window(index)->replies[kind]++;
+}
+
+/**
+ * Marks a writer online: from now on it records into the windows of the last rotation.
+ * Called by each probe thread when it wakes up, before it records anything.
+ * The sequentially consistent store and load guarantee that a writer the reporter saw offline either
+ * sees the new rotation here, or is waited for.
+ * @param writer The index of the writer.
+ */
+void report_quiescent(int writer)
+{
+    __atomic_store_n(&writer_epochs[writer], REPORT_ONLINE, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&writer_epochs[writer], __atomic_load_n(&report_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Marks a writer offline: it holds no window until it calls report_quiescent again.
+ * Called by each probe thread before it sleeps, and when it's done, so the reporter never waits for it.
+ * @param writer The index of the writer.
+ */
+void report_offline(int writer)
+{
+    __atomic_store_n(&writer_epochs[writer], REPORT_OFFLINE, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Ends the current window and hands it over to the reporter thread.
+ * If the reporter is still busy with the previous window, the current one just keeps growing
+ * until the next rotation, so no sample is lost and the probe loop never waits.
+ */
+void rotate_report(void)
+{
+    pthread_mutex_lock(&report_lock);
+
+    if (!pending)
+    {
+        double now = wall_time();
+        report_start = window_start;
+        report_end = now;
+        window_start = now;
+        reported = current;
+        __atomic_store_n(&current, current ^ 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&report_epoch, (report_epoch + 1) % REPORT_ONLINE, __ATOMIC_SEQ_CST); // After the swap, for the writers
+        pending = 1;
+        pthread_cond_broadcast(&report_cond);
+    }
+
+    pthread_mutex_unlock(&report_lock);
+}
+
+/**
+ * Reports the last, partial window and stops the reporter thread.
+ */
+void stop_reporter(void)
+{
+    // Let the reporter finish the previous window, so the last one can be handed over
+    pthread_mutex_lock(&report_lock);
+
+    while (pending)
+        pthread_cond_wait(&report_cond, &report_lock);
+
+    pthread_mutex_unlock(&report_lock);
+    rotate_report();
+
+    pthread_mutex_lock(&report_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&report_cond);
+    pthread_mutex_unlock(&report_lock);
+    pthread_join(reporter, NULL);
+
+    if (report_file != NULL && report_file != stdout)
+        fclose(report_file);
+
+    if (report_socket >= 0)
+        close(report_socket);
+
+    free(windows);
+    free(writer_epochs);
+    windows = NULL;
+    writer_epochs = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef _REPORT_H
+#define _REPORT_H
+
+#include "stats.h"
+
+// Formats of the interval reports
+#define REPORT_JSON 0 // One JSON object per line and per target
+#define REPORT_PROMETHEUS 1 // Prometheus text exposition format
+
+#define REPORT_UNIX_PREFIX "unix:" // Prefix of the report destinations that are Unix sockets
+#define REPORT_OFFLINE 0xFFFFFFFFu // Epoch of a writer that holds no window (asleep or done)
+#define REPORT_ONLINE 0xFFFFFFFEu // Epoch of a writer waking up, until it reads the current epoch
+
+// Function declarations
+int start_reporter(const char *destination, int format, int count, const char **names, int writers);
+void report_transmit(int index);
+void report_rtt(int index, double rtt);
+void report_reply(int index, int kind);
+void report_quiescent(int writer);
+void report_offline(int writer);
+void rotate_report(void);
+void stop_reporter(void);
+
+#endif // _REPORT_H
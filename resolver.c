@@ -0,0 +1,476 @@
+#include <stdio.h> // fopen, fgets, perror, fprintf
+#include <stdlib.h> // calloc
+#include <string.h> // memset, strcspn, strspn, snprintf
+#include <unistd.h> // write
+#include <pthread.h> // Resolver threads
+#include <sys/eventfd.h> // Wake-ups of the program when a late name arrives
+#include "resolver.h"
+#include "timestamp.h" // monotonic_time_ms
+
+// Reverse DNS lookups block for as long as the DNS servers take to answer, so they run on a pool of threads,
+// off the probe loops: a lookup only queues the address, and returns the name once a thread has resolved it.
+// The names are kept in a cache (LRU, with a TTL since getnameinfo(3) doesn't tell the one of the record),
+// so each address is resolved once however many times it's printed, and the cache can be pre-warmed from
+// a hosts file. The names that arrive after their address was printed are announced through an eventfd.
+
+#define RESOLVER_BUCKETS (2 * RESOLVER_CACHE_SIZE) // Hash buckets of the cache (power of 2)
+
+// Structure to hold an address of the cache
+struct cache_entry
+{
+    struct net_addr addr; // The address
+    char name[NI_MAXHOST]; // Its name, empty if it has none
+    int resolved; // Whether the name was resolved (or read from the hosts file), even if it's empty
+    int pending; // Whether the address is queued or being resolved (the entry isn't evicted meanwhile)
+    int late; // Whether the address was printed while it was pending, so its name is announced when it arrives
+    double expires; // Monotonic time the name expires at, in milliseconds (0 for the names of the hosts file)
+    int bucket_next; // Next entry of the same hash bucket, or -1
+    int lru_prev, lru_next; // Neighbours in the least recently used order (the most recent first), or -1
+    int queue_next; // Next entry of the queue of the addresses to resolve, or -1
+};
+
+// Structure to hold a name that arrived after its address was printed
+struct late_name
+{
+    struct net_addr addr;
+    char name[NI_MAXHOST];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Protects everything below
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER; // Signals the threads that an address was queued
+static struct cache_entry *entries = NULL; // The cache (NULL until the resolver starts)
+static int num_entries = 0;
+static int buckets[RESOLVER_BUCKETS]; // First entry of each hash bucket, or -1
+static int lru_head = -1, lru_tail = -1; // Most and least recently used entries
+static int queue_head = -1, queue_tail = -1; // Queue of the addresses to resolve
+static int announce = 0; // Whether the late names are announced
+static struct late_name late_names[RESOLVER_LATE_NAMES]; // Ring of the late names to print
+static int late_first = 0, num_late = 0;
+static int waiting = 0; // Addresses printed while pending, whose name hasn't arrived yet
+static int event_fd = -1; // eventfd written when a name the program waits for arrives
+
+/**
+ * Unlinks an entry from the least recently used order.
+ * @param index The index of the entry.
+ */
+static void lru_unlink(int index)
+{
+    struct cache_entry *entry = &entries[index];
+
+    if (entry->lru_prev >= 0)
+        entries[entry->lru_prev].lru_next = entry->lru_next;
+
+    else
+        lru_head = entry->lru_next;
+
+    if (entry->lru_next >= 0)
+        entries[entry->lru_next].lru_prev = entry->lru_prev;
+
+    else
+        lru_tail = entry->lru_prev;
+}
+
+/**
+ * Moves an entry to the front of the least recently used order.
+ * @param index The index of the entry.
+ */
+static void lru_touch(int index)
+{
+    if (lru_head == index)
+        return;
+
+    if (entries[index].lru_prev >= 0 || entries[index].lru_next >= 0 || lru_tail == index)
+        lru_unlink(index);
+
+    entries[index].lru_prev = -1;
+    entries[index].lru_next = lru_head;
+
+    if (lru_head >= 0)
+        entries[lru_head].lru_prev = index;
+
+    lru_head = index;
+
+    if (lru_tail < 0)
+        lru_tail = index;
+}
+
+/**
+ * Finds the entry of an address in the cache.
+ * @param addr Pointer to the address.
+ * @return The index of the entry, or -1 if the address isn't cached.
+ */
+static int find_entry(const struct net_addr *addr)
+{
+    const void *bytes = address_bytes(addr);
+    int index = buckets[hash_address(addr->type, bytes) & (RESOLVER_BUCKETS - 1)];
+
+    while (index >= 0 && !(entries[index].addr.type == addr->type && same_address(&entries[index].addr, addr->type, bytes)))
+        index = entries[index].bucket_next;
+
+    return index;
+}
+
+/**
+ * Evicts the least recently used entry that isn't being resolved, to reuse it.
+ * @return The index of the evicted entry, or -1 if all of them are being resolved.
+ */
+static int evict_entry(void)
+{
+    int index = lru_tail;
+
+    while (index >= 0 && entries[index].pending)
+        index = entries[index].lru_prev;
+
+    if (index < 0)
+        return -1;
+
+    // Unlink it from its hash bucket and from the least recently used order
+    struct cache_entry *entry = &entries[index];
+    int *link = &buckets[hash_address(entry->addr.type, address_bytes(&entry->addr)) & (RESOLVER_BUCKETS - 1)];
+
+    while (*link != index)
+        link = &entries[*link].bucket_next;
+
+    *link = entry->bucket_next;
+    lru_unlink(index);
+    return index;
+}
+
+/**
+ * Gets the entry of an address, adding it to the cache (unresolved) if it isn't there.
+ * The entry becomes the most recently used one.
+ * @param addr Pointer to the address.
+ * @return The index of the entry, or -1 if the cache is full of addresses being resolved.
+ */
+static int get_entry(const struct net_addr *addr)
+{
+    int index = find_entry(addr);
+
+    if (index < 0)
+    {
+        index = (num_entries < RESOLVER_CACHE_SIZE) ? num_entries++ : evict_entry();
+
+        if (index < 0)
+            return -1;
+
+        struct cache_entry *entry = &entries[index];
+        int bucket = hash_address(addr->type, address_bytes(addr)) & (RESOLVER_BUCKETS - 1);
+
+        memset(entry, 0, sizeof(*entry));
+        entry->addr = *addr;
+        entry->lru_prev = entry->lru_next = entry->queue_next = -1;
+        entry->bucket_next = buckets[bucket];
+        buckets[bucket] = index;
+    }
+
+    lru_touch(index);
+    return index;
+}
+
+/**
+ * Queues the address of an entry for the resolver threads, unless its name is known and fresh
+ * or it's already queued.
+ * @param index The index of the entry.
+ */
+static void queue_entry(int index)
+{
+    struct cache_entry *entry = &entries[index];
+
+    if (entry->pending || (entry->resolved && (entry->expires == 0 || monotonic_time_ms() < entry->expires)))
+        return;
+
+    entry->pending = 1;
+    entry->queue_next = -1;
+
+    if (queue_tail >= 0)
+        entries[queue_tail].queue_next = index;
+
+    else
+        queue_head = index;
+
+    queue_tail = index;
+    pthread_cond_signal(&queued);
+}
+
+/**
+ * Resolves the queued addresses, one at a time, for as long as the program runs.
+ * The entry of an address being resolved isn't evicted, so it's still there when its name arrives.
+ * @param arg Unused.
+ * @return Never returns.
+ */
+static void *resolve_names(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+
+    while (1)
+    {
+        while (queue_head < 0)
+            pthread_cond_wait(&queued, &lock);
+
+        int index = queue_head;
+        struct net_addr addr = entries[index].addr;
+        char name[NI_MAXHOST];
+
+        queue_head = entries[index].queue_next;
+
+        if (queue_head < 0)
+            queue_tail = -1;
+
+        pthread_mutex_unlock(&lock);
+        int found = getnameinfo(&addr.sa, address_length(&addr), name, sizeof(name), NULL, 0, NI_NAMEREQD) == 0;
+        pthread_mutex_lock(&lock);
+
+        struct cache_entry *entry = &entries[index];
+
+        entry->pending = 0;
+        entry->resolved = 1;
+        entry->expires = monotonic_time_ms() + (found ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL) * 1000.0;
+        snprintf(entry->name, sizeof(entry->name), "%s", found ? name : "");
+
+        if (entry->late)
+        {
+            entry->late = 0;
+            waiting--;
+
+            if (found && num_late < RESOLVER_LATE_NAMES)
+            {
+                struct late_name *late = &late_names[(late_first + num_late++) % RESOLVER_LATE_NAMES];
+                late->addr = addr;
+                snprintf(late->name, sizeof(late->name), "%s", name);
+            }
+
+            if (write(event_fd, &(unsigned long long){1}, sizeof(unsigned long long)) < 0)
+                perror("write(2)");
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the resolver: allocates the cache and starts the threads of the pool. The threads are detached,
+ * as one of them may be blocked in a lookup when the program exits.
+ * @param threads The number of resolver threads.
+ * @param announce_late Whether the names that arrive after their address was printed are announced
+ *                      (through resolver_fd and resolver_late_name).
+ * @return 0 on success, or 1 on error.
+ */
+int resolver_start(int threads, int announce_late)
+{
+    entries = calloc(RESOLVER_CACHE_SIZE, sizeof(struct cache_entry));
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (entries == NULL || event_fd < 0)
+    {
+        perror((entries == NULL) ? "calloc(3)" : "eventfd(2)");
+        return 1;
+    }
+
+    memset(buckets, -1, sizeof(buckets));
+    announce = announce_late;
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, resolve_names, NULL);
+        pthread_attr_destroy(&attr);
+
+        if (err != 0)
+        {
+            fprintf(stderr, "pthread_create(3): %s\n", strerror(err));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Pre-warms the cache from a hosts file: "address name [aliases]" lines, with # comments.
+ * These names never expire (but may be evicted like the others). Call it after resolver_start.
+ * @param path The path of the file.
+ * @return 0 on success, or 1 on error.
+ */
+int resolver_load_hosts(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[1024];
+    int number = 0;
+
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char address[ADDRESS_STRLEN + 1], name[NI_MAXHOST];
+        struct net_addr addr;
+
+        number++;
+        line[strcspn(line, "#\n")] = '\0'; // Strip the comment and the newline
+
+        if (line[strspn(line, " \t\r")] == '\0')
+            continue; // Blank line
+
+        if (sscanf(line, "%46s %1024s", address, name) != 2 || parse_address(0, address, &addr) != 0)
+        {
+            fprintf(stderr, "%s:%d: expected an address and a name\n", path, number);
+            fclose(file);
+            return 1;
+        }
+
+        pthread_mutex_lock(&lock);
+        int index = get_entry(&addr);
+
+        if (index >= 0 && !entries[index].pending)
+        {
+            snprintf(entries[index].name, sizeof(entries[index].name), "%s", name);
+            entries[index].resolved = 1;
+            entries[index].expires = 0;
+        }
+
+        pthread_mutex_unlock(&lock);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Queues an address for resolution, unless its name is already known, so the name is likely there by the time
+ * the address is printed. It doesn't block.
+ * @param addr Pointer to the address.
+ */
+void resolver_request(const struct net_addr *addr)
+{
+    if (entries == NULL)
+        return; // Names aren't resolved
+
+    pthread_mutex_lock(&lock);
+    int index = get_entry(addr);
+
+    if (index >= 0)
+        queue_entry(index);
+
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Looks up the name of an address in the cache, and queues it for resolution if it isn't there or expired.
+ * An expired name is still returned until the new one arrives. It doesn't block.
+ * @param addr Pointer to the address.
+ * @param name Buffer receiving the name.
+ * @param size Size of the buffer.
+ * @return 1 if the name was returned, 0 if the address has no name, or its name isn't known yet.
+ */
+int resolver_lookup(const struct net_addr *addr, char *name, size_t size)
+{
+    if (entries == NULL)
+        return 0; // Names aren't resolved
+
+    pthread_mutex_lock(&lock);
+    int index = get_entry(addr);
+    int found = 0;
+
+    if (index >= 0)
+    {
+        struct cache_entry *entry = &entries[index];
+
+        queue_entry(index);
+        found = entry->resolved && entry->name[0] != '\0';
+
+        if (found)
+            snprintf(name, size, "%s", entry->name);
+
+        else if (entry->pending && !entry->late && announce)
+        {
+            entry->late = 1; // Printed without its name: announce the name when it arrives
+            waiting++;
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/**
+ * Formats an address for printing: "name (address)" when its name is known, the address alone otherwise.
+ * Without the resolver, it's the address alone.
+ * @param addr Pointer to the address.
+ * @param buffer The buffer to write the string to (HOST_STRLEN bytes are always enough).
+ * @param size The size of the buffer.
+ */
+void format_host(const struct net_addr *addr, char *buffer, size_t size)
+{
+    char address[ADDRESS_STRLEN], name[NI_MAXHOST];
+
+    format_address(addr, address, sizeof(address));
+
+    if (resolver_lookup(addr, name, sizeof(name)))
+        snprintf(buffer, size, "%s (%s)", name, address);
+
+    else
+        snprintf(buffer, size, "%s", address);
+}
+
+/**
+ * Gets the eventfd that becomes readable when a name the program waits for arrives (or turns out not to exist).
+ * Read it before calling resolver_late_name.
+ * @return The eventfd, or -1 without the resolver.
+ */
+int resolver_fd(void)
+{
+    return event_fd;
+}
+
+/**
+ * Gets the next name that arrived after its address was printed.
+ * @param addr Pointer to the structure receiving the address.
+ * @param name Buffer receiving the name.
+ * @param size Size of the buffer.
+ * @return 1 if a name was returned, 0 if there are no more.
+ */
+int resolver_late_name(struct net_addr *addr, char *name, size_t size)
+{
+    int found = 0;
+    unsigned long long count;
+
+    if (event_fd >= 0 && read(event_fd, &count, sizeof(count)) < 0)
+        count = 0; // Nothing new (EAGAIN), the ring is checked anyway
+
+    pthread_mutex_lock(&lock);
+
+    if (num_late > 0)
+    {
+        struct late_name *late = &late_names[late_first];
+
+        *addr = late->addr;
+        snprintf(name, size, "%s", late->name);
+        late_first = (late_first + 1) % RESOLVER_LATE_NAMES;
+        num_late--;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/**
+ * Gets the number of addresses that were printed while their name was being resolved, and whose name
+ * hasn't arrived yet.
+ * @return The number of names the program waits for.
+ */
+int resolver_waiting(void)
+{
+    pthread_mutex_lock(&lock);
+    int count = waiting;
+    pthread_mutex_unlock(&lock);
+    return count;
+}
@@ -0,0 +1,26 @@
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+#include <stddef.h>
+#include <netdb.h>
+#include "netaddr.h"
+
+#define RESOLVER_THREADS 4 // Threads of the resolver pool, each blocked in one getnameinfo(3) at a time
+#define RESOLVER_CACHE_SIZE 4096 // Addresses kept in the cache, the least recently used ones are evicted beyond
+#define RESOLVER_TTL 3600 // seconds, how long a name is kept before it's resolved again
+#define RESOLVER_NEGATIVE_TTL 300 // seconds, how long an address without a name is kept
+#define RESOLVER_LATE_NAMES 256 // Names that arrived after their address was printed, waiting to be printed
+#define RESOLVER_DRAIN_TIMEOUT 2000 // milliseconds, how long a program waits for the pending names before exiting
+#define HOST_STRLEN (NI_MAXHOST + ADDRESS_STRLEN + 3) // Room for "name (address)"
+
+// Function declarations
+int resolver_start(int threads, int announce_late);
+int resolver_load_hosts(const char *path);
+void resolver_request(const struct net_addr *addr);
+int resolver_lookup(const struct net_addr *addr, char *name, size_t size);
+void format_host(const struct net_addr *addr, char *buffer, size_t size);
+int resolver_fd(void);
+int resolver_late_name(struct net_addr *addr, char *name, size_t size);
+int resolver_waiting(void);
+
+#endif // _RESOLVER_H
@@ -0,0 +1,331 @@
+#!/bin/bash
+# Benchmark of ping and traceroute over a chain of network namespaces, without a real network.
+#
+#   src --- r1 --- r2 --- dst
+#
+# Each netem profile shapes the link from r1 to src, so every reply (from dst, and the ICMP errors of the routers
+# to traceroute) crosses it. For each profile and IP type it runs ping paced at 5 probes per second, at a short
+# interval, and in flood mode with each engine, then traceroute to dst, and records one JSON object per run:
+#
+#   pps               Probes sent per second of wall time
+#   cpu_us_per_probe  CPU time (user + system) of the run, in microseconds per probe
+#   rtt_avg_ms        Average round-trip time reported by ping
+#   rtt_error_ms      rtt_avg_ms minus the delay of the profile
+#   loss_pct          Probes that got no reply, in percent
+#   trace_s           Time traceroute took to complete the trace, and whether it reached dst
+#
+# With a baseline (-b), the runs are compared with the ones of the baseline, and the script fails if any of them
+# regressed by more than the tolerance. It also fails if ping or traceroute fails in any run.
+# Run as root; the namespaces are removed on exit.
+
+set -u
+
+usage()
+{
+    echo "Usage: $0 [-o output] [-b baseline] [-P profiles] [-t types] [-E engines] [-c count] [-C flood_count] [-T tolerance]" >&2
+    exit 1
+}
+
+BIN=$(cd "$(dirname "$0")/.." && pwd) # Directory of the ping and traceroute programs
+OUTPUT=bench.json # Results, one JSON object per line
+BASELINE= # Results of a previous run to compare with
+PROFILES="clean delay jitter loss reorder"
+TYPES="4 6"
+ENGINES="poll uring"
+COUNT=20 # Probes of the paced run and, ten times more, of the short interval
+FLOOD_COUNT=100000 # Probes of a flood
+TOLERANCE=20 # Regression tolerance of the throughput, CPU and trace time, in percent
+RTT_SLACK=0.5 # Regression tolerance of the round-trip time error, in milliseconds
+TRACE_SLACK=0.1 # Regression tolerance of the trace time on top of the percentage, in seconds (timer granularity)
+FAILED=0 # Runs whose ping or traceroute failed
+
+while getopts "o:b:P:t:E:c:C:T:" opt; do
+    case $opt in
+    o) OUTPUT=$OPTARG ;;
+    b) BASELINE=$OPTARG ;;
+    P) PROFILES=$OPTARG ;;
+    t) TYPES=$OPTARG ;;
+    E) ENGINES=$OPTARG ;;
+    c) COUNT=$OPTARG ;;
+    C) FLOOD_COUNT=$OPTARG ;;
+    T) TOLERANCE=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "$0 must run as root (network namespaces, raw sockets)" >&2
+    exit 1
+fi
+
+if [ -n "$BASELINE" ] && [ ! -r "$BASELINE" ]; then
+    echo "Cannot read the baseline $BASELINE" >&2
+    exit 1
+fi
+
+NS="bench-$$" # Prefix of the namespaces, unique to this run
+DST4=10.201.3.2
+DST6=fd20:3::2
+WORK=$(mktemp -d)
+
+cleanup()
+{
+    for node in src r1 r2 dst; do
+        ip netns del "$NS-$node" 2>/dev/null
+    done
+
+    rm -rf "$WORK"
+}
+
+trap cleanup EXIT
+
+# Runs a command in the namespace of a node
+in_ns()
+{
+    local node=$1
+    shift
+    ip netns exec "$NS-$node" "$@"
+}
+
+# Links two nodes with a veth pair: link <node> <ifname> <node> <ifname> <subnet>, where the first node gets .1
+# (and ::1) of the subnet and the second one .2 (and ::2)
+link()
+{
+    ip link add "$2" netns "$NS-$1" type veth peer name "$4" netns "$NS-$3"
+    in_ns "$1" ip addr add "10.201.$5.1/24" dev "$2"
+    in_ns "$3" ip addr add "10.201.$5.2/24" dev "$4"
+    in_ns "$1" ip addr add "fd20:$5::1/64" dev "$2" nodad
+    in_ns "$3" ip addr add "fd20:$5::2/64" dev "$4" nodad
+    in_ns "$1" ip link set "$2" up
+    in_ns "$3" ip link set "$4" up
+}
+
+# Builds the chain of namespaces
+setup()
+{
+    for node in src r1 r2 dst; do
+        ip netns add "$NS-$node" || return 1
+        in_ns $node ip link set lo up
+        in_ns $node sysctl -qw net.ipv4.icmp_ratelimit=0 net.ipv6.icmp.ratelimit=0
+    done
+
+    link src s0 r1 a0 1 && link r1 a1 r2 b0 2 && link r2 b1 dst d0 3 || return 1
+
+    for node in r1 r2; do
+        in_ns $node sysctl -qw net.ipv4.ip_forward=1 net.ipv6.conf.all.forwarding=1
+    done
+
+    in_ns src ip route add default via 10.201.1.2
+    in_ns src ip -6 route add default via fd20:1::2
+    in_ns r1 ip route add 10.201.3.0/24 via 10.201.2.2
+    in_ns r1 ip -6 route add fd20:3::/64 via fd20:2::2
+    in_ns r2 ip route add 10.201.1.0/24 via 10.201.2.1
+    in_ns r2 ip -6 route add fd20:1::/64 via fd20:2::1
+    in_ns dst ip route add default via 10.201.3.1
+    in_ns dst ip -6 route add default via fd20:3::1
+}
+
+# Shapes the link from r1 to src with the netem parameters of a profile, and sets DELAY to the delay it adds
+# to the round-trip time (ms)
+apply_profile()
+{
+    local netem
+
+    case $1 in
+    clean) DELAY=0; netem= ;;
+    delay) DELAY=10; netem="delay 10ms" ;;
+    jitter) DELAY=10; netem="delay 10ms 2ms" ;;
+    loss) DELAY=10; netem="delay 10ms loss 5%" ;;
+    reorder) DELAY=10; netem="delay 10ms reorder 25% 50%" ;;
+    *) echo "Unknown profile $1" >&2; return 1 ;;
+    esac
+
+    in_ns r1 tc qdisc del dev a0 root 2>/dev/null
+
+    if [ -n "$netem" ]; then
+        in_ns r1 tc qdisc add dev a0 root netem limit 100000 $netem 2>"$WORK/tc" || return 2
+    fi
+}
+
+# Runs a command in src and measures it: sets REAL, CPU (seconds), STATUS (its exit status) and leaves its output
+# in $WORK/out
+measure()
+{
+    local times
+    local TIMEFORMAT="%3R %3U %3S"
+    times=$( { time in_ns src "$@" >"$WORK/out" 2>&1; echo $? >"$WORK/status"; } 2>&1 )
+    REAL=$(echo "$times" | awk '{print $1}')
+    CPU=$(echo "$times" | awk '{print $2 + $3}')
+    STATUS=$(cat "$WORK/status")
+}
+
+# Reports a run whose program failed, with its output: fail <program> <test>
+fail()
+{
+    echo "$1 $2 failed (exit status $STATUS):" >&2
+    cat "$WORK/out" >&2
+    FAILED=$((FAILED + 1))
+    return 1
+}
+
+# Appends a result: record <profile> <type> <test> <engine> <json fields>
+record()
+{
+    printf '{"profile":"%s","ip":%s,"test":"%s","engine":"%s",%s}\n' "$1" "$2" "$3" "$4" "$5" >>"$OUTPUT"
+    printf '%-8s IPv%s %-9s %-6s %s\n' "$1" "$2" "$3" "$4" "$5"
+}
+
+# Runs ping: run_ping <profile> <type> <test> <engine> <ping arguments>
+run_ping()
+{
+    local profile=$1 type=$2 test=$3 engine=$4
+    shift 4
+    local dst=$DST4
+    [ "$type" = 6 ] && dst=$DST6
+
+    measure "$BIN/ping" -a "$dst" -t "$type" -E "$engine" "$@"
+    [ "$STATUS" -eq 0 ] || { fail ping "$test"; return 1; }
+
+    awk -v real="$REAL" -v cpu="$CPU" -v delay="$DELAY" '
+        / packets transmitted, / { transmitted = $1; received = $4 }
+        /^rtt min\/avg\/max\/mdev/ { split($4, rtt, "/"); avg = rtt[2] }
+        END {
+            if (transmitted == 0)
+                exit 1
+            printf "\"transmitted\":%d,\"received\":%d,\"pps\":%.0f,\"cpu_us_per_probe\":%.3f,", transmitted, received,
+                   transmitted / real, cpu * 1000000 / transmitted
+            printf "\"rtt_avg_ms\":%.3f,\"rtt_error_ms\":%.3f,\"loss_pct\":%.2f",
+                   avg, (received > 0) ? avg - delay : 0, 100 - received * 100 / transmitted
+        }' "$WORK/out" >"$WORK/fields" || { fail ping "$test"; return 1; }
+
+    record "$profile" "$type" "$test" "$engine" "$(cat "$WORK/fields")"
+}
+
+# Runs traceroute: run_trace <profile> <type> <engine>
+run_trace()
+{
+    local profile=$1 type=$2 engine=$3
+    local dst=$DST4
+    [ "$type" = 6 ] && dst=$DST6
+
+    measure "$BIN/traceroute" -a "$dst" -t "$type" -E "$engine"
+    [ "$STATUS" -eq 0 ] || { fail traceroute trace; return 1; }
+
+    awk -v real="$REAL" -v cpu="$CPU" -v dst="$dst" '
+        /^ *[0-9]+  / { hops = $1; reached = ($2 == dst) }
+        END { printf "\"trace_s\":%.3f,\"cpu_ms\":%.3f,\"hops\":%d,\"reached\":%s", real, cpu * 1000, hops, reached ? "true" : "false" }
+    ' "$WORK/out" >"$WORK/fields"
+
+    record "$profile" "$type" "trace" "$engine" "$(cat "$WORK/fields")"
+}
+
+# Compares the results with the baseline: a run regressed if its round-trip time error grew by more than the slack,
+# its trace time by more than the tolerance and the slack, or its trace stopped reaching dst. Only the floods are
+# compared on throughput and CPU per probe (the other runs are paced by their interval, and too short to measure
+# their CPU time). A run of the baseline that this run selected (-P, -t, -E) but has no result for is a regression,
+# so a crashed or skipped run can't pass for a clean one; new runs missing from the baseline are ignored.
+compare()
+{
+    awk -v tolerance="$TOLERANCE" -v slack="$RTT_SLACK" -v trace_slack="$TRACE_SLACK" \
+        -v profiles=" $PROFILES " -v types=" $TYPES " -v engines=" $ENGINES " '
+        function field(line, name,    value) {
+            if (!match(line, "\"" name "\":[^,}]*"))
+                return ""
+            value = substr(line, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+            gsub(/"/, "", value)
+            return value
+        }
+        function key(line) {
+            return field(line, "profile") " IPv" field(line, "ip") " " field(line, "test") " " field(line, "engine")
+        }
+        function number(line, name) { return field(line, name) + 0 }
+        function abs(x) { return (x < 0) ? -x : x }
+        function check(k, name, base, now, worse) {
+            if (worse) {
+                printf "REGRESSION %s: %s %s -> %s\n", k, name, base, now
+                regressions++
+            }
+        }
+        function selected(line) {
+            return index(profiles, " " field(line, "profile") " ") && index(types, " " field(line, "ip") " ") &&
+                   (field(line, "test") != "flood" || index(engines, " " field(line, "engine") " "))
+        }
+        FNR == NR { baseline[key($0)] = $0; next }
+        {
+            k = key($0)
+            seen[k] = 1
+            if (!(k in baseline))
+                next
+            b = baseline[k]
+            if (field(b, "test") == "flood")
+            {
+                check(k, "pps", field(b, "pps"), field($0, "pps"), number($0, "pps") < number(b, "pps") * (1 - tolerance / 100))
+                check(k, "cpu_us_per_probe", field(b, "cpu_us_per_probe"), field($0, "cpu_us_per_probe"),
+                      number($0, "cpu_us_per_probe") > number(b, "cpu_us_per_probe") * (1 + tolerance / 100))
+            }
+            if (field(b, "test") != "trace")
+            {
+                check(k, "rtt_error_ms", field(b, "rtt_error_ms"), field($0, "rtt_error_ms"),
+                      abs(number($0, "rtt_error_ms")) > abs(number(b, "rtt_error_ms")) + slack)
+            }
+            else
+            {
+                check(k, "trace_s", field(b, "trace_s"), field($0, "trace_s"),
+                      number($0, "trace_s") > number(b, "trace_s") * (1 + tolerance / 100) + trace_slack)
+                check(k, "reached", field(b, "reached"), field($0, "reached"), field(b, "reached") == "true" && field($0, "reached") != "true")
+            }
+        }
+        END {
+            for (k in baseline)
+            {
+                if (!(k in seen) && selected(baseline[k]))
+                {
+                    printf "REGRESSION %s: no result\n", k
+                    regressions++
+                }
+            }
+            if (regressions > 0)
+            {
+                printf "%d regressions against the baseline\n", regressions
+                exit 1
+            }
+            print "No regression against the baseline"
+        }' "$BASELINE" "$OUTPUT"
+}
+
+setup || { echo "Cannot build the network namespaces" >&2; exit 1; }
+: >"$OUTPUT"
+
+for profile in $PROFILES; do
+    apply_profile "$profile"
+
+    case $? in
+    1) exit 1 ;;
+    2) echo "Skipping profile $profile, netem is unavailable: $(cat "$WORK/tc")" >&2; continue ;;
+    esac
+
+    for type in $TYPES; do
+        run_ping "$profile" "$type" paced poll -c "$COUNT" -i 0.2
+        run_ping "$profile" "$type" interval poll -c $((COUNT * 10)) -i 0.01
+
+        for engine in $ENGINES; do
+            run_ping "$profile" "$type" flood "$engine" -f -c "$FLOOD_COUNT"
+        done
+
+        run_trace "$profile" "$type" poll
+    done
+done
+
+echo "Results written to $OUTPUT"
+status=0
+
+if [ -n "$BASELINE" ]; then
+    compare || status=1
+fi
+
+if [ "$FAILED" -gt 0 ]; then
+    echo "$FAILED runs failed" >&2
+    status=1
+fi
+
+exit $status
@@ -0,0 +1,227 @@
+#include <math.h> // fabs, sqrt
+#include <string.h> // memset, memcpy
+#include "stats.h"
+
+/**
+ * Empties a summary of round-trip times.
+ * @param summary Pointer to the summary.
+ */
+void reset_summary(struct rtt_summary *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    summary->min = 999999;
+}
+
+/**
+ * Adds a round-trip time to a summary: the extremes, the total, the running mean and deviation, and the jitter.
+ * The histograms that go with the summaries are recorded by their owners, as their kinds differ.
+ * @param summary Pointer to the summary to update.
+ * @param rtt The round-trip time in milliseconds.
+ */
+void summary_record(struct rtt_summary *summary, double rtt)
+{
+    summary->received++; // Increment the received counter
+    summary->min = (rtt < summary->min) ? rtt : summary->min; // Update minimum RTT
+    summary->max = (rtt > summary->max) ? rtt : summary->max; // Update maximum RTT
+    summary->total += rtt; // Update total RTT
+
+    // Welford's update, which doesn't lose precision over millions of samples like a sum of squares does
+    double delta = rtt - summary->mean;
+    summary->mean += delta / summary->received;
+    summary->m2 += delta * (rtt - summary->mean);
+
+    // J = J + (|D| - J) / 16, where D is the difference between the round-trip times of consecutive replies
+    if (summary->received > 1)
+        summary->jitter += (fabs(rtt - summary->last) - summary->jitter) / 16;
+
+    summary->last = rtt;
+}
+
+/**
+ * Gets the standard deviation of the round-trip times of a summary (mdev).
+ * @param summary Pointer to the summary.
+ * @return The standard deviation in milliseconds, or 0 without replies.
+ */
+double summary_mdev(const struct rtt_summary *summary)
+{
+    return (summary->received > 0) ? sqrt(summary->m2 / summary->received) : 0;
+}
+
+/**
+ * Empties the statistics.
+ * A fine histogram is seven times the size of the statistics, so only the few totals have one.
+ * @param ping_stats Pointer to the statistics.
+ * @param fine Pointer to the fine histogram kept along with the statistics (emptied too), or NULL for none.
+ */
+void reset_stats(struct ping_stats *ping_stats, struct histogram *fine)
+{
+    memset(ping_stats, 0, sizeof(*ping_stats));
+    reset_summary(&ping_stats->rtt);
+    ping_stats->fine = fine;
+
+    if (fine != NULL)
+        histogram_init(fine);
+}
+
+/**
+ * Marks the start of an update, so the concurrent snapshots retry until it's over.
+ * Only the thread that owns the statistics updates them, so the sequence needs no atomic increment.
+ * @param ping_stats Pointer to the statistics.
+ */
+static void begin_update(struct ping_stats *ping_stats)
+{
+    __atomic_store_n(&ping_stats->sequence, ping_stats->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The odd sequence is visible before any of the updated fields
+}
+
+/**
+ * Marks the end of an update.
+ * @param ping_stats Pointer to the statistics.
+ */
+static void end_update(struct ping_stats *ping_stats)
+{
+    __atomic_store_n(&ping_stats->sequence, ping_stats->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Counts a sent request.
+ * @param ping_stats Pointer to the statistics to update.
+ */
+void record_transmit(struct ping_stats *ping_stats)
+{
+    begin_update(ping_stats);
+    ping_stats->transmitted++;
+    end_update(ping_stats);
+}
+
+/**
+ * Updates the statistics with a new round-trip time sample.
+ * @param ping_stats Pointer to the statistics to update.
+ * @param rtt The round-trip time in milliseconds.
+ */
+void record_rtt(struct ping_stats *ping_stats, double rtt)
+{
+    begin_update(ping_stats);
+    summary_record(&ping_stats->rtt, rtt);
+    coarse_histogram_record(&ping_stats->histogram, (unsigned long long)(rtt * 1000000.0)); // In nanoseconds
+
+    if (ping_stats->fine != NULL)
+        histogram_record(ping_stats->fine, (unsigned long long)(rtt * 1000000.0));
+    end_update(ping_stats);
+}
+
+/**
+ * Counts a reply that doesn't simply answer a probe in flight.
+ * @param ping_stats Pointer to the statistics to update.
+ * @param kind The kind of reply (REPLY_*).
+ */
+void record_reply(struct ping_stats *ping_stats, int kind)
+{
+    begin_update(ping_stats);
+    ping_stats->replies[kind]++;
+    end_update(ping_stats);
+}
+
+/**
+ * Gets the name of a kind of reply, as the summary and the reports print its counter.
+ * @param kind The kind of reply (REPLY_*).
+ * @return The name.
+ */
+const char *reply_kind_name(int kind)
+{
+    static const char *names[REPLY_KINDS] = {"duplicates", "reordered", "late", "corrupted"};
+    return names[kind];
+}
+
+/**
+ * Copies the statistics while they may be updated by another thread, without ever blocking the updates.
+ * The copy is retried until no update overlapped it (seqlock).
+ * The fine histogram of the statistics is copied into the one of the snapshot, which is dropped if they have none.
+ * @param snapshot Pointer to the copy.
+ * @param ping_stats Pointer to the statistics.
+ */
+void snapshot_stats(struct ping_stats *snapshot, const struct ping_stats *ping_stats)
+{
+    struct histogram *fine = (ping_stats->fine != NULL) ? snapshot->fine : NULL;
+    unsigned int sequence;
+
+    do
+    {
+        sequence = __atomic_load_n(&ping_stats->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence & 1)
+            continue; // An update is in progress
+
+        memcpy(snapshot, ping_stats, sizeof(*snapshot));
+
+        if (fine != NULL)
+            memcpy(fine, ping_stats->fine, sizeof(*fine));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy is done before the sequence is checked again
+    } while ((sequence & 1) || __atomic_load_n(&ping_stats->sequence, __ATOMIC_RELAXED) != sequence);
+
+    snapshot->fine = fine;
+}
+
+/**
+ * Adds statistics kept apart (e.g. by another worker thread) to statistics, as if all their samples had been
+ * recorded into them. Both must be consistent copies (snapshots) or owned by the calling thread.
+ * The means and squared deviations are combined with Chan's formula, and the jitter is averaged by replies.
+ * The fine histograms are merged when both statistics have one.
+ * @param ping_stats Pointer to the statistics to add to.
+ * @param other Pointer to the statistics that are added.
+ */
+void merge_stats(struct ping_stats *ping_stats, const struct ping_stats *other)
+{
+    struct rtt_summary *rtt = &ping_stats->rtt;
+    int received = rtt->received + other->rtt.received;
+
+    if (other->rtt.received > 0)
+    {
+        double delta = other->rtt.mean - rtt->mean;
+        rtt->m2 += other->rtt.m2 + delta * delta * rtt->received * other->rtt.received / received;
+        rtt->mean += delta * other->rtt.received / received;
+        rtt->jitter = (rtt->jitter * rtt->received + other->rtt.jitter * other->rtt.received) / received;
+        rtt->min = (other->rtt.min < rtt->min) ? other->rtt.min : rtt->min;
+        rtt->max = (other->rtt.max > rtt->max) ? other->rtt.max : rtt->max;
+        rtt->total += other->rtt.total;
+        rtt->last = other->rtt.last;
+        coarse_histogram_merge(&ping_stats->histogram, &other->histogram);
+
+        if (ping_stats->fine != NULL && other->fine != NULL)
+            histogram_merge(ping_stats->fine, other->fine);
+    }
+
+    ping_stats->transmitted += other->transmitted;
+    rtt->received = received;
+
+    for (int kind = 0; kind < REPLY_KINDS; kind++)
+        ping_stats->replies[kind] += other->replies[kind];
+
+    if (ping_stats->start_time == 0 || (other->start_time != 0 && other->start_time < ping_stats->start_time))
+        ping_stats->start_time = other->start_time;
+}
+
+/**
+ * Gets the standard deviation of the round-trip times (mdev).
+ * @param ping_stats Pointer to the statistics.
+ * @return The standard deviation in milliseconds, or 0 without replies.
+ */
+double rtt_mdev(const struct ping_stats *ping_stats)
+{
+    return summary_mdev(&ping_stats->rtt);
+}
+
+/**
+ * Gets a percentile of the round-trip times, from the fine histogram if the statistics have one.
+ * @param ping_stats Pointer to the statistics.
+ * @param percentile The percentile (e.g. 99.9).
+ * @return The round-trip time of the percentile in milliseconds.
+ */
+double rtt_percentile(const struct ping_stats *ping_stats, double percentile)
+{
+    if (ping_stats->fine != NULL)
+        return histogram_quantile(ping_stats->fine, percentile / 100) / 1000000.0;
+
+    return coarse_histogram_quantile(&ping_stats->histogram, percentile / 100) / 1000000.0;
+}
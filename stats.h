@@ -0,0 +1,52 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "histogram.h"
+
+// Kinds of replies that don't simply answer a probe in flight
+#define REPLY_DUPLICATE 0 // Another reply to a probe that was already answered
+#define REPLY_REORDERED 1 // The reply to a probe older than the latest answered one of its target (also counted as received)
+#define REPLY_LATE 2 // A reply to a probe that had already timed out
+#define REPLY_CORRUPTED 3 // A reply whose checksum, size or payload doesn't match the request
+#define REPLY_KINDS 4
+
+// Structure to hold the summary of round-trip times, shared by the statistics and the report windows
+struct rtt_summary
+{
+    int received;
+    double min;
+    double max;
+    double total;
+    double mean; // Running mean of the round-trip times (Welford)
+    double m2; // Running sum of the squared deviations from the mean (Welford), for the standard deviation
+    double jitter; // Interarrival jitter (RFC 3550): smoothed difference between consecutive round-trip times
+    double last; // Round-trip time of the previous reply, for the jitter
+};
+
+// Structure to hold ping statistics
+struct ping_stats
+{
+    unsigned int sequence; // Seqlock: odd while an update is in progress, so other threads can take consistent snapshots
+    int transmitted;
+    struct rtt_summary rtt; // Round-trip times of the replies
+    int replies[REPLY_KINDS]; // Replies of each kind (REPLY_*)
+    struct coarse_histogram histogram; // Round-trip times in nanoseconds, for the percentiles
+    struct histogram *fine; // Finer histogram of the same samples, for the totals of the summary (NULL for a target)
+    double start_time; // Monotonic time the statistics started, in milliseconds
+};
+
+// Function declarations
+void reset_summary(struct rtt_summary *summary);
+void summary_record(struct rtt_summary *summary, double rtt);
+double summary_mdev(const struct rtt_summary *summary);
+void reset_stats(struct ping_stats *ping_stats, struct histogram *fine);
+void record_transmit(struct ping_stats *ping_stats);
+void record_rtt(struct ping_stats *ping_stats, double rtt);
+void record_reply(struct ping_stats *ping_stats, int kind);
+const char *reply_kind_name(int kind);
+void snapshot_stats(struct ping_stats *snapshot, const struct ping_stats *ping_stats);
+void merge_stats(struct ping_stats *ping_stats, const struct ping_stats *other);
+double rtt_mdev(const struct ping_stats *ping_stats);
+double rtt_percentile(const struct ping_stats *ping_stats, double percentile);
+
+#endif // _STATS_H
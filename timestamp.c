@@ -0,0 +1,259 @@
+#include <string.h> // memset, memcpy
+#include <errno.h> // EAGAIN, ENOMSG
+#include <time.h> // struct timespec, needed before the kernel headers
+#include <linux/net_tstamp.h> // SO_TIMESTAMPING flags and struct scm_timestamping
+#include <linux/errqueue.h> // struct sock_extended_err
+#include <netinet/in.h> // IP_RECVERR, IPV6_RECVERR, IP_TTL, IPV6_HOPLIMIT
+#include "timestamp.h"
+
+/**
+ * Gets the current time of the monotonic clock.
+ * Unlike the wall clock, it never jumps when the system time is adjusted (e.g. by NTP).
+ * @param ts Pointer to the timespec to fill.
+ */
+void monotonic_time(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/**
+ * Gets the current time of the monotonic clock in milliseconds.
+ * @return The current time in milliseconds as a double.
+ */
+double monotonic_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Asks the kernel to timestamp the packets sent and received on the socket.
+ * Received packets carry their timestamps in a control message, and the transmit timestamps are queued on
+ * the socket's error queue, tagged with a per-socket counter of the sent packets (SOF_TIMESTAMPING_OPT_ID).
+ * @param sock The socket file descriptor.
+ * @return 0 on success, or -1 if the kernel doesn't support timestamping (the user timestamps are used then).
+ */
+int enable_timestamping(int sock)
+{
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/**
+ * Asks the kernel to attach the number of packets the socket dropped so far (because its receive buffer was full)
+ * to the packets received on it.
+ * @param sock The socket file descriptor.
+ * @return 0 on success, or -1 if the kernel doesn't support it.
+ */
+int enable_drop_count(int sock)
+{
+    int on = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+}
+
+/**
+ * Copies the kernel timestamps of a control message into a packet_times structure.
+ * @param msg Pointer to the received message.
+ * @param times Pointer to the packet_times structure to fill.
+ * @param key If not NULL, receives the transmit timestamp key of an error queue message.
+ * @return 1 if a transmit timestamp key was found, 0 otherwise.
+ */
+static int parse_control(struct msghdr *msg, struct packet_times *times, unsigned int *key)
+{
+    int found_key = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct scm_timestamping tss;
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            times->software = tss.ts[0]; // ts[1] is deprecated, ts[2] is the raw hardware timestamp
+            times->hardware = tss.ts[2];
+        }
+
+        else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            memcpy(&times->drops, CMSG_DATA(cmsg), sizeof(times->drops));
+        }
+
+        else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_TTL) ||
+                 (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT))
+        {
+            memcpy(&times->hops, CMSG_DATA(cmsg), sizeof(times->hops));
+        }
+
+        else if (key != NULL && ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                                 (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+        {
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+            if (err.ee_errno == ENOMSG && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+            {
+                *key = err.ee_data;
+                found_key = 1;
+            }
+        }
+    }
+
+    return found_key;
+}
+
+/**
+ * Receives a packet together with its timestamps.
+ * The user timestamp is always taken, the kernel ones are filled in when the kernel provides them.
+ * @param sock The socket file descriptor.
+ * @param buffer Buffer to store the packet.
+ * @param len The size of the buffer.
+ * @param flags Flags for recvmsg(2) (e.g. MSG_DONTWAIT).
+ * @param addr Pointer to the structure to store the source address in.
+ * @param addr_len Pointer to the size of the address structure.
+ * @param times Pointer to the packet_times structure to fill.
+ * @return The number of bytes received, or -1 on error.
+ */
+ssize_t recv_timestamped(int sock, void *buffer, size_t len, int flags, void *addr, socklen_t *addr_len, struct packet_times *times)
+{
+    char control[TIMESTAMP_CONTROL_SIZE];
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    struct msghdr msg = {
+        .msg_name = addr,
+        .msg_namelen = *addr_len,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control)
+        };
+
+    ssize_t bytes = recvmsg(sock, &msg, flags);
+    monotonic_time(&times->user); // Taken right after the system call, before any processing
+
+    if (bytes < 0)
+        return bytes;
+
+    *addr_len = msg.msg_namelen;
+    read_rx_timestamps(&msg, times);
+    return bytes;
+}
+
+/**
+ * Reads the kernel timestamps of a packet received with recvmsg(2) or recvmmsg(2).
+ * The user timestamp is left untouched, as the caller takes it right after the system call.
+ * @param msg Pointer to the received message, with its control messages.
+ * @param times Pointer to the packet_times structure to fill.
+ */
+void read_rx_timestamps(struct msghdr *msg, struct packet_times *times)
+{
+    memset(&times->software, 0, sizeof(times->software));
+    memset(&times->hardware, 0, sizeof(times->hardware));
+    times->hops = -1;
+    times->drops = 0;
+    parse_control(msg, times, NULL);
+}
+
+/**
+ * Reads one transmit timestamp from the socket's error queue.
+ * Only the kernel timestamps are filled in, the user timestamp is left untouched.
+ * @param sock The socket file descriptor.
+ * @param key Receives the number of the sent packet the timestamp belongs to (0 for the first packet).
+ * @param times Pointer to the packet_times structure to fill.
+ * @return 1 if a timestamp was read, 0 if the error queue is empty, or -1 on error.
+ */
+int read_tx_timestamp(int sock, unsigned int *key, struct packet_times *times)
+{
+    char control[TIMESTAMP_CONTROL_SIZE];
+    char data[64]; // With SOF_TIMESTAMPING_OPT_TSONLY no packet data is returned
+    struct iovec iov = {.iov_base = data, .iov_len = sizeof(data)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control)
+        };
+
+    while (1)
+    {
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+        struct packet_times tx = {0};
+
+        if (parse_control(&msg, &tx, key))
+        {
+            times->software = tx.software;
+            times->hardware = tx.hardware;
+            return 1;
+        }
+
+        // Another kind of error (e.g. an ICMP error), skip it
+        msg.msg_controllen = sizeof(control);
+    }
+}
+
+/**
+ * Calculates the difference between two timespecs in milliseconds.
+ */
+static double timespec_diff_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/**
+ * Calculates the time between a sent and a received packet using the most accurate pair of timestamps
+ * taken by the same clock: hardware, then kernel software, and the monotonic user timestamps otherwise.
+ * @param start Pointer to the timestamps of the sent packet.
+ * @param end Pointer to the timestamps of the received packet.
+ * @param source If not NULL, receives the source of the timestamps that were used (TS_SOURCE_*).
+ * @return The elapsed time in milliseconds.
+ */
+double elapsed_ms(const struct packet_times *start, const struct packet_times *end, int *source)
+{
+    int chosen = TS_SOURCE_USER;
+    double elapsed = timespec_diff_ms(&start->user, &end->user);
+
+    if (start->hardware.tv_sec != 0 && end->hardware.tv_sec != 0)
+    {
+        chosen = TS_SOURCE_HARDWARE;
+        elapsed = timespec_diff_ms(&start->hardware, &end->hardware);
+    }
+
+    else if (start->software.tv_sec != 0 && end->software.tv_sec != 0)
+    {
+        chosen = TS_SOURCE_SOFTWARE;
+        elapsed = timespec_diff_ms(&start->software, &end->software);
+    }
+
+    // The wall clock of the software timestamps was stepped in between, fall back to the monotonic clock
+    if (elapsed < 0)
+    {
+        chosen = TS_SOURCE_USER;
+        elapsed = timespec_diff_ms(&start->user, &end->user);
+    }
+
+    if (source != NULL)
+        *source = chosen;
+
+    return elapsed;
+}
+
+/**
+ * Gets the name of a timestamp source, for printing.
+ * @param source The timestamp source (TS_SOURCE_*).
+ * @return The name of the source.
+ */
+const char *timestamp_source_name(int source)
+{
+    switch (source)
+    {
+    case TS_SOURCE_HARDWARE:
+        return "hw";
+    case TS_SOURCE_SOFTWARE:
+        return "kernel";
+    default:
+        return "user";
+    }
+}
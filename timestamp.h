@@ -0,0 +1,37 @@
+#ifndef _TIMESTAMP_H
+#define _TIMESTAMP_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/socket.h>
+
+// Sources of the timestamps a round-trip time can be measured with, from the least to the most accurate
+#define TS_SOURCE_USER 0 // CLOCK_MONOTONIC, read by the program around the system calls
+#define TS_SOURCE_SOFTWARE 1 // Taken by the kernel when the packet passes the network stack
+#define TS_SOURCE_HARDWARE 2 // Taken by the NIC (only if the NIC supports it and hardware timestamping is enabled on it)
+
+#define TIMESTAMP_CONTROL_SIZE 512 // Room for the control messages of a received packet
+
+// Structure to hold the timestamps of a sent or received packet (zero when a timestamp isn't available)
+struct packet_times
+{
+    struct timespec user; // CLOCK_MONOTONIC
+    struct timespec software; // Kernel software timestamp (CLOCK_REALTIME)
+    struct timespec hardware; // Raw NIC hardware timestamp
+    int hops; // TTL or hop limit of a received packet, from its IP_TTL / IPV6_HOPLIMIT control message (-1 without one)
+    unsigned int drops; // Packets the socket dropped so far, from the SO_RXQ_OVFL control message of a received packet
+                        // (0 without one: the kernel only attaches it once the socket dropped packets)
+};
+
+// Function declarations
+double monotonic_time_ms(void);
+void monotonic_time(struct timespec *ts);
+int enable_timestamping(int sock);
+int enable_drop_count(int sock);
+ssize_t recv_timestamped(int sock, void *buffer, size_t len, int flags, void *addr, socklen_t *addr_len, struct packet_times *times);
+void read_rx_timestamps(struct msghdr *msg, struct packet_times *times);
+int read_tx_timestamp(int sock, unsigned int *key, struct packet_times *times);
+double elapsed_ms(const struct packet_times *start, const struct packet_times *end, int *source);
+const char *timestamp_source_name(int source);
+
+#endif // _TIMESTAMP_H
@@ -4,76 +4,200 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
 #include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
 #include "traceroute.h"
+#include "checksum.h"
+#include "timestamp.h"
+#include "netaddr.h"
+#include "filter.h"
+#include "engine.h"
+#include "resolver.h"
+#include "capture.h"
 
-/**
- * Calculates Checksum for IP/ICMP headers
- * @param addr Pointer to the buffer containing data
- * @param len Length of data in bytes
- * @return Checksum value
- */
-unsigned short calculate_checksum(unsigned short *addr, int len) {
-    unsigned int sum = 0; // Sum to handle overflow
-    unsigned short answer = 0; // Final checksum result
-    unsigned short *w = addr; // Working pointer
-    int nleft = len; // Remaining bytes to process
+struct trace;
 
-    // Process at a time
-    while (nleft > 1) {
-        sum += *w++;
-        nleft -= 2;
-    }
+// Structure to hold a probe and, once it arrives, its reply
+struct hop_probe {
+    int state; // PROBE_UNSENT, PROBE_PENDING, PROBE_ANSWERED or PROBE_TIMEOUT
+    int ttl; // TTL of the probe
+    int flow; // Flow identifier of the probe
+    unsigned short seq; // Sequence number of the probe
+    unsigned int tag; // Tag of the request in the engine: the sequence number, and the count of probes above it
+    struct packet_times sent; // Timestamps of the probe
+    double send_time; // Monotonic time the probe was sent, in milliseconds
+    double rtt; // Round-trip time of the reply
+    int source; // Source of the timestamps of the reply
+    int type; // ICMP type of the reply
+    int code; // ICMP code of the reply
+    int echo_reply; // Whether the reply is an echo reply
+    struct net_addr responder; // Address of the router or host that replied
+    struct trace *trace; // Trace the probe belongs to in the multi-destination mode, or NULL
+    struct hop_probe *timer_next; // Next probe in the same slot of the timer wheel
+};
 
-    if (nleft == 1) {
-        *(unsigned char *)(&answer) = *(unsigned char *)w;
-        sum += answer;
-    }
+// Structure to hold the trace to one destination in the multi-destination mode
+struct trace {
+    struct net_addr dest; // Destination address
+    struct hop_probe probes[MAX_HOPS * TRIES_PER_HOP]; // Probe of TTL t and try i is at (t - 1) * TRIES_PER_HOP + i
+    int state; // TRACE_QUEUED, TRACE_ACTIVE, TRACE_PROBED or TRACE_PRINTED
+    int dirty; // Whether a probe of the trace was answered or timed out since the trace was last advanced
+    int next_ttl; // Next TTL of the forward phase to send probes for
+    int forward_ttl; // Lowest TTL of the forward phase whose probes aren't all answered or timed out
+    int silent; // Number of consecutive silent hops below forward_ttl
+    int end_ttl; // Last TTL to probe and print: the destination, or where the gap limit was hit
+    int back_ttl; // TTL probed by the backward phase, or 0 once it stopped
+    int borrow_ttl; // The hops below this TTL are the ones of the owner, or 0 if none are borrowed
+    struct trace *owner; // Trace that discovered the path prefix shared with this one
+};
 
-    // Fold 32-bit sum into 16 bits
-    sum = (sum >> 16) + (sum & 0xFFFF); // Add high 16 to low 16
-    sum += (sum >> 16); // Add carry
-    answer = ~sum; // One's complement
-    return answer;
-}
+// Structure to hold the options of the multi-destination mode
+struct multi_options {
+    int window; // Number of TTLs of the forward phase probed at the same time, per destination
+    int rate; // Probes per second, overall
+    int hop_rate; // Probes per second, per TTL
+    int first_ttl; // TTL at which the forward phase starts, and below which the backward phase goes
+    int quiet; // Whether the traces are only probed, not printed (the re-traces of the monitor mode)
+};
+
+// Structure to hold the last known path to a destination in the monitor mode
+struct path {
+    struct net_addr dest; // Destination address
+    int hops; // Number of hops of the last full trace (its end TTL)
+    int reached; // Whether the last full trace reached the destination
+    struct net_addr responders[MAX_HOPS]; // First responder of each hop (type 0 for a silent hop)
+    double rtt; // Baseline round-trip time to the destination: the lowest one of the last full trace
+    int sample_ttl; // Hop sampled by the last round, 0 if none
+    int losses; // Consecutive rounds the destination didn't answer
+    int rtt_shifts; // Consecutive rounds the round-trip time to the destination was off its baseline
+    struct hop_probe checks[2]; // Probes of the current round: the destination's hop, and the sampled hop
+    char trigger[HOST_STRLEN + 64]; // Why the path must be traced again, empty if it needn't
+};
+
+// Structure to hold an entry of the stop set: an interface seen at a given TTL by a trace
+struct stop_entry {
+    struct trace *owner; // The trace that saw the interface first, or NULL if the entry is free
+    int ttl; // TTL at which the interface replied
+    struct net_addr addr; // Address of the interface
+};
+
+// Structure to hold an outstanding probe in the lookup table
+struct probe_entry {
+    struct hop_probe *probe; // The probe, or NULL if the sequence number is free
+    struct net_addr dest; // Destination of the probe, checked against the header quoted in ICMP errors
+};
+
+// Structure to hold the parsed headers of a received ICMP or ICMPv6 packet
+struct reply_info {
+    int type; // ICMP type
+    int code; // ICMP code
+    int echo_reply; // Whether the packet is an echo reply (rather than an error)
+    unsigned short id; // Identifier of the echo request the packet replies to (network byte order)
+    unsigned short seq; // Sequence number of the echo request the packet replies to (host byte order)
+    struct in6_addr dest; // Destination of that echo request (a struct in_addr for IPv4)
+};
+
+// Global variables
+static struct probe_entry probe_table[PROBE_TABLE_SIZE]; // Outstanding probes, indexed by sequence number
+static unsigned short next_seq = 1; // Sequence number of the next probe
+static unsigned short probe_id = 0; // ICMP identifier of our probes (network byte order)
+static int flow_id = DEFAULT_FLOW; // Flow identifier of the probes, outside of the multipath mode
+static int packet_size = PACKET_SIZE; // Size of the probes (-s)
+static char probe_templates[2][MAX_PACKET_SIZE]; // Prebuilt IPv4 and IPv6 echo requests, with sequence number 0
+static unsigned short template_checksum[2]; // Checksums of the prebuilt echo requests
+
+static int timestamping = 0; // Whether the kernel timestamps the packets
+static int sockets[2] = {-1, -1}; // IPv4 and IPv6 sockets, whose replies the engine receives
+static int resolving = 0; // Whether the names of the hops are resolved (-N), off the probe loop
+static int capturing = 0; // Whether the probes are appended to a capture file (-w), as their hops are printed
+static struct capture_writer writer; // The capture file (-w)
+static unsigned int capture_target = 0; // Index of the destination being printed, in the capture file
+
+// Multi-destination mode
+static struct stop_entry *stop_set = NULL; // Interfaces seen so far, to share path prefixes between traces
+static unsigned int stop_set_size = 0; // Number of entries of the stop set (a power of 2)
+static struct hop_probe *timer_wheel[WHEEL_SLOTS]; // Pending probes, by the tick at which they time out
+static long wheel_tick = 0; // Next tick of the timer wheel to process
+
+// Monitor mode
+static volatile sig_atomic_t keep_running = 1; // Cleared by SIGINT and SIGTERM, so the monitor prints its summary
+static unsigned long probe_count = 0; // Number of probes sent, for the summary of the monitor mode
 
 /**
- * Gets current time in milliseconds
- * @return Current time in milliseconds as a double
+ * Prebuilds the IPv4 and IPv6 echo requests once, so sending a probe only fills in its sequence number,
+ * its flow and the balance word, and checksums nothing.
  */
-double get_time_ms() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (double)tv.tv_sec * 1000.0 + (double)tv.tv_usec / 1000.0;
+void build_probe_templates(void) {
+    for (int v6 = 0; v6 < 2; v6++) {
+        struct icmphdr *icmp_header = (struct icmphdr *)probe_templates[v6]; // Same layout in ICMPv6
+
+        memset(probe_templates[v6], 0, packet_size); // Clear packet buffer
+        icmp_header->type = v6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO; // Echo Request
+        icmp_header->code = 0; // Set the code of the ICMP packet to 0 (As it isn't used in the ECHO type)
+        icmp_header->un.echo.id = probe_id; // Identity
+        template_checksum[v6] = calculate_checksum(icmp_header, packet_size); // With the balance word zeroed
+    }
 }
 
-int send_probe(int sockfd, struct sockaddr_in *dest_addr, int seq) {
-    char packet[PACKET_SIZE]; // Packet buffer
+/**
+ * Sends an ICMP or ICMPv6 echo request with the given TTL (hop limit).
+ * The TTL is passed as a control message, so probes for different TTLs can be sent back to back
+ * without changing the socket's TTL in between.
+ * The checksum is kept equal to the flow identifier whatever the sequence number, by balancing it with the
+ * first word of the payload: load balancers hash the checksum like a port number, so all the probes of a flow
+ * take the same path (Paris traceroute). The kernel computes the ICMPv6 checksum itself, over a pseudo-header
+ * that is the same for all the probes to a destination, so balancing the payload keeps it constant too.
+ * @param sockfd The socket file descriptor
+ * @param dest_addr Pointer to the destination address
+ * @param seq Sequence number of the probe
+ * @param tag Tag of the request, given back with its transmit timestamp
+ * @param ttl TTL of the probe
+ * @param flow Flow identifier of the probe
+ * @return Number of bytes queued (the engine sends them when it waits next), or -1 on error
+ */
+int send_probe(int sockfd, struct net_addr *dest_addr, int seq, unsigned int tag, int ttl, int flow) {
+    char *packet = probe_templates[dest_addr->type == 6]; // Prebuilt echo request
     struct icmphdr *icmp_header = (struct icmphdr *)packet; // ICMP header
+    unsigned short *balance = (unsigned short *)(packet + sizeof(struct icmphdr)); // First word of the payload
+
+    icmp_header->un.echo.sequence = htons(seq); // Set the sequence number
+
+    // The template was checksummed with sequence number 0, so only the new sequence number is added to it
+    *balance = checksum_balance(checksum_update16(template_checksum[dest_addr->type == 6], 0, icmp_header->un.echo.sequence), htons(flow));
+    icmp_header->checksum = (dest_addr->type == 6) ? 0 : htons(flow); // Now the flow identifier (the kernel fills in the ICMPv6 one)
+
+    // Attach the TTL as an IP_TTL or IPV6_HOPLIMIT control message
+    char control[HOP_LIMIT_CONTROL_SIZE];
+    struct iovec iov = {.iov_base = packet, .iov_len = packet_size};
+    struct msghdr msg = {
+        .msg_name = &dest_addr->sa,
+        .msg_namelen = address_length(dest_addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control
+    };
 
-    // Prepare ICMP packet
-    memset(packet, 0, PACKET_SIZE); // Clear packet buffer
-    icmp_header->type = ICMP_ECHO; // ICMP Echo Request
-    icmp_header->code = 0; // Set the code of the ICMP packet to 0 (As it isn't used in the ECHO type)
-    icmp_header->un.echo.sequence = seq; // Set the sequence number
-    icmp_header->un.echo.id = getpid(); // Identity
-    icmp_header->checksum = 0; // Clear checksum
-    icmp_header->checksum = calculate_checksum((unsigned short *)icmp_header, PACKET_SIZE); // Calculate checksum
+    set_hop_limit(&msg, dest_addr->type, ttl);
 
-    return sendto(sockfd, packet, PACKET_SIZE, 0, (struct sockaddr *)dest_addr, sizeof(*dest_addr));
+    return (engine_send(sockfd, &msg, tag) == 0) ? packet_size : -1;
 }
 
-void print_probe_results(int ttl, struct sockaddr_in *recv_addr, int replies, double times[]) {
+void print_probe_results(int ttl, struct net_addr *recv_addr, int replies, double times[], int source) {
     printf("%2d  ", ttl); // Print TTL
 
-    // Print IP address and RTT times
+    // Print IP address (with its name if it's known) and RTT times
     if (replies > 0) {
-        char ip_str[16]; // IP address string (up to 3 digits for each cell and there are 4 cells + 3 dots + "\0")
-        inet_ntop(AF_INET, &recv_addr->sin_addr, ip_str, sizeof(ip_str)); // Convert IP address to string
-        printf("%s  ", ip_str); // Print IP address
+        char host[HOST_STRLEN]; // Name and IP address string
+        format_host(recv_addr, host, sizeof(host));
+        printf("%s  ", host);
 
         for (int i = 0; i < TRIES_PER_HOP; i++) {
             if (i < replies) {
@@ -88,91 +212,1824 @@ void print_probe_results(int ttl, struct sockaddr_in *recv_addr, int replies, do
                 printf("  "); // Print space between times
             }
         }
+
+        printf("  (%s)", timestamp_source_name(source)); // Print the source of the timestamps
     }
-    
+
     // No replies case
     else {
         printf("* * *");
     }
-    
+
     printf("\n");
 }
 
-int main(int argc, char *argv[]) {
-    // Check arguments and usage
-    if (argc != 3 || strcmp(argv[1], "-a") != 0) {
-        printf("Invalid arguments.\n");
-        return 1;
+/**
+ * Prints the names that arrived after their hop was printed with its address alone.
+ */
+void print_late_names(void) {
+    struct net_addr addr;
+    char name[NI_MAXHOST];
+
+    while (resolver_late_name(&addr, name, sizeof(name))) {
+        char ip_str[ADDRESS_STRLEN];
+        format_address(&addr, ip_str, sizeof(ip_str));
+        printf("    %s is %s\n", ip_str, name);
     }
 
-    int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP); // Create raw socket (related to IPv4)
+    fflush(stdout);
+}
 
-    // Check socket creation
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        return 1;
+/**
+ * Waits up to RESOLVER_DRAIN_TIMEOUT for the names of the hops printed with their address alone, and prints them.
+ */
+void wait_late_names(void) {
+    double deadline = monotonic_time_ms() + RESOLVER_DRAIN_TIMEOUT;
+
+    while (resolver_waiting() > 0) {
+        double wait = deadline - monotonic_time_ms();
+
+        if (wait <= 0) {
+            break;
+        }
+
+        struct pollfd fd = {.fd = resolver_fd(), .events = POLLIN};
+        poll(&fd, 1, (int)wait + 1);
+        print_late_names();
+    }
+
+    print_late_names();
+}
+
+/**
+ * Parses the headers of a received ICMP or ICMPv6 packet: the outer IP header (IPv4 raw sockets deliver it,
+ * IPv6 ones don't), the ICMP type and code, and either the echo header of an echo reply, or the IP and ICMP
+ * headers of the probe quoted in an error (Time Exceeded or Destination Unreachable).
+ * ICMP and ICMPv6 share the layout of these headers, only the types and the quoted IP header differ.
+ * @param ip_type IP type of the socket the packet was received on (4 or 6)
+ * @param packet The received packet
+ * @param len Length of the packet
+ * @param source Source address of the packet
+ * @param info Receives the parsed headers
+ * @return 0 if the packet replies to an echo request, or -1 otherwise (malformed, or another kind of packet)
+ */
+int parse_reply(int ip_type, const char *packet, int len, const struct net_addr *source, struct reply_info *info) {
+    if (ip_type == 4) {
+        const struct iphdr *ip_header = (const struct iphdr *)packet; // Outer IP header
+
+        if (len < (int)sizeof(struct iphdr) || ip_header->version != 4 || ip_header->ihl < 5 ||
+            ip_header->protocol != IPPROTO_ICMP || len < ip_header->ihl * 4) {
+            return -1;
+        }
+
+        packet += ip_header->ihl * 4;
+        len -= ip_header->ihl * 4;
+    }
+
+    if (len < (int)sizeof(struct icmphdr)) {
+        return -1; // Truncated packet
+    }
+
+    const struct icmphdr *icmp_header = (const struct icmphdr *)packet; // Outer ICMP header
+    info->type = icmp_header->type;
+    info->code = icmp_header->code;
+    info->echo_reply = (icmp_header->type == ((ip_type == 6) ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY));
+
+    if (info->echo_reply) {
+        info->id = icmp_header->un.echo.id;
+        info->seq = ntohs(icmp_header->un.echo.sequence);
+        memcpy(&info->dest, address_bytes(source), address_size(ip_type)); // The destination of the request is the one replying
+        return 0;
+    }
+
+    int error = (ip_type == 6) ? (icmp_header->type == ICMP6_TIME_EXCEEDED || icmp_header->type == ICMP6_DST_UNREACH) :
+                                 (icmp_header->type == ICMP_TIME_EXCEEDED || icmp_header->type == ICMP_DEST_UNREACH);
+
+    if (!error) {
+        return -1; // Not a reply to a probe (e.g. our own echo request on the loopback interface, or neighbor discovery)
+    }
+
+    // The error quotes the IP header of the probe and at least the first 8 bytes of its ICMP header
+    const char *quoted = packet + sizeof(struct icmphdr);
+    int quoted_len = len - sizeof(struct icmphdr);
+    int inner_len; // Length of the quoted IP header
+    const void *inner_dest; // Destination address in the quoted IP header
+
+    if (ip_type == 4) {
+        const struct iphdr *inner_ip = (const struct iphdr *)quoted;
+
+        if (quoted_len < (int)sizeof(struct iphdr) || inner_ip->version != 4 || inner_ip->ihl < 5 || inner_ip->protocol != IPPROTO_ICMP) {
+            return -1;
+        }
+
+        inner_len = inner_ip->ihl * 4;
+        inner_dest = &inner_ip->daddr;
+    }
+
+    else {
+        const struct ip6_hdr *inner_ip6 = (const struct ip6_hdr *)quoted;
+
+        // Our probes carry no extension headers, so the ICMPv6 header follows the IPv6 header, or the Fragment header
+        // when a probe larger than the path MTU (-s) was fragmented and the error is about its first fragment
+        if (quoted_len < (int)sizeof(struct ip6_hdr) || (inner_ip6->ip6_vfc >> 4) != 6) {
+            return -1;
+        }
+
+        inner_len = sizeof(struct ip6_hdr);
+        inner_dest = &inner_ip6->ip6_dst;
+
+        if (inner_ip6->ip6_nxt == IPPROTO_FRAGMENT) {
+            const struct ip6_frag *fragment = (const struct ip6_frag *)(quoted + inner_len);
+
+            if (quoted_len < inner_len + (int)sizeof(struct ip6_frag) || fragment->ip6f_nxt != IPPROTO_ICMPV6 ||
+                (fragment->ip6f_offlg & IP6F_OFF_MASK) != 0) {
+                return -1;
+            }
+
+            inner_len += sizeof(struct ip6_frag);
+        }
+
+        else if (inner_ip6->ip6_nxt != IPPROTO_ICMPV6) {
+            return -1;
+        }
+    }
+
+    if (quoted_len < inner_len + 8) {
+        return -1;
+    }
+
+    const struct icmphdr *inner_icmp = (const struct icmphdr *)(quoted + inner_len);
+
+    if (inner_icmp->type != ((ip_type == 6) ? ICMP6_ECHO_REQUEST : ICMP_ECHO)) {
+        return -1;
+    }
+
+    info->id = inner_icmp->un.echo.id;
+    info->seq = ntohs(inner_icmp->un.echo.sequence);
+    memcpy(&info->dest, inner_dest, address_size(ip_type));
+    return 0;
+}
+
+/**
+ * Sends a probe and registers it in the lookup table, so its reply can be routed back to it.
+ * @param sockfd The socket file descriptor
+ * @param dest_addr Pointer to the destination address
+ * @param probe Pointer to the probe
+ * @param ttl TTL of the probe
+ * @param flow Flow identifier of the probe
+ * @return 0 on success, or 1 on error
+ */
+int start_probe(int sockfd, struct net_addr *dest_addr, struct hop_probe *probe, int ttl, int flow) {
+    // Skip the sequence numbers still used by outstanding probes (and 0)
+    while (next_seq == 0 || probe_table[next_seq].probe != NULL) {
+        next_seq++;
     }
 
-    // Set socket timeout
-    struct timeval tv = {TIMEOUT, 0}; 
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    unsigned short seq = next_seq++;
+    memset(probe, 0, sizeof(*probe));
+    probe->ttl = ttl;
+    probe->seq = seq;
+    probe->tag = (unsigned int)probe_count << 16 | seq; // Tells this probe from a later one that reuses its number
+    probe->flow = flow;
+    probe_count++;
+    monotonic_time(&probe->sent.user);
+    probe->send_time = probe->sent.user.tv_sec * 1000.0 + probe->sent.user.tv_nsec / 1000000.0;
 
-    // Prepare destination address
-    struct sockaddr_in dest_addr; // Destination address
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET; // IPv4
-    if (inet_pton(AF_INET, argv[2], &dest_addr.sin_addr) <= 0) { // Convert IP address to binary
-        printf("Invalid address\n");
-        close(sockfd);
+    if (send_probe(sockfd, dest_addr, seq, probe->tag, ttl, flow) <= 0) {
+        perror("sendto failed");
+        probe->state = PROBE_TIMEOUT; // Counts as a lost probe
         return 1;
     }
 
-    printf("traceroute to %s, %d hops max\n", argv[2], MAX_HOPS);
+    probe->state = PROBE_PENDING;
+    probe_table[seq].probe = probe;
+    probe_table[seq].dest = *dest_addr;
+    return 0;
+}
+
+/**
+ * Gives up on a probe that waited for its reply longer than TIMEOUT, and frees its sequence number.
+ * @param probe Pointer to the probe
+ */
+void expire_probe(struct hop_probe *probe) {
+    if (probe_table[probe->seq].probe == probe) {
+        probe_table[probe->seq].probe = NULL;
+    }
+
+    probe->state = PROBE_TIMEOUT;
+
+    if (probe->trace != NULL) {
+        probe->trace->dirty = 1;
+    }
+}
+
+/**
+ * Routes each packet received during the last wait to the probe that caused it.
+ * Packets that aren't replies to our outstanding probes (other processes' pings and traceroutes,
+ * late or duplicate replies) are dropped.
+ * @return 0 on success, or 1 on error
+ */
+int receive_replies(void) {
+    if (resolving && engine_ready(resolver_fd())) {
+        print_late_names();
+    }
+
+    // Attach the transmit timestamps before the replies are matched
+    for (int v6 = 0; v6 < 2 && timestamping; v6++) {
+        unsigned int key, tag;
+        struct packet_times tx;
+
+        while (sockets[v6] >= 0 && read_tx_timestamp(sockets[v6], &key, &tx) > 0) {
+            if (!engine_tx_tag(sockets[v6], key, &tag)) {
+                continue; // Too old for the engine to know its probe
+            }
+
+            struct hop_probe *probe = probe_table[tag % PROBE_TABLE_SIZE].probe;
+
+            if (probe == NULL || probe->tag != tag) {
+                continue; // The probe expired, and its sequence number may have gone to another one since
+            }
+
+            probe->sent.software = tx.software;
+            probe->sent.hardware = tx.hardware;
+        }
+    }
+
+    while (1) {
+        struct engine_packet packet;
+        int ret = engine_receive(&packet);
+
+        if (ret <= 0) {
+            return (ret < 0) ? 1 : 0; // No more packets to read, or an error
+        }
+
+        int ip_type = (packet.sock == sockets[1]) ? 6 : 4;
+        struct net_addr source;
+        struct reply_info info;
+        address_from_sockaddr(&source, &packet.source);
+
+        if (parse_reply(ip_type, packet.data, packet.len, &source, &info) != 0 || info.id != probe_id) {
+            continue; // Not a reply to one of our probes
+        }
+
+        struct probe_entry *entry = &probe_table[info.seq];
+
+        if (entry->probe == NULL || entry->probe->seq != info.seq || !same_address(&entry->dest, ip_type, &info.dest)) {
+            continue; // Late or duplicate reply, or a probe of ours with the same number but another destination
+        }
+
+        struct hop_probe *probe = entry->probe;
+        entry->probe = NULL;
+        probe->state = PROBE_ANSWERED;
+        probe->rtt = elapsed_ms(&probe->sent, &packet.times, &probe->source);
+        probe->type = info.type;
+        probe->code = info.code;
+        probe->echo_reply = info.echo_reply;
+        probe->responder = source;
+        resolver_request(&source); // Likely resolved by the time the hop is printed
+
+        if (probe->trace != NULL) {
+            probe->trace->dirty = 1;
+        }
+    }
+}
+
+/**
+ * Sends the queued probes, then waits for replies until the given time, routing them to their probes.
+ * @param deadline Monotonic time to wait until, in milliseconds
+ * @param probe If not NULL, stop as soon as this probe is no longer pending
+ * @return 0 on success, or 1 on error
+ */
+int wait_replies(double deadline, struct hop_probe *probe) {
+    while (probe == NULL || probe->state == PROBE_PENDING) {
+        if (monotonic_time_ms() >= deadline) {
+            break;
+        }
+
+        if (engine_wait(deadline) != 0 || receive_replies() != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether a probe reached the destination: the destination answers with an echo reply,
+ * or with an error of its own (e.g. port unreachable).
+ * @param probe Pointer to the probe
+ * @param dest_addr Pointer to the destination address
+ * @return 1 if the destination replied, 0 otherwise
+ */
+int reached_destination(struct hop_probe *probe, struct net_addr *dest_addr) {
+    return probe->state == PROBE_ANSWERED &&
+           (probe->echo_reply || same_address(&probe->responder, dest_addr->type, address_bytes(dest_addr)));
+}
+
+/**
+ * Appends the probes of a hop to the capture file (-w), as the hop is printed.
+ * @param ttl TTL of the hop
+ * @param probes The probes of the hop
+ * @param num_probes Number of probes
+ */
+void capture_hop(int ttl, struct hop_probe *probes, int num_probes) {
+    for (int i = 0; i < num_probes; i++) {
+        struct hop_probe *probe = &probes[i];
+        int answered = (probe->state == PROBE_ANSWERED);
+        struct probe_outcome outcome = {
+            .outcome = answered ? OUTCOME_REPLY : OUTCOME_TIMEOUT,
+            .source = answered ? probe->source : TS_SOURCE_USER,
+            .ttl = ttl,
+            .target = capture_target,
+            .responder = answered ? capture_address(&writer, &probe->responder) : CAPTURE_NONE,
+            .seq = i,
+            .sent = capture_time(&writer, &probe->sent.user),
+            .rtt = answered ? probe->rtt : -1,
+            .type = answered ? probe->type : 0,
+            .code = answered ? probe->code : 0
+        };
+
+        capture_probe(&writer.buffer, &outcome);
+    }
+}
+
+/**
+ * Prints the results of one hop.
+ * @param ttl TTL of the hop
+ * @param hop The probes of the hop (TRIES_PER_HOP of them)
+ */
+void print_hop(int ttl, struct hop_probe *hop) {
+    double times[TRIES_PER_HOP]; // Round-trip times of the answered probes
+    struct net_addr *responder = NULL; // Address of the first responder
+    int replies = 0;
+    int source = TS_SOURCE_USER;
+
+    for (int try = 0; try < TRIES_PER_HOP; try++) {
+        if (hop[try].state == PROBE_ANSWERED) {
+            if (responder == NULL) {
+                responder = &hop[try].responder;
+            }
+
+            times[replies++] = hop[try].rtt;
+            source = hop[try].source;
+        }
+    }
+
+    print_probe_results(ttl, responder, replies, times, source);
 
-    char recv_packet[PACKET_SIZE];
-    int seq = 1; // Sequence number for each probe
+    if (capturing) {
+        capture_hop(ttl, hop, TRIES_PER_HOP);
+    }
+}
 
+/**
+ * Traces the route one probe at a time: each probe waits for its reply (or the timeout) before the next one is sent.
+ * @param sockfd The socket file descriptor
+ * @param dest_addr Pointer to the destination address
+ * @return 0 on success, or 1 on error
+ */
+int trace_serial(int sockfd, struct net_addr *dest_addr) {
     // Main loop for each TTL
     for (int ttl = 1; ttl <= MAX_HOPS; ttl++) {
-        setsockopt(sockfd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)); // Set TTL
-
-        struct sockaddr_in recv_addr; // Address of the received packet
-        socklen_t addr_len = sizeof(recv_addr); // Length of the address
+        struct hop_probe hop[TRIES_PER_HOP]; // Probes of the hop
         int reached_dest = 0; // Flag to check if destination reached
-        int replies = 0; // Number of replies
-        double times[TRIES_PER_HOP]; // Array for round-trip times
 
         // Send probes for each TTL
-        for (int try = 0; try < TRIES_PER_HOP; try++) { 
-            double send_time = get_time_ms(); // Time of sending probe
-            
-            // Send probe and check for errors
-            if (send_probe(sockfd, &dest_addr, seq++) <= 0) {
-                perror("sendto failed");
+        for (int try = 0; try < TRIES_PER_HOP; try++) {
+            if (start_probe(sockfd, dest_addr, &hop[try], ttl, flow_id) != 0) {
                 continue;
             }
 
-            memset(recv_packet, 0, PACKET_SIZE); // Clear receive buffer
-            int recv_len = recvfrom(sockfd, recv_packet, PACKET_SIZE, 0, (struct sockaddr *)&recv_addr, &addr_len); // Receive packet
-
-            if (recv_len > 0) { // Check if packet received
-                times[replies] = get_time_ms() - send_time; // Calculate round-trip time
-                replies++;
+            // Wait for the reply of this probe, ignoring the packets that aren't for it
+            if (wait_replies(hop[try].send_time + TIMEOUT * 1000.0, &hop[try]) != 0) {
+                return 1;
+            }
 
-                if (recv_addr.sin_addr.s_addr == dest_addr.sin_addr.s_addr) { // Check if destination reached
-                    reached_dest = 1; // Set flag
-                }
+            if (hop[try].state == PROBE_PENDING) {
+                expire_probe(&hop[try]);
             }
+
+            reached_dest = reached_dest || reached_destination(&hop[try], dest_addr);
         }
 
-        print_probe_results(ttl, &recv_addr, replies, times); // Print probe results
+        print_hop(ttl, hop); // Print probe results
 
         if (reached_dest) { // Check if destination reached
             break; // Exit loop
         }
     }
 
-    // Close the socket and return 0 to the operating system
-    close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Traces the route with the probes of up to `window` TTLs in flight at the same time.
+ * Each reply is routed to its probe through the lookup table, and the hops are printed in order
+ * as soon as all the probes of a hop and of the hops before it are answered or timed out.
+ * @param sockfd The socket file descriptor
+ * @param dest_addr Pointer to the destination address
+ * @param window Number of TTLs probed at the same time
+ * @return 0 on success, or 1 on error
+ */
+int trace_parallel(int sockfd, struct net_addr *dest_addr, int window) {
+    struct hop_probe probes[MAX_HOPS * TRIES_PER_HOP]; // Probe of TTL t and try i is at (t - 1) * TRIES_PER_HOP + i
+    int next_ttl = 1; // Next TTL to send probes for
+    int printed = 0; // Number of hops printed so far
+    int dest_ttl = MAX_HOPS; // Lowest TTL at which the destination replied
+
+    while (printed < dest_ttl) {
+        // Keep up to `window` hops beyond the last printed one in flight, but never probe past the destination
+        while (next_ttl <= dest_ttl && next_ttl <= printed + window) {
+            for (int try = 0; try < TRIES_PER_HOP; try++) {
+                start_probe(sockfd, dest_addr, &probes[(next_ttl - 1) * TRIES_PER_HOP + try], next_ttl, flow_id);
+            }
+
+            next_ttl++;
+        }
+
+        // Time out the probes that waited too long, and find when the next one expires
+        double now = monotonic_time_ms();
+        double next_expiry = -1;
+
+        for (int i = printed * TRIES_PER_HOP; i < (next_ttl - 1) * TRIES_PER_HOP; i++) {
+            if (probes[i].state != PROBE_PENDING) {
+                continue;
+            }
+
+            if (now - probes[i].send_time >= TIMEOUT * 1000.0) {
+                expire_probe(&probes[i]);
+            }
+
+            else if (next_expiry < 0 || probes[i].send_time + TIMEOUT * 1000.0 < next_expiry) {
+                next_expiry = probes[i].send_time + TIMEOUT * 1000.0;
+            }
+        }
+
+        // Print the hops that are complete, in order
+        while (printed < dest_ttl && printed < next_ttl - 1) {
+            struct hop_probe *hop = &probes[printed * TRIES_PER_HOP];
+            int complete = 1;
+
+            for (int try = 0; try < TRIES_PER_HOP; try++) {
+                complete = complete && (hop[try].state != PROBE_PENDING);
+            }
+
+            if (!complete) {
+                break;
+            }
+
+            print_hop(++printed, hop);
+        }
+
+        if (printed >= dest_ttl || next_expiry < 0) {
+            continue; // Done, or nothing in flight: send the next hops
+        }
+
+        // Send the new probes, and wait for the next reply or expiry
+        if (engine_wait(next_expiry) != 0 || receive_replies() != 0) {
+            return 1;
+        }
+
+        // Lower the destination TTL as soon as the destination replied
+        for (int i = printed * TRIES_PER_HOP; i < (next_ttl - 1) * TRIES_PER_HOP; i++) {
+            if (reached_destination(&probes[i], dest_addr) && probes[i].ttl < dest_ttl) {
+                dest_ttl = probes[i].ttl;
+            }
+        }
+    }
+
+    // Forget the probes past the destination that are still in flight
+    for (int i = 0; i < (next_ttl - 1) * TRIES_PER_HOP; i++) {
+        if (probes[i].state == PROBE_PENDING) {
+            expire_probe(&probes[i]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Prints the results of one hop of the multipath mode: each interface that replied, with the
+ * number of flows that went through it and their round-trip times.
+ * @param ttl TTL of the hop
+ * @param probes The probes of the hop
+ * @param num_probes Number of probes
+ */
+void print_multipath_hop(int ttl, struct hop_probe *probes, int num_probes) {
+    int printed[MDA_MAX_PROBES] = {0}; // Whether the interface of a probe was already printed
+    int interfaces = 0;
+
+    for (int i = 0; i < num_probes; i++) {
+        if (probes[i].state != PROBE_ANSWERED || printed[i]) {
+            continue;
+        }
+
+        // Gather the flows that went through the same interface
+        int flows = 0;
+        double min_rtt = probes[i].rtt, total_rtt = 0;
+
+        for (int j = i; j < num_probes; j++) {
+            if (probes[j].state == PROBE_ANSWERED &&
+                same_address(&probes[j].responder, probes[i].responder.type, address_bytes(&probes[i].responder))) {
+                printed[j] = 1;
+                flows++;
+                total_rtt += probes[j].rtt;
+                min_rtt = (probes[j].rtt < min_rtt) ? probes[j].rtt : min_rtt;
+            }
+        }
+
+        char host[HOST_STRLEN];
+        format_host(&probes[i].responder, host, sizeof(host));
+
+        if (interfaces++ == 0) {
+            printf("%2d  ", ttl);
+        }
+
+        else {
+            printf("    ");
+        }
+
+        printf("%-15s  %2d/%d flows  %.3f/%.3fms  (%s)\n", host, flows, num_probes, min_rtt, total_rtt / flows,
+               timestamp_source_name(probes[i].source));
+    }
+
+    if (interfaces == 0) {
+        printf("%2d  * * *\n", ttl);
+    }
+
+    if (capturing) {
+        capture_hop(ttl, probes, num_probes);
+    }
+}
+
+/**
+ * Traces all the load-balanced paths to the destination (Multipath Detection Algorithm).
+ * Each TTL is probed with a growing number of flows, until enough probes were answered to
+ * rule out one more interface than the ones seen at this TTL with 95% confidence.
+ * @param sockfd The socket file descriptor
+ * @param dest_addr Pointer to the destination address
+ * @return 0 on success, or 1 on error
+ */
+int trace_multipath(int sockfd, struct net_addr *dest_addr) {
+    // Number of probes needed to rule out a (k + 1)-th interface after seeing k of them, at 95% confidence
+    static const int stop_probes[MDA_MAX_INTERFACES + 1] = {6, 6, 11, 16, 21, 27, 33, 38, 44, 51, 57, 63, 70, 76, 83, 90, 96};
+
+    for (int ttl = 1; ttl <= MAX_HOPS; ttl++) {
+        struct hop_probe probes[MDA_MAX_PROBES]; // Probe of flow i is at flow_id + i
+        int num_probes = 0; // Number of probes sent
+        int needed = stop_probes[0]; // Number of probes to send before stopping
+        int reached_dest = 1; // Whether all the flows reached the destination
+
+        while (num_probes < needed) {
+            // Send the missing probes at once, one per flow
+            int first = num_probes;
+
+            while (num_probes < needed) {
+                start_probe(sockfd, dest_addr, &probes[num_probes], ttl, (flow_id + num_probes) & 0xFFFF);
+                num_probes++;
+            }
+
+            // Wait for their replies
+            for (int i = first; i < num_probes; i++) {
+                if (wait_replies(probes[i].send_time + TIMEOUT * 1000.0, &probes[i]) != 0) {
+                    return 1;
+                }
+
+                if (probes[i].state == PROBE_PENDING) {
+                    expire_probe(&probes[i]);
+                }
+            }
+
+            // Count the interfaces seen so far
+            int interfaces = 0;
+
+            for (int i = 0; i < num_probes; i++) {
+                int seen = (probes[i].state != PROBE_ANSWERED);
+
+                for (int j = 0; j < i && !seen; j++) {
+                    seen = (probes[j].state == PROBE_ANSWERED &&
+                            same_address(&probes[j].responder, probes[i].responder.type, address_bytes(&probes[i].responder)));
+                }
+
+                interfaces += !seen;
+            }
+
+            needed = stop_probes[(interfaces < MDA_MAX_INTERFACES) ? interfaces : MDA_MAX_INTERFACES];
+        }
+
+        for (int i = 0; i < num_probes; i++) {
+            reached_dest = reached_dest && reached_destination(&probes[i], dest_addr);
+        }
+
+        print_multipath_hop(ttl, probes, num_probes);
+
+        if (reached_dest) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Hashes a (TTL, address) pair of the stop set (FNV-1a, continued over the TTL).
+ * @param ttl The TTL
+ * @param addr Pointer to the address
+ * @return The hash
+ */
+unsigned int hash_stop(int ttl, const struct net_addr *addr) {
+    return (hash_address(addr->type, address_bytes(addr)) ^ (unsigned int)ttl) * 16777619u;
+}
+
+/**
+ * Finds the slot of an interface in the stop set (open addressing with linear probing).
+ * @param ttl TTL at which the interface replied
+ * @param addr Pointer to the address of the interface
+ * @return The slot of the interface, or the free slot where it would go
+ */
+struct stop_entry *find_stop(int ttl, const struct net_addr *addr) {
+    unsigned int mask = stop_set_size - 1;
+    unsigned int i = hash_stop(ttl, addr) & mask;
+
+    while (stop_set[i].owner != NULL && (stop_set[i].ttl != ttl || !same_address(&stop_set[i].addr, addr->type, address_bytes(addr)))) {
+        i = (i + 1) & mask;
+    }
+
+    return &stop_set[i];
+}
+
+/**
+ * Adds the routers that replied at a hop of a trace to the stop set, so later traces crossing
+ * one of them at the same TTL can stop probing backward and reuse the hops below.
+ * @param trace Pointer to the trace
+ * @param ttl TTL of the hop
+ */
+void record_hop(struct trace *trace, int ttl) {
+    struct hop_probe *hop = &trace->probes[(ttl - 1) * TRIES_PER_HOP];
+
+    for (int try = 0; try < TRIES_PER_HOP; try++) {
+        if (hop[try].state != PROBE_ANSWERED || reached_destination(&hop[try], &trace->dest)) {
+            continue; // Destinations are never on the path to another destination
+        }
+
+        struct stop_entry *entry = find_stop(ttl, &hop[try].responder);
+
+        if (entry->owner == NULL) {
+            entry->owner = trace;
+            entry->ttl = ttl;
+            entry->addr = hop[try].responder;
+        }
+    }
+}
+
+/**
+ * Adds a pending probe to the timer wheel, in the slot of the tick by which it times out.
+ * The wheel spans more than TIMEOUT, so a slot holds only the probes of a single tick.
+ * @param probe Pointer to the probe
+ */
+void wheel_add(struct hop_probe *probe) {
+    long tick = (long)((probe->send_time + TIMEOUT * 1000.0) / WHEEL_TICK) + 1;
+    struct hop_probe **slot = &timer_wheel[tick % WHEEL_SLOTS];
+
+    probe->timer_next = *slot;
+    *slot = probe;
+}
+
+/**
+ * Advances the timer wheel to the given time, timing out the probes still pending in the slots it goes through.
+ * @param now Monotonic time, in milliseconds
+ */
+void wheel_advance(double now) {
+    long tick = (long)(now / WHEEL_TICK);
+
+    for (; wheel_tick <= tick; wheel_tick++) {
+        struct hop_probe *probe = timer_wheel[wheel_tick % WHEEL_SLOTS];
+        timer_wheel[wheel_tick % WHEEL_SLOTS] = NULL;
+
+        while (probe != NULL) {
+            struct hop_probe *next = probe->timer_next;
+
+            if (probe->state == PROBE_PENDING) {
+                expire_probe(probe);
+            }
+
+            probe = next;
+        }
+    }
+}
+
+/**
+ * Checks whether all the probes of a hop of a trace are answered or timed out.
+ * @param trace Pointer to the trace
+ * @param ttl TTL of the hop
+ * @return 1 if the hop is complete, 0 otherwise
+ */
+int hop_complete(struct trace *trace, int ttl) {
+    struct hop_probe *hop = &trace->probes[(ttl - 1) * TRIES_PER_HOP];
+
+    for (int try = 0; try < TRIES_PER_HOP; try++) {
+        if (hop[try].state == PROBE_UNSENT || hop[try].state == PROBE_PENDING) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Picks the next probe a trace wants to send: the forward phase probes up to `window` TTLs
+ * past the first incomplete one, and the backward phase probes one TTL at a time.
+ * @param trace Pointer to the trace
+ * @param window Number of TTLs of the forward phase probed at the same time
+ * @param ttl Receives the TTL of the probe
+ * @return Pointer to the probe, or NULL if the trace has nothing to send for now
+ */
+struct hop_probe *next_probe(struct trace *trace, int window, int *ttl) {
+    while (trace->next_ttl <= trace->end_ttl && trace->next_ttl < trace->forward_ttl + window) {
+        struct hop_probe *hop = &trace->probes[(trace->next_ttl - 1) * TRIES_PER_HOP];
+
+        for (int try = 0; try < TRIES_PER_HOP; try++) {
+            if (hop[try].state == PROBE_UNSENT) {
+                *ttl = trace->next_ttl;
+                return &hop[try];
+            }
+        }
+
+        trace->next_ttl++;
+    }
+
+    if (trace->back_ttl > 0) {
+        struct hop_probe *hop = &trace->probes[(trace->back_ttl - 1) * TRIES_PER_HOP];
+
+        for (int try = 0; try < TRIES_PER_HOP; try++) {
+            if (hop[try].state == PROBE_UNSENT) {
+                *ttl = trace->back_ttl;
+                return &hop[try];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Updates a trace after some of its probes were answered or timed out (Doubletree):
+ * the forward phase stops at the destination or after GAP_LIMIT silent hops, and the backward
+ * phase stops at the first router already seen at the same TTL by another trace, whose hops below are reused.
+ * @param trace Pointer to the trace
+ * @return 1 if the trace is done probing, 0 otherwise
+ */
+int advance_trace(struct trace *trace) {
+    trace->dirty = 0;
+
+    // Lower the end TTL as soon as the destination replied to a probe of the forward phase
+    for (int ttl = trace->forward_ttl; ttl <= trace->next_ttl && ttl < trace->end_ttl; ttl++) {
+        for (int try = 0; try < TRIES_PER_HOP; try++) {
+            if (reached_destination(&trace->probes[(ttl - 1) * TRIES_PER_HOP + try], &trace->dest)) {
+                trace->end_ttl = ttl;
+            }
+        }
+    }
+
+    // Move the forward phase past the complete hops
+    while (trace->forward_ttl <= trace->end_ttl && hop_complete(trace, trace->forward_ttl)) {
+        struct hop_probe *hop = &trace->probes[(trace->forward_ttl - 1) * TRIES_PER_HOP];
+        int answered = 0;
+
+        for (int try = 0; try < TRIES_PER_HOP; try++) {
+            answered = answered || (hop[try].state == PROBE_ANSWERED);
+        }
+
+        trace->silent = answered ? 0 : trace->silent + 1;
+
+        if (trace->silent >= GAP_LIMIT) {
+            trace->end_ttl = trace->forward_ttl; // Give up on a destination that doesn't reply
+        }
+
+        record_hop(trace, trace->forward_ttl++);
+    }
+
+    // Move the backward phase down the complete hops
+    while (trace->back_ttl > 0 && hop_complete(trace, trace->back_ttl)) {
+        struct hop_probe *hop = &trace->probes[(trace->back_ttl - 1) * TRIES_PER_HOP];
+        struct trace *owner = NULL;
+        int reached_dest = 0;
+
+        for (int try = 0; try < TRIES_PER_HOP; try++) {
+            if (hop[try].state != PROBE_ANSWERED) {
+                continue;
+            }
+
+            if (reached_destination(&hop[try], &trace->dest)) {
+                reached_dest = 1;
+                continue;
+            }
+
+            struct stop_entry *entry = find_stop(trace->back_ttl, &hop[try].responder);
+
+            if (entry->owner != NULL && entry->owner != trace) {
+                owner = entry->owner;
+            }
+        }
+
+        if (reached_dest) {
+            trace->end_ttl = trace->back_ttl; // The destination is closer than the first TTL
+        }
+
+        else if (owner != NULL) {
+            trace->borrow_ttl = trace->back_ttl; // Same router at the same TTL: same path below
+            trace->owner = owner;
+            trace->back_ttl = 0;
+            break;
+        }
+
+        else {
+            record_hop(trace, trace->back_ttl);
+        }
+
+        trace->back_ttl--;
+    }
+
+    return trace->forward_ttl > trace->end_ttl && trace->back_ttl == 0;
+}
+
+/**
+ * Checks whether a trace can be printed: it's done probing, and so are the traces it borrows hops from.
+ * @param trace Pointer to the trace
+ * @return 1 if the trace can be printed, 0 otherwise
+ */
+int trace_printable(struct trace *trace) {
+    return trace->state >= TRACE_PROBED && (trace->owner == NULL || trace_printable(trace->owner));
+}
+
+/**
+ * Gets the probes of a hop of a trace, from the trace that discovered them if the hop is below its borrow TTL.
+ * @param trace Pointer to the trace
+ * @param ttl TTL of the hop
+ * @return The probes of the hop (TRIES_PER_HOP of them)
+ */
+struct hop_probe *trace_hop(struct trace *trace, int ttl) {
+    while (ttl < trace->borrow_ttl) {
+        trace = trace->owner;
+    }
+
+    return &trace->probes[(ttl - 1) * TRIES_PER_HOP];
+}
+
+/**
+ * Prints a trace, taking the hops below its borrow TTL from the trace that discovered them.
+ * @param trace Pointer to the trace
+ */
+void print_trace(struct trace *trace) {
+    char host[HOST_STRLEN];
+    format_host(&trace->dest, host, sizeof(host));
+    printf("traceroute to %s, %d hops max, %d byte packets\n", host, MAX_HOPS, packet_size);
+
+    if (capturing) {
+        capture_target = capture_address(&writer, &trace->dest);
+    }
+
+    for (int ttl = 1; ttl <= trace->end_ttl; ttl++) {
+        print_hop(ttl, trace_hop(trace, ttl));
+    }
+
+    printf("\n");
+    fflush(stdout); // Stream the traces out as they finish
+    trace->state = TRACE_PRINTED;
+}
+
+/**
+ * Traces the routes to many destinations at once over one socket.
+ * Up to MAX_ACTIVE_TRACES traces run at the same time; an event loop sends their probes within
+ * a global rate and a per-TTL rate (token buckets), routes the replies to them, and times out
+ * the lost probes with a timer wheel. Each trace is printed as soon as it's done, unless the options are quiet.
+ * @param socks The IPv4 and IPv6 socket file descriptors (-1 when no destination is of that type)
+ * @param traces The traces, one per destination
+ * @param num_traces Number of traces
+ * @param options Options of the multi-destination mode
+ * @return 0 on success, or 1 on error
+ */
+int trace_many(int socks[2], struct trace *traces, int num_traces, struct multi_options *options) {
+    // Size the stop set for every probe of every trace, at a load factor of 1/2 at most
+    for (stop_set_size = 1; stop_set_size < 2u * num_traces * MAX_HOPS * TRIES_PER_HOP; stop_set_size *= 2);
+    stop_set = calloc(stop_set_size, sizeof(struct stop_entry));
+
+    struct trace **active = calloc(MAX_ACTIVE_TRACES, sizeof(struct trace *)); // Traces being probed
+    struct trace **probed = calloc(num_traces, sizeof(struct trace *)); // Traces waiting for the traces they borrow from
+
+    if (stop_set == NULL || active == NULL || probed == NULL) {
+        perror("trace_many");
+        free(stop_set);
+        free(active);
+        free(probed);
+        return 1;
+    }
+
+    // Token buckets, refilled every tick
+    double burst = (options->rate * WHEEL_TICK / 1000.0 > 1) ? options->rate * WHEEL_TICK / 1000.0 : 1;
+    double hop_burst = (options->hop_rate * WHEEL_TICK / 1000.0 > 1) ? options->hop_rate * WHEEL_TICK / 1000.0 : 1;
+    double tokens = burst;
+    double hop_tokens[MAX_HOPS + 1];
+
+    for (int ttl = 0; ttl <= MAX_HOPS; ttl++) {
+        hop_tokens[ttl] = hop_burst;
+    }
+
+    double last_refill = monotonic_time_ms();
+    wheel_tick = (long)(last_refill / WHEEL_TICK);
+    memset(timer_wheel, 0, sizeof(timer_wheel)); // Forget the probes of a previous call, even the answered ones
+
+    int queued = 0, num_active = 0, num_probed = 0, printed = 0, next_active = 0;
+    int ret = 0;
+
+    while (printed < num_traces && ret == 0) {
+        double now = monotonic_time_ms();
+        wheel_advance(now); // Time out the lost probes
+
+        // Refill the token buckets
+        double elapsed = (now - last_refill) / 1000.0;
+        last_refill = now;
+        tokens = (tokens + options->rate * elapsed < burst) ? tokens + options->rate * elapsed : burst;
+
+        for (int ttl = 1; ttl <= MAX_HOPS; ttl++) {
+            hop_tokens[ttl] = (hop_tokens[ttl] + options->hop_rate * elapsed < hop_burst) ?
+                              hop_tokens[ttl] + options->hop_rate * elapsed : hop_burst;
+        }
+
+        // Advance the traces whose probes were answered or timed out
+        for (int i = 0; i < num_active; i++) {
+            struct trace *trace = active[i];
+
+            if (!trace->dirty || !advance_trace(trace)) {
+                continue;
+            }
+
+            // Done probing: forget the probes past the end that are still in flight
+            for (int j = 0; j < MAX_HOPS * TRIES_PER_HOP; j++) {
+                if (trace->probes[j].state == PROBE_PENDING) {
+                    expire_probe(&trace->probes[j]);
+                }
+            }
+
+            trace->state = TRACE_PROBED;
+            probed[num_probed++] = trace;
+            active[i--] = active[--num_active];
+        }
+
+        // Print the traces whose hops are all known, as they finish
+        for (int i = 0; i < num_probed; i++) {
+            if (trace_printable(probed[i])) {
+                if (options->quiet) {
+                    probed[i]->state = TRACE_PRINTED;
+                }
+
+                else {
+                    print_trace(probed[i]);
+                }
+
+                printed++;
+                probed[i] = probed[--num_probed];
+                i = -1; // Printing one trace may make the ones borrowing from it printable
+            }
+        }
+
+        // Start new traces in place of the finished ones
+        while (queued < num_traces && num_active < MAX_ACTIVE_TRACES) {
+            struct trace *trace = &traces[queued++];
+            trace->state = TRACE_ACTIVE;
+            trace->next_ttl = options->first_ttl;
+            trace->forward_ttl = options->first_ttl;
+            trace->end_ttl = MAX_HOPS;
+            trace->back_ttl = options->first_ttl - 1;
+            active[num_active++] = trace;
+        }
+
+        // Send probes round-robin over the active traces, while there are tokens left
+        int sent = 1;
+
+        while (sent && tokens >= 1) {
+            sent = 0;
+
+            for (int n = 0; n < num_active && tokens >= 1; n++) {
+                struct trace *trace = active[(next_active + n) % num_active];
+                int ttl;
+                struct hop_probe *probe = next_probe(trace, options->window, &ttl);
+
+                if (probe == NULL || hop_tokens[ttl] < 1) {
+                    continue;
+                }
+
+                start_probe(socks[trace->dest.type == 6], &trace->dest, probe, ttl, flow_id);
+                probe->trace = trace;
+                trace->dirty |= (probe->state != PROBE_PENDING); // A failed send counts as a lost probe
+
+                if (probe->state == PROBE_PENDING) {
+                    wheel_add(probe);
+                }
+
+                tokens--;
+                hop_tokens[ttl]--;
+                sent = 1;
+            }
+
+            next_active = (num_active > 0) ? (next_active + 1) % num_active : 0;
+        }
+
+        if (printed >= num_traces) {
+            break;
+        }
+
+        // Send the probes of this round, and wait for replies until the next tick of the timer wheel
+        if (engine_wait(wheel_tick * WHEEL_TICK) != 0 || receive_replies() != 0) {
+            ret = 1;
+        }
+    }
+
+    free(stop_set);
+    free(active);
+    free(probed);
+    return ret;
+}
+
+/**
+ * Handles SIGINT and SIGTERM in the monitor mode: stops the rounds, so the summary is printed.
+ * @param signum The signal number
+ */
+void stop_monitor(int signum) {
+    (void)signum;
+    keep_running = 0;
+}
+
+/**
+ * Records the path found by a full trace as the last known path to its destination.
+ * @param path Pointer to the path
+ * @param trace Pointer to the trace, done probing
+ */
+void load_path(struct path *path, struct trace *trace) {
+    path->hops = trace->end_ttl;
+    path->reached = 0;
+    path->rtt = -1;
+    memset(path->responders, 0, sizeof(path->responders));
+
+    for (int ttl = 1; ttl <= trace->end_ttl; ttl++) {
+        struct hop_probe *hop = trace_hop(trace, ttl);
+
+        for (int i = 0; i < TRIES_PER_HOP; i++) {
+            if (hop[i].state != PROBE_ANSWERED) {
+                continue;
+            }
+
+            if (path->responders[ttl - 1].type == 0) {
+                path->responders[ttl - 1] = hop[i].responder;
+            }
+
+            if (reached_destination(&hop[i], &trace->dest)) {
+                path->reached = 1;
+                path->rtt = (path->rtt < 0 || hop[i].rtt < path->rtt) ? hop[i].rtt : path->rtt;
+            }
+        }
+    }
+
+    path->losses = 0;
+    path->rtt_shifts = 0;
+}
+
+/**
+ * Checks whether a round-trip time is off its baseline: by more than MONITOR_RTT_MARGIN,
+ * and by more than a factor of MONITOR_RTT_FACTOR either way.
+ * @param baseline The baseline round-trip time, in milliseconds
+ * @param rtt The round-trip time, in milliseconds
+ * @return 1 if the round-trip time is off, 0 otherwise
+ */
+int rtt_shifted(double baseline, double rtt) {
+    double diff = (rtt > baseline) ? rtt - baseline : baseline - rtt;
+    return diff > MONITOR_RTT_MARGIN && (rtt > baseline * MONITOR_RTT_FACTOR || rtt * MONITOR_RTT_FACTOR < baseline);
+}
+
+/**
+ * Picks the hop a round samples on a path: the next answered hop before the destination, round-robin.
+ * @param path Pointer to the path
+ * @return TTL of the hop, or 0 if no hop before the destination ever answered
+ */
+int pick_sample(struct path *path) {
+    int last = path->reached ? path->hops - 1 : path->hops; // Last hop that isn't the destination
+
+    for (int n = 1; n <= last; n++) {
+        int ttl = (path->sample_ttl + n - 1) % last + 1;
+
+        if (path->responders[ttl - 1].type != 0) {
+            return ttl;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Sends the probes of a round of the monitor mode, within the overall rate, and waits for their replies.
+ * Each path gets a probe at the destination's hop (MAX_HOPS if the destination wasn't reached)
+ * and one at its sampled hop. The probes still unanswered after TIMEOUT are given up.
+ * @param socks The IPv4 and IPv6 socket file descriptors
+ * @param paths The paths
+ * @param num_paths Number of paths
+ * @param rate Probes per second, overall
+ * @return 0 on success, or 1 on error
+ */
+int check_paths(int socks[2], struct path *paths, int num_paths, int rate) {
+    // Token bucket, refilled with the time elapsed since the last refill (see trace_many)
+    double burst = (rate * WHEEL_TICK / 1000.0 > 1) ? rate * WHEEL_TICK / 1000.0 : 1;
+    double tokens = burst;
+    double last_refill = monotonic_time_ms();
+    int next = 0; // Next probe to send: the probes of path i are 2 * i and 2 * i + 1
+    double deadline = 0; // Time the last probe times out, once all are sent
+
+    while (1) {
+        double now = monotonic_time_ms();
+        tokens = (tokens + rate * (now - last_refill) / 1000.0 < burst) ? tokens + rate * (now - last_refill) / 1000.0 : burst;
+        last_refill = now;
+
+        for (; tokens >= 1 && next < 2 * num_paths; next++) {
+            struct path *path = &paths[next / 2];
+            struct hop_probe *probe = &path->checks[next % 2];
+            int ttl = (next % 2 == 0) ? (path->reached ? path->hops : MAX_HOPS) : path->sample_ttl;
+
+            if (ttl == 0) {
+                probe->state = PROBE_UNSENT; // Nothing to sample
+                continue;
+            }
+
+            start_probe(socks[path->dest.type == 6], &path->dest, probe, ttl, flow_id);
+            tokens--;
+        }
+
+        int pending = 0;
+
+        for (int i = 0; i < 2 * num_paths && !pending; i++) {
+            pending = (paths[i / 2].checks[i % 2].state == PROBE_PENDING);
+        }
+
+        if (next == 2 * num_paths) {
+            if (deadline == 0) {
+                deadline = now + TIMEOUT * 1000;
+            }
+
+            if (!pending || now >= deadline) {
+                break;
+            }
+        }
+
+        if (engine_wait((next < 2 * num_paths) ? now + WHEEL_TICK : deadline) != 0 || receive_replies() != 0) {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < 2 * num_paths; i++) {
+        if (paths[i / 2].checks[i % 2].state == PROBE_PENDING) {
+            expire_probe(&paths[i / 2].checks[i % 2]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Compares the replies of a round to the last known path, and decides whether it must be traced again:
+ * when a router answers at the destination's hop or the destination at an earlier one (the hop count changed),
+ * when the sampled hop is answered by another router (a responder changed), when the destination stops answering
+ * for MONITOR_LOSS_ROUNDS rounds or answers again, or when its round-trip time is off its baseline for
+ * MONITOR_RTT_ROUNDS rounds (the RTT profile changed).
+ * @param path Pointer to the path, whose trigger is set
+ * @return 1 if the path must be traced again, 0 otherwise
+ */
+int check_path(struct path *path) {
+    struct hop_probe *dest = &path->checks[0];
+    struct hop_probe *sample = &path->checks[1];
+    char host[HOST_STRLEN];
+    path->trigger[0] = '\0';
+
+    if (!path->reached) {
+        if (reached_destination(dest, &path->dest)) {
+            snprintf(path->trigger, sizeof(path->trigger), "destination answered");
+        }
+    }
+
+    else if (reached_destination(dest, &path->dest)) {
+        path->losses = 0;
+        path->rtt_shifts = rtt_shifted(path->rtt, dest->rtt) ? path->rtt_shifts + 1 : 0;
+
+        if (path->rtt_shifts >= MONITOR_RTT_ROUNDS) {
+            snprintf(path->trigger, sizeof(path->trigger), "rtt %.3fms, baseline %.3fms", dest->rtt, path->rtt);
+        }
+    }
+
+    else if (dest->state == PROBE_ANSWERED) {
+        format_host(&dest->responder, host, sizeof(host));
+        snprintf(path->trigger, sizeof(path->trigger), "hop %d answered by %s", path->hops, host);
+    }
+
+    else if (++path->losses >= MONITOR_LOSS_ROUNDS) {
+        snprintf(path->trigger, sizeof(path->trigger), "no reply for %d rounds", path->losses);
+    }
+
+    // A silent sampled hop is no news: routers rate-limit their errors
+    if (path->trigger[0] == '\0' && sample->state == PROBE_ANSWERED) {
+        if (reached_destination(sample, &path->dest)) {
+            snprintf(path->trigger, sizeof(path->trigger), "destination answered at hop %d", sample->ttl);
+        }
+
+        else if (!same_address(&sample->responder, path->responders[sample->ttl - 1].type,
+                               address_bytes(&path->responders[sample->ttl - 1]))) {
+            format_host(&sample->responder, host, sizeof(host));
+            snprintf(path->trigger, sizeof(path->trigger), "hop %d answered by %s", sample->ttl, host);
+        }
+    }
+
+    return path->trigger[0] != '\0';
+}
+
+/**
+ * Prints an event of the monitor mode, with the wall-clock time and the destination it's about.
+ * @param dest Pointer to the destination address
+ * @param format printf(3) format of the event, followed by its arguments
+ */
+void print_event(const struct net_addr *dest, const char *format, ...) {
+    struct timespec now;
+    char host[HOST_STRLEN];
+    va_list args;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    format_host(dest, host, sizeof(host));
+    printf("[%ld.%06ld] %s: ", (long)now.tv_sec, now.tv_nsec / 1000, host);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+/**
+ * Formats the first responder of a hop of a path for a diff: "*" if the hop was silent, "-" if it's past the end.
+ * @param path Pointer to the path
+ * @param ttl TTL of the hop
+ * @param buffer The buffer to write to
+ * @param size Size of the buffer
+ * @return The buffer
+ */
+char *format_responder(struct path *path, int ttl, char *buffer, size_t size) {
+    if (ttl > path->hops) {
+        snprintf(buffer, size, "-");
+    }
+
+    else if (path->responders[ttl - 1].type == 0) {
+        snprintf(buffer, size, "*");
+    }
+
+    else {
+        format_host(&path->responders[ttl - 1], buffer, size);
+    }
+
+    return buffer;
+}
+
+/**
+ * Prints what a full trace changed in the last known path to its destination, and makes it the last known path.
+ * Silent hops aren't compared to answered ones, unless one of them is past the end of the other path.
+ * @param path Pointer to the path, traced again because of its trigger
+ * @param trace Pointer to the trace, done probing
+ * @return 1 if the path changed, 0 otherwise
+ */
+int report_change(struct path *path, struct trace *trace) {
+    struct path *old = malloc(sizeof(struct path));
+
+    if (old == NULL) {
+        perror("report_change");
+        load_path(path, trace);
+        return 0;
+    }
+
+    *old = *path;
+    load_path(path, trace);
+    print_event(&path->dest, "re-traced (%s)", old->trigger);
+
+    if (capturing) {
+        capture_target = capture_address(&writer, &trace->dest);
+
+        for (int ttl = 1; ttl <= trace->end_ttl; ttl++) {
+            capture_hop(ttl, trace_hop(trace, ttl), TRIES_PER_HOP);
+        }
+    }
+
+    int changed = 0;
+    int last = (old->hops > path->hops) ? old->hops : path->hops;
+
+    for (int ttl = 1; ttl <= last; ttl++) {
+        int was = (ttl <= old->hops) ? old->responders[ttl - 1].type : -1; // -1 past the end, 0 silent
+        int is = (ttl <= path->hops) ? path->responders[ttl - 1].type : -1;
+        struct net_addr *addr = &path->responders[ttl - 1];
+
+        if ((was > 0 && is > 0) ? !same_address(&old->responders[ttl - 1], addr->type, address_bytes(addr)) :
+                                  ((was < 0 && is > 0) || (was > 0 && is < 0))) {
+            char from[HOST_STRLEN], to[HOST_STRLEN];
+            printf("  hop %d: %s -> %s\n", ttl, format_responder(old, ttl, from, sizeof(from)),
+                   format_responder(path, ttl, to, sizeof(to)));
+            changed = 1;
+        }
+    }
+
+    if (old->reached != path->reached) {
+        printf("  destination %s\n", path->reached ? "reachable again" : "unreachable");
+        changed = 1;
+    }
+
+    else if (old->hops != path->hops) {
+        printf("  length %d -> %d hops\n", old->hops, path->hops);
+        changed = 1;
+    }
+
+    if (old->reached && path->reached && rtt_shifted(old->rtt, path->rtt)) {
+        printf("  rtt %.3f -> %.3fms\n", old->rtt, path->rtt);
+        changed = 1;
+    }
+
+    if (!changed) {
+        printf("  no change\n");
+    }
+
+    path->sample_ttl = old->sample_ttl;
+    free(old);
+    return changed;
+}
+
+/**
+ * Monitors the paths to the destinations for changes (-i): traces them all once and prints the traces,
+ * then every interval sends each path a probe at the destination's hop and one at a sampled hop.
+ * Only the paths whose replies don't match (see check_path) are traced again, and what changed is printed.
+ * @param socks The IPv4 and IPv6 socket file descriptors
+ * @param traces The traces, one per destination
+ * @param num_traces Number of traces
+ * @param options Options of the multi-destination mode, used by the traces and the rounds
+ * @param interval Time between two rounds, in seconds
+ * @param rounds Number of rounds, or 0 to run until interrupted
+ * @return 0 on success, or 1 on error
+ */
+int monitor(int socks[2], struct trace *traces, int num_traces, struct multi_options *options, double interval, int rounds) {
+    struct path *paths = calloc(num_traces, sizeof(struct path)); // Last known paths, in the order of the traces
+    struct trace *batch = calloc(num_traces, sizeof(struct trace)); // Traces of the paths traced again in a round
+
+    if (paths == NULL || batch == NULL) {
+        perror("monitor");
+        free(paths);
+        free(batch);
+        return 1;
+    }
+
+    int ret = trace_many(socks, traces, num_traces, options);
+    unsigned long initial = probe_count; // Probes of a full trace of every destination
+    unsigned long checks = 0, retraces = 0; // Probes of the rounds and of the traces they triggered
+    int round = 0, changes = 0;
+
+    for (int i = 0; i < num_traces; i++) {
+        paths[i].dest = traces[i].dest;
+        load_path(&paths[i], &traces[i]);
+    }
+
+    options->quiet = 1; // The traces of the rounds are printed as diffs
+    double next_round = monotonic_time_ms() + interval * 1000;
+
+    while (ret == 0 && keep_running && (rounds == 0 || round < rounds)) {
+        // Sleep until the round, printing the names that arrive in the meantime
+        while (ret == 0 && keep_running && monotonic_time_ms() < next_round) {
+            if (engine_wait(next_round) != 0 || receive_replies() != 0) {
+                ret = 1;
+            }
+        }
+
+        if (ret != 0 || !keep_running) {
+            break;
+        }
+
+        // Keep the rounds on schedule, unless one ran past the next
+        next_round = (next_round + interval * 1000 > monotonic_time_ms()) ?
+                     next_round + interval * 1000 : monotonic_time_ms() + interval * 1000;
+        round++;
+
+        for (int i = 0; i < num_traces; i++) {
+            paths[i].sample_ttl = pick_sample(&paths[i]);
+        }
+
+        unsigned long before = probe_count;
+        ret = check_paths(socks, paths, num_traces, options->rate);
+        checks += probe_count - before;
+
+        int num_batch = 0;
+
+        for (int i = 0; i < num_traces && ret == 0; i++) {
+            if (check_path(&paths[i])) {
+                memset(&batch[num_batch], 0, sizeof(struct trace));
+                batch[num_batch++].dest = paths[i].dest;
+            }
+        }
+
+        if (num_batch > 0) {
+            before = probe_count;
+            ret = trace_many(socks, batch, num_batch, options);
+            retraces += probe_count - before;
+
+            // The batch holds the triggered paths in order
+            for (int i = 0, j = 0; i < num_traces && ret == 0; i++) {
+                if (paths[i].trigger[0] != '\0') {
+                    changes += report_change(&paths[i], &batch[j++]);
+                }
+            }
+
+            printf("\n"); // A blank line after the events of the round, as after a trace
+        }
+
+        fflush(stdout);
+    }
+
+    printf("--- %d path%s monitored ---\n", num_traces, (num_traces == 1) ? "" : "s");
+    printf("%d rounds, %lu probes (%lu checks, %lu re-traces), %d path changes\n", round, checks + retraces, checks,
+           retraces, changes);
+    printf("a full trace every round would have sent %lu probes\n", initial * round);
+
+    free(paths);
+    free(batch);
+    return ret;
+}
+
+/**
+ * Reads the destinations of the multi-destination mode from a file, one address per line.
+ * Blank lines and lines starting with '#' are skipped, and so are duplicate addresses.
+ * @param path Path to the file, or "-" for the standard input
+ * @param ip_type The IP type of the addresses (4, 6, or 0 to detect it from each address)
+ * @param traces Receives the array of traces, one per destination
+ * @param num_traces Receives the number of traces
+ * @return 0 on success, or 1 on error
+ */
+int read_trace_list(const char *path, int ip_type, struct trace **traces, int *num_traces) {
+    FILE *file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+
+    if (file == NULL) {
+        perror("fopen(3)");
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int capacity = 0;
+    int ret = 0;
+
+    *traces = NULL;
+    *num_traces = 0;
+
+    while (getline(&line, &line_size, file) != -1) {
+        char *addr = line + strspn(line, " \t"); // Skip the leading whitespace
+        addr[strcspn(addr, " \t\r\n")] = '\0'; // Cut the trailing whitespace
+
+        if (addr[0] == '\0' || addr[0] == '#') {
+            continue;
+        }
+
+        struct net_addr dest;
+
+        if (parse_address(ip_type, addr, &dest) != 0) {
+            ret = 1;
+            break;
+        }
+
+        int duplicate = 0;
+
+        for (int i = 0; i < *num_traces && !duplicate; i++) {
+            duplicate = same_address(&(*traces)[i].dest, dest.type, address_bytes(&dest));
+        }
+
+        if (duplicate) {
+            continue;
+        }
+
+        // Grow the array of traces
+        if (*num_traces == capacity) {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            struct trace *grown = realloc(*traces, capacity * sizeof(struct trace));
+
+            if (grown == NULL) {
+                perror("realloc");
+                ret = 1;
+                break;
+            }
+
+            *traces = grown;
+        }
+
+        struct trace *trace = &(*traces)[(*num_traces)++];
+        memset(trace, 0, sizeof(*trace));
+        trace->dest = dest;
+    }
+
+    free(line);
+
+    if (file != stdin) {
+        fclose(file);
+    }
+
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    char *address = NULL; // Destination address
+    char *list = NULL; // File with the destinations of the multi-destination mode
+    int window = 0; // Number of TTLs probed at the same time, 0 for the serial mode
+    int multipath = 0; // Whether to trace all the load-balanced paths
+    int ip_type = 0; // IP type of the destinations (4, 6, or 0 to detect it from the addresses)
+    int engine = ENGINE_POLL; // Backend of the sends and receives
+    struct multi_options multi = {
+        .window = MULTI_WINDOW,
+        .rate = MULTI_RATE,
+        .hop_rate = MULTI_HOP_RATE,
+        .first_ttl = MULTI_FIRST_TTL
+    };
+    char *hosts = NULL; // Hosts file the names are pre-warmed from (--hosts)
+    char *capture = NULL; // Capture file the probes are appended to (-w)
+    double interval = 0; // Time between two rounds of the monitor mode (-i), in seconds, 0 outside of it
+    int rounds = 0; // Number of rounds of the monitor mode (-c), 0 to run until interrupted
+    static const struct option long_options[] = {
+        {"hosts", required_argument, NULL, OPT_HOSTS},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    // Parse arguments
+    while ((opt = getopt_long(argc, argv, "a:t:p:l:r:R:H:F:mE:s:Nw:i:c:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            address = optarg;
+            break;
+        case 't':
+            ip_type = atoi(optarg);
+            if (ip_type != 4 && ip_type != 6) {
+                fprintf(stderr, "Invalid IP type. Must be 4 or 6\n");
+                return 1;
+            }
+            break;
+        case 'p':
+            window = atoi(optarg);
+            if (window <= 0 || window > MAX_HOPS) {
+                fprintf(stderr, "Window must be between 1 and %d\n", MAX_HOPS);
+                return 1;
+            }
+            multi.window = window;
+            break;
+        case 'l':
+            list = optarg;
+            break;
+        case 'r':
+            multi.rate = atoi(optarg);
+            if (multi.rate <= 0) {
+                fprintf(stderr, "Rate must be positive\n");
+                return 1;
+            }
+            break;
+        case 'R':
+            multi.hop_rate = atoi(optarg);
+            if (multi.hop_rate <= 0) {
+                fprintf(stderr, "Per-hop rate must be positive\n");
+                return 1;
+            }
+            break;
+        case 'H':
+            multi.first_ttl = atoi(optarg);
+            if (multi.first_ttl <= 0 || multi.first_ttl > MAX_HOPS) {
+                fprintf(stderr, "First TTL must be between 1 and %d\n", MAX_HOPS);
+                return 1;
+            }
+            break;
+        case 'F':
+            flow_id = atoi(optarg);
+            if (flow_id < 0 || flow_id > 0xFFFF) {
+                fprintf(stderr, "Flow must be between 0 and 65535\n");
+                return 1;
+            }
+            break;
+        case 'm':
+            multipath = 1;
+            break;
+        case 's':
+            packet_size = atoi(optarg);
+            if (packet_size < MIN_PACKET_SIZE || packet_size > MAX_PACKET_SIZE) {
+                fprintf(stderr, "Packet size must be between %d and %d\n", MIN_PACKET_SIZE, MAX_PACKET_SIZE);
+                return 1;
+            }
+            break;
+        case 'E':
+            engine = parse_engine(optarg);
+            if (engine < 0) {
+                fprintf(stderr, "Engine must be either poll or uring\n");
+                return 1;
+            }
+            break;
+        case 'N':
+            resolving = 1;
+            break;
+        case OPT_HOSTS:
+            hosts = optarg;
+            resolving = 1;
+            break;
+        case 'w':
+            capture = optarg;
+            break;
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0) {
+                fprintf(stderr, "Interval must be positive\n");
+                return 1;
+            }
+            break;
+        case 'c':
+            rounds = atoi(optarg);
+            if (rounds <= 0) {
+                fprintf(stderr, "Rounds must be positive\n");
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -a <address> [-t type] [-p window | -m] [-F flow] [-s size] [-E poll|uring] [-N [--hosts file]] [-w file] [-i interval [-c rounds]]\n"
+                            "       %s -l <file> [-t type] [-p window] [-r rate] [-R hop_rate] [-H first_ttl] [-F flow] [-s size] [-E poll|uring] [-N [--hosts file]] [-w file] [-i interval [-c rounds]]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    // Check arguments and usage
+    if ((address == NULL) == (list == NULL) || (multipath && (list != NULL || window > 0 || interval > 0)) ||
+        (rounds > 0 && interval == 0) || optind != argc) {
+        printf("Invalid arguments.\n");
+        return 1;
+    }
+
+    struct trace *traces = NULL; // Traces of the multi-destination mode
+    int num_traces = 0;
+    struct net_addr dest_addr; // Destination address of the single-destination modes
+
+    if (list != NULL) {
+        if (read_trace_list(list, ip_type, &traces, &num_traces) != 0) {
+            free(traces);
+            return 1;
+        }
+
+        if (num_traces == 0) {
+            fprintf(stderr, "No destinations to trace\n");
+            free(traces);
+            return 1;
+        }
+    }
+
+    else if (parse_address(ip_type, address, &dest_addr) != 0) {
+        return 1;
+    }
+
+    // The monitor mode runs on the multi-destination engine, with one destination if need be
+    else if (interval > 0) {
+        traces = calloc(1, sizeof(struct trace));
+
+        if (traces == NULL) {
+            perror("calloc");
+            return 1;
+        }
+
+        traces[0].dest = dest_addr;
+        num_traces = 1;
+    }
+
+    probe_id = htons(getpid()); // The ICMP identifier of all our probes
+
+    // The names are resolved by a pool of threads, so the hops are printed right away, with their name if it's known,
+    // and the names that arrive later are printed on their own lines
+    if (resolving && (resolver_start(RESOLVER_THREADS, 1) != 0 || (hosts != NULL && resolver_load_hosts(hosts) != 0))) {
+        free(traces);
+        return 1;
+    }
+
+    // The engine sends the probes queued between two waits together, and receives the replies in batches:
+    // the errors quoting the probes, and the echo replies as large as the probes
+    if (engine_open(engine, IO_BATCH, (packet_size + REPLY_HEADROOM > RECV_SIZE) ? packet_size + REPLY_HEADROOM : RECV_SIZE) < 0) {
+        free(traces);
+        return 1;
+    }
+
+    // Create one raw socket per IP type in use
+    int *socks = sockets; // IPv4 and IPv6 sockets
+
+    for (int i = 0; i < ((traces != NULL) ? num_traces : 1); i++) {
+        int type = (traces != NULL) ? traces[i].dest.type : dest_addr.type;
+        int *sock = &socks[type == 6];
+
+        if (*sock >= 0) {
+            continue;
+        }
+
+        *sock = create_socket(type);
+
+        // Drop the ICMP packets that aren't about our probes in the kernel, so the other instances don't wake us up
+        if (*sock < 0 || attach_probe_filter(*sock, type, probe_id) != 0 || engine_watch(*sock, 1) != 0) {
+            for (int v6 = 0; v6 < 2; v6++) {
+                if (socks[v6] >= 0) {
+                    close(socks[v6]);
+                }
+            }
+
+            free(traces);
+            return 1;
+        }
+
+        // Ask for kernel timestamps, otherwise the round-trip times are measured with the monotonic clock
+        timestamping = (enable_timestamping(*sock) == 0);
+    }
+
+    // The probe loops wake up to print the names that arrive late
+    if (resolving && engine_watch(resolver_fd(), 0) != 0) {
+        free(traces);
+        return 1;
+    }
+
+    build_probe_templates();
+
+    // The capture records are buffered, and written out when the buffer is full and at the end
+    if (capture != NULL) {
+        if (capture_open(&writer, capture, CAPTURE_TOOL_TRACEROUTE, multipath ? CAPTURE_MULTIPATH : 0, packet_size,
+                         (traces != NULL) ? num_traces : 1, TIMEOUT * 1000) != 0) {
+            free(traces);
+            return 1;
+        }
+
+        capturing = 1;
+    }
+
+    if (traces != NULL) {
+        int ret;
+
+        if (interval > 0) {
+            // Stop the rounds on SIGINT and SIGTERM rather than exit, so the summary is printed
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = stop_monitor;
+            sigaction(SIGINT, &action, NULL);
+            sigaction(SIGTERM, &action, NULL);
+            ret = monitor(socks, traces, num_traces, &multi, interval, rounds);
+        }
+
+        else {
+            ret = trace_many(socks, traces, num_traces, &multi);
+        }
+
+        if (resolving) {
+            wait_late_names();
+        }
+
+        if (capturing && capture_close(&writer) != 0) {
+            ret = 1;
+        }
+
+        engine_close();
+        free(traces);
+
+        for (int v6 = 0; v6 < 2; v6++) {
+            if (socks[v6] >= 0) {
+                close(socks[v6]);
+            }
+        }
+
+        return ret;
+    }
+
+    int sockfd = socks[dest_addr.type == 6];
+
+    char host[HOST_STRLEN];
+    format_host(&dest_addr, host, sizeof(host));
+    printf("traceroute to %s, %d hops max, %d byte packets\n", host, MAX_HOPS, packet_size);
+
+    if (capturing) {
+        capture_target = capture_address(&writer, &dest_addr);
+    }
+
+    int ret;
+
+    if (multipath) {
+        ret = trace_multipath(sockfd, &dest_addr);
+    }
+
+    else {
+        ret = (window > 0) ? trace_parallel(sockfd, &dest_addr, window) : trace_serial(sockfd, &dest_addr);
+    }
+
+    if (resolving) {
+        wait_late_names();
+    }
+
+    if (capturing && capture_close(&writer) != 0) {
+        ret = 1;
+    }
+
+    // Close the engine and the socket, and return to the operating system
+    engine_close();
+    close(sockfd);
+    return ret;
+}
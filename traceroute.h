@@ -1,15 +1,99 @@
 #ifndef _TRACEROUTE_H
 #define _TRACEROUTE_H
 
-#define PACKET_SIZE 64
+#define PACKET_SIZE 64 // Default size of the probes (ICMP header and payload)
+#define MIN_PACKET_SIZE 10 // Smallest probe: the ICMP header and the word balancing its checksum
+#define MAX_PACKET_SIZE (65535 - 20) // Largest probe, in an IPv4 packet without options
 #define MAX_HOPS 30
 #define TRIES_PER_HOP 3
 #define TIMEOUT 1 // seconds
+#define RECV_SIZE 1500 // Large enough for ICMP errors quoting the probe
+#define REPLY_HEADROOM 60 // Room for the IP header (with options) of an echo reply, on top of the probe
+#define PROBE_TABLE_SIZE 65536 // One entry per sequence number
+#define IO_BATCH 64 // Probes sent and replies received per system call (poll engine)
+#define OPT_HOSTS 256 // getopt_long value of --hosts, past the values of the single-character options
+
+// Flows
+#define DEFAULT_FLOW 0x2F1A // Flow identifier of the probes (their ICMP checksum), unless -F is given
+#define MDA_MAX_INTERFACES 16 // Interfaces per hop after which the multipath mode stops looking for more
+#define MDA_MAX_PROBES 96 // Probes per hop needed to rule out one more interface past MDA_MAX_INTERFACES
+
+// Multi-destination mode
+#define MULTI_WINDOW 4 // Default number of TTLs probed at the same time, per destination
+#define MULTI_RATE 2000 // Default probes per second, overall
+#define MULTI_HOP_RATE 500 // Default probes per second, per TTL
+#define MULTI_FIRST_TTL 8 // Default TTL at which the forward phase starts
+#define MAX_ACTIVE_TRACES 512 // Traces probed at the same time (keeps the outstanding probes below PROBE_TABLE_SIZE)
+#define GAP_LIMIT 5 // Number of consecutive silent hops after which a trace gives up
+#define WHEEL_TICK 10 // Tick of the timer wheel, in milliseconds
+#define WHEEL_SLOTS 256 // Slots of the timer wheel (must span more than TIMEOUT)
+
+// Monitor mode
+#define MONITOR_LOSS_ROUNDS 3 // Rounds without reply from the destination after which its path is traced again
+#define MONITOR_RTT_ROUNDS 3 // Rounds with a round-trip time off its baseline after which the path is traced again
+#define MONITOR_RTT_FACTOR 2 // A round-trip time is off its baseline when larger or smaller by this factor...
+#define MONITOR_RTT_MARGIN 1.0 // ...and by more than this many milliseconds
+
+// States of a trace in the multi-destination mode
+#define TRACE_QUEUED 0
+#define TRACE_ACTIVE 1
+#define TRACE_PROBED 2
+#define TRACE_PRINTED 3
+
+// States of a probe
+#define PROBE_UNSENT 0
+#define PROBE_PENDING 1
+#define PROBE_ANSWERED 2
+#define PROBE_TIMEOUT 3
+
+struct hop_probe;
+struct reply_info;
+struct trace;
+struct stop_entry;
+struct multi_options;
+struct path;
+struct net_addr;
 
 // Function declarations
-unsigned short calculate_checksum(unsigned short *addr, int len);
-double get_time_ms(void);
-int send_probe(int sockfd, struct sockaddr_in *dest_addr, int seq);
-void print_probe_results(int ttl, struct sockaddr_in *recv_addr, int replies, double times[]);
+void build_probe_templates(void);
+int send_probe(int sockfd, struct net_addr *dest_addr, int seq, unsigned int tag, int ttl, int flow);
+int parse_reply(int ip_type, const char *packet, int len, const struct net_addr *source, struct reply_info *info);
+int start_probe(int sockfd, struct net_addr *dest_addr, struct hop_probe *probe, int ttl, int flow);
+void expire_probe(struct hop_probe *probe);
+int receive_replies(void);
+int wait_replies(double deadline, struct hop_probe *probe);
+int reached_destination(struct hop_probe *probe, struct net_addr *dest_addr);
+void capture_hop(int ttl, struct hop_probe *probes, int num_probes);
+void print_hop(int ttl, struct hop_probe *hop);
+int trace_serial(int sockfd, struct net_addr *dest_addr);
+int trace_parallel(int sockfd, struct net_addr *dest_addr, int window);
+void print_multipath_hop(int ttl, struct hop_probe *probes, int num_probes);
+int trace_multipath(int sockfd, struct net_addr *dest_addr);
+unsigned int hash_stop(int ttl, const struct net_addr *addr);
+struct stop_entry *find_stop(int ttl, const struct net_addr *addr);
+void record_hop(struct trace *trace, int ttl);
+void wheel_add(struct hop_probe *probe);
+void wheel_advance(double now);
+int hop_complete(struct trace *trace, int ttl);
+struct hop_probe *next_probe(struct trace *trace, int window, int *ttl);
+int advance_trace(struct trace *trace);
+int trace_printable(struct trace *trace);
+struct hop_probe *trace_hop(struct trace *trace, int ttl);
+void print_trace(struct trace *trace);
+int trace_many(int socks[2], struct trace *traces, int num_traces, struct multi_options *options);
+void stop_monitor(int signum);
+void load_path(struct path *path, struct trace *trace);
+int rtt_shifted(double baseline, double rtt);
+int pick_sample(struct path *path);
+int check_paths(int socks[2], struct path *paths, int num_paths, int rate);
+int check_path(struct path *path);
+void print_event(const struct net_addr *dest, const char *format, ...);
+char *format_responder(struct path *path, int ttl, char *buffer, size_t size);
+int report_change(struct path *path, struct trace *trace);
+int monitor(int socks[2], struct trace *traces, int num_traces, struct multi_options *options, double interval, int rounds);
+int read_trace_list(const char *path, int ip_type, struct trace **traces, int *num_traces);
+void print_probe_results(int ttl, struct net_addr *recv_addr, int replies, double times[], int source);
+void print_late_names(void);
+void wait_late_names(void);
 
 #endif // _TRACEROUTE_H
\ No newline at end of file